@@ -0,0 +1,348 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+// On-target benchmark, run from the EFI shell (steamcl-bench.efi [-n RUNS]
+// [-v]): repeats handle enumeration, partition probing, bootconf parsing,
+// loader reads and the whole of choose_steamos_loader RUNS times without
+// ever starting a loader, then reports min/median/p99 TSC cycles for
+// each phase and the read throughput of each volume with a bootconf.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "err.h"
+#include "util.h"
+#include "arena.h"
+#include "timing.h"
+#include "fwtrace.h"
+#include "fileio.h"
+#include "config.h"
+#include "bootload.h"
+#include "partition.h"
+
+#define DEFAULT_RUNS 20
+#define MAX_RUNS 1000
+
+typedef enum
+{
+    PH_ENUM,   // LocateHandle for simple file systems
+    PH_PROBE,  // order the targets, mount them, look for a bootconf
+    PH_PARSE,  // parse every bootconf found
+    PH_READ,   // read every candidate's loader into memory
+    PH_SELECT, // choose_steamos_loader, start to finish
+    PH_MAX,
+} bench_phase;
+
+static CONST CHAR16 *phase_name[ PH_MAX ] =
+    { L"enum", L"probe", L"parse", L"read", L"select" };
+
+// per-volume loader read totals, over all runs:
+typedef struct
+{
+    EFI_HANDLE handle;
+    UINTN index;
+    UINT64 bytes;
+    UINT64 ticks;
+} volume_stats;
+
+static UINT64 cycles[ PH_MAX ][ MAX_RUNS ];
+static volume_stats volumes[ MAX_PROBE_TARGETS ];
+static UINTN n_volumes;
+
+// just the options we care about from the shell command line;
+// the first word is usually our own name, which is skipped like
+// anything else that isn't an option:
+static UINTN parse_options (EFI_HANDLE image, OUT UINTN *runs)
+{
+    EFI_GUID lip_guid = LOADED_IMAGE_PROTOCOL;
+    EFI_LOADED_IMAGE *li = NULL;
+    CHAR16 *opt;
+    CHAR16 *end;
+
+    if( get_handle_protocol( &image, &lip_guid, (VOID **) &li ) != EFI_SUCCESS ||
+        !li->LoadOptions )
+        return 1;
+
+    opt = li->LoadOptions;
+    end = opt + ( li->LoadOptionsSize / sizeof(CHAR16) );
+
+    while( opt < end && *opt )
+    {
+        if( opt[0] == L'-' && opt[1] == L'v' )
+        {
+            verbose++;
+        }
+        else if( opt[0] == L'-' && opt[1] == L'n' )
+        {
+            UINTN n = 0;
+
+            for( opt += 2; opt < end && *opt == L' '; opt++ );
+            for( ; opt < end && *opt >= L'0' && *opt <= L'9'; opt++ )
+                n = ( n * 10 ) + ( *opt - L'0' );
+
+            if( n < 1 || n > MAX_RUNS )
+                return 0;
+
+            *runs = n;
+            continue;
+        }
+
+        while( opt < end && *opt && *opt != L' ' )
+            opt++;
+        while( opt < end && *opt == L' ' )
+            opt++;
+    }
+
+    return 1;
+}
+
+static volume_stats *volume_slot (EFI_HANDLE handle, UINTN index)
+{
+    for( UINTN i = 0; i < n_volumes; i++ )
+        if( volumes[ i ].handle == handle )
+            return &volumes[ i ];
+
+    if( n_volumes >= MAX_PROBE_TARGETS )
+        return NULL;
+
+    volumes[ n_volumes ].handle = handle;
+    volumes[ n_volumes ].index  = index;
+
+    return &volumes[ n_volumes++ ];
+}
+
+static VOID sort_u64 (UINT64 *v, UINTN n)
+{
+    for( UINTN i = 1; i < n; i++ )
+    {
+        UINT64 x = v[ i ];
+        UINTN j = i;
+
+        for( ; j > 0 && v[ j - 1 ] > x; j-- )
+            v[ j ] = v[ j - 1 ];
+        v[ j ] = x;
+    }
+}
+
+// nearest-rank percentile of sorted values:
+static UINT64 percentile (CONST UINT64 *sorted, UINTN n, UINTN pct)
+{
+    UINTN rank = ( ( n * pct ) + 99 ) / 100;
+
+    return sorted[ rank ? rank - 1 : 0 ];
+}
+
+static VOID bench_run (UINTN run, OUT UINTN *failed)
+{
+    EFI_GUID fs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+    probe_target targets[ MAX_PROBE_TARGETS ];
+    EFI_FILE_PROTOCOL *root[ MAX_PROBE_TARGETS ] = { NULL };
+    cfg_entry *conf[ MAX_PROBE_TARGETS ] = { NULL };
+    UINTN has_conf[ MAX_PROBE_TARGETS ] = { 0 };
+    EFI_HANDLE *handles = NULL;
+    bootloader chosen = { NULL };
+    UINTN n_targets = 0;
+    UINTN count = 0;
+    EFI_STATUS res;
+    UINT64 t;
+
+    t = read_tsc();
+    res = get_protocol_handles( &fs_guid, &handles, &count );
+    cycles[ PH_ENUM ][ run ] = read_tsc() - t;
+    ERROR_JUMP( res, out, L"get_fs_handles" );
+
+    t = read_tsc();
+    n_targets = order_probe_targets( handles, count, PROBE_POLICY, targets );
+    for( UINTN i = 0; i < n_targets; i++ )
+    {
+        EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs = NULL;
+
+        res = get_handle_protocol( &targets[ i ].handle, &fs_guid, (VOID **) &fs );
+        ERROR_CONTINUE( res, L"simple fs protocol" );
+
+        res = efi_mount( fs, &root[ i ] );
+        ERROR_CONTINUE( res, L"partition #%u not opened", targets[ i ].index );
+
+        has_conf[ i ] = ( efi_file_exists( root[ i ], BOOTCONFPATH ) == EFI_SUCCESS );
+    }
+    cycles[ PH_PROBE ][ run ] = read_tsc() - t;
+
+    t = read_tsc();
+    for( UINTN i = 0; i < n_targets; i++ )
+    {
+        if( !has_conf[ i ] )
+            continue;
+
+        res = parse_config( root[ i ], &conf[ i ] );
+        WARN_STATUS( res, L"partition #%u bootconf not parsed",
+                     targets[ i ].index );
+    }
+    cycles[ PH_PARSE ][ run ] = read_tsc() - t;
+
+    t = read_tsc();
+    for( UINTN i = 0; i < n_targets; i++ )
+    {
+        volume_stats *vol;
+        cfg_summary sum = { 0 };
+        CHAR16 *path;
+        CHAR8 *image = NULL;
+        UINTN size = 0;
+        UINTN pages = 0;
+        UINT64 r;
+
+        if( !conf[ i ] )
+            continue;
+
+        config_summary( conf[ i ], &sum );
+        path = candidate_loader( &sum );
+        if( !path )
+            continue;
+
+        r = read_tsc();
+        res = efi_file_to_pages( root[ i ], path, &image, &size, &pages,
+                                 NULL, NULL );
+        r = read_tsc() - r;
+
+        WARN_STATUS( res, L"partition #%u: %s not read",
+                     targets[ i ].index, path );
+        vol = volume_slot( targets[ i ].handle, targets[ i ].index );
+        if( res == EFI_SUCCESS && vol )
+        {
+            vol->bytes += size;
+            vol->ticks += r;
+        }
+
+        efi_free_pages( &image, pages );
+        efi_free( path );
+    }
+    cycles[ PH_READ ][ run ] = read_tsc() - t;
+
+    for( UINTN i = 0; i < n_targets; i++ )
+    {
+        free_config( &conf[ i ] );
+        efi_unmount( &root[ i ] );
+    }
+
+    t = read_tsc();
+    res = choose_steamos_loader( handles, count, &chosen );
+    cycles[ PH_SELECT ][ run ] = read_tsc() - t;
+    WARN_STATUS( res, L"no valid steamos loader found" );
+
+    if( verbose && run == 0 && res == EFI_SUCCESS )
+        Print( L"chose: %s\n", chosen.loader_path );
+
+    efi_free( chosen.loader_path );
+    free_config( &chosen.config );
+    efi_unmount( &chosen.root );
+
+out:
+    if( res != EFI_SUCCESS )
+        (*failed)++;
+
+    efi_free( handles );
+}
+
+// the GPT label, if the firmware will tell us (it need not be terminated):
+static VOID volume_label (EFI_HANDLE handle, OUT CHAR16 *label, UINTN len)
+{
+    CONST UINTN max = sizeof(((gpt_entry *) 0)->name) / sizeof(CHAR16);
+    partition_info *info = NULL;
+    UINTN i = 0;
+
+    if( get_partition_info( handle, &info ) == EFI_SUCCESS &&
+        info->type == PARTITION_TYPE_GPT )
+        for( ; i < max && i < len - 1 && info->info.gpt.name[ i ]; i++ )
+            label[ i ] = info->info.gpt.name[ i ];
+
+    label[ i ] = L'\0';
+}
+
+EFI_STATUS
+EFIAPI
+efi_main (EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *sys_table)
+{
+    UINTN runs = DEFAULT_RUNS;
+    UINTN failed = 0;
+    UINT64 usec_per_gcycle;
+
+    InitializeLib( image_handle, sys_table );
+
+    if( !parse_options( image_handle, &runs ) )
+    {
+        Print( L"Usage: steamcl-bench.efi [-n RUNS] [-v]  (RUNS: 1-%d)\n",
+               MAX_RUNS );
+        return EFI_INVALID_PARAMETER;
+    }
+
+    initialise( image_handle, verbose );
+    timing_init();
+
+    if( CONNECT_PARTITIONS )
+        connect_steamos_partitions();
+
+    // the arena is reset every run, as if each were a fresh boot:
+    for( UINTN r = 0; r < runs; r++ )
+    {
+        arena_init();
+        bench_run( r, &failed );
+        arena_shutdown();
+    }
+
+    usec_per_gcycle = tsc_to_usec( 1000000000 );
+    Print( L"steamcl-bench: %d runs, %d failed, TSC %lu cycles/usec\n",
+           runs, failed,
+           usec_per_gcycle ? 1000000000 / usec_per_gcycle : 0 );
+    Print( L"%-8s %12s %12s %12s  (TSC cycles)\n",
+           L"phase", L"min", L"median", L"p99" );
+
+    for( UINTN p = 0; p < PH_MAX; p++ )
+    {
+        sort_u64( cycles[ p ], runs );
+        Print( L"%-8s %12lu %12lu %12lu\n", phase_name[ p ],
+               cycles[ p ][ 0 ],
+               percentile( cycles[ p ], runs, 50 ),
+               percentile( cycles[ p ], runs, 99 ) );
+    }
+
+    for( UINTN i = 0; i < n_volumes; i++ )
+    {
+        UINT64 usec = tsc_to_usec( volumes[ i ].ticks );
+        CHAR16 label[ 37 ];
+
+        volume_label( volumes[ i ].handle, label, sizeof(label) / sizeof(label[0]) );
+
+        // bytes per usec is MB/s:
+        Print( L"volume #%d %s: %lu bytes/run, ", volumes[ i ].index,
+               *label ? label : L"-", volumes[ i ].bytes / runs );
+        if( usec )
+            Print( L"%lu.%lu MB/s\n", volumes[ i ].bytes / usec,
+                   ( ( volumes[ i ].bytes * 10 ) / usec ) % 10 );
+        else
+            Print( L"- MB/s\n" );
+    }
+
+    // totals over all runs (nothing, unless built with FWTRACE and
+    // ALLOC_TRACE): every run starts afresh, so anything still live
+    // here was leaked, once per run:
+    fwtrace_dump();
+    alloc_trace_dump();
+
+    return failed ? EFI_NOT_FOUND : EFI_SUCCESS;
+}
@@ -0,0 +1,373 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+// Host-side selection benchmark: runs the chainloader's handle
+// enumeration and choose_steamos_loader against bench/mockfw.c, with
+// each volume backed by a directory, and reports how long selection
+// took and how many firmware calls it made.
+//
+// This file sees the chainloader's headers, so it must not include
+// unistd.h (util.h has its own sleep()): anything POSIX lives in mockfw.c.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "util.h"
+#include "arena.h"
+#include "timing.h"
+#include "bootload.h"
+#include "config.h"
+#include "fileio.h"
+#include "mirror.h"
+#include "mockfw.h"
+
+#define MAX_RUNS 10000
+
+typedef struct
+{
+    UINTN runs;
+    UINTN images;
+    UINTN decoys;
+    UINTN loader_bytes;
+    UINTN warm;
+    UINTN mirrors;
+} bench_opts;
+
+static UINT64 enum_us[ MAX_RUNS ];
+static UINT64 select_us[ MAX_RUNS ];
+
+static int usage (const char *prog)
+{
+    Print( L"Usage: %a [-n RUNS] [-i IMAGES] [-d DECOYS] [-s LOADER_BYTES]\n"
+           L"          [-l CALL=USEC]... [-r MB/s] [-w] [-m] [-v] [DIR...]\n"
+           L"\n"
+           L"  Each DIR is the root of one volume (the first is the one the\n"
+           L"  chainloader was loaded from). Without any, a scenario of an\n"
+           L"  ESP, IMAGES SteamOS volumes (default 2) and DECOYS empty data\n"
+           L"  volumes on a second disk is generated, at most %d in all.\n"
+           L"\n"
+           L"  -l  latency per call for OpenVolume, Open, Read, GetInfo,\n"
+           L"      Close, HandleProtocol, LocateHandle, GetVariable or\n"
+           L"      SetVariable\n"
+           L"  -r  read rate, on top of the Read latency\n"
+           L"  -w  keep NVRAM (the loader cache etc) between runs\n"
+           L"  -m  give the generated images NVRAM bootconf mirrors\n",
+           prog, MOCK_MAX_VOLUMES );
+
+    return 2;
+}
+
+static int cmp_u64 (const void *a, const void *b)
+{
+    UINT64 x = *(const UINT64 *) a;
+    UINT64 y = *(const UINT64 *) b;
+
+    return ( x > y ) - ( x < y );
+}
+
+static EFI_GUID image_guid (UINTN n)
+{
+    EFI_GUID g = { 0x5e5e0000 + n, 0xa0b0, 0x4c0d,
+                   { 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, (UINT8) n } };
+
+    return g;
+}
+
+static int guid_str (char *buf, size_t space, CONST EFI_GUID *g)
+{
+    return snprintf( buf, space,
+                     "%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+                     g->Data1, g->Data2, g->Data3,
+                     g->Data4[0], g->Data4[1], g->Data4[2], g->Data4[3],
+                     g->Data4[4], g->Data4[5], g->Data4[6], g->Data4[7] );
+}
+
+static EFI_STATUS synth_scenario (CONST bench_opts *o)
+{
+    char partitions[ MOCK_MAX_VOLUMES * 37 + 1 ] = "";
+    char bootconf[ sizeof(partitions) + 256 ];
+    char name[ 16 ];
+    size_t used = 0;
+    EFI_GUID g;
+    EFI_STATUS res;
+
+    // the image volumes all list each other, as SteamOS images do:
+    for( UINTN i = 0; i < o->images; i++ )
+    {
+        g = image_guid( i + 1 );
+        used += guid_str( partitions + used, sizeof(partitions) - used, &g );
+        partitions[ used++ ] = ' ';
+        partitions[ used ] = '\0';
+    }
+
+    g = image_guid( 0 );
+    res = mockfw_synth_volume( (CONST CHAR8 *) "esp", &g, 0, 1, NULL, 0 );
+    ERROR_RETURN( res, res, L"esp volume" );
+
+    // newest last: the last image is the one that should win
+    for( UINTN i = 0; i < o->images; i++ )
+    {
+        snprintf( name, sizeof(name), "efi-%c", (int) ( 'A' + i ) );
+        snprintf( bootconf, sizeof(bootconf),
+                  "boot-requested-at: %llu\n"
+                  "boot-other: 0\n"
+                  "image-invalid: 0\n"
+                  "update: 0\n"
+                  "partitions: %s\n"
+                  "mirror-generation: %u\n",
+                  20240101000000ULL + i, partitions, o->mirrors ? 1 : 0 );
+        g = image_guid( i + 1 );
+        res = mockfw_synth_volume( (CONST CHAR8 *) name, &g, 0, 1,
+                                   (CONST CHAR8 *) bootconf, o->loader_bytes );
+        ERROR_RETURN( res, res, L"image volume %a", name );
+    }
+
+    for( UINTN i = 0; i < o->decoys; i++ )
+    {
+        snprintf( name, sizeof(name), "data-%u", (unsigned) i );
+        g = image_guid( 0x100 + i );
+        res = mockfw_synth_volume( (CONST CHAR8 *) name, &g, 1, 0, NULL, 0 );
+        ERROR_RETURN( res, res, L"decoy volume %a", name );
+    }
+
+    return EFI_SUCCESS;
+}
+
+// what steamos-bootconf --efivar-mirror would have left in NVRAM
+// for the images synth_scenario generated:
+static VOID seed_mirrors (CONST bench_opts *o)
+{
+    static EFI_GUID steamos_guid = STEAMOS_VENDOR_GUID;
+    CHAR8 rec[ MIRROR_SIZE ];
+    CHAR16 name[ 64 ];
+    char guid[ 40 ];
+
+    for( UINTN i = 0; i < o->images; i++ )
+    {
+        EFI_GUID g = image_guid( i + 1 );
+
+        guid_str( guid, sizeof(guid), &g );
+        SPrint( name, sizeof(name), L"%a%a", MIRROR_VAR_PREFIX, guid );
+
+        ZeroMem( rec, sizeof(rec) );
+        bootbin_put( rec + MIRROR_OFF_VERSION     , 4, MIRROR_VERSION );
+        bootbin_put( rec + MIRROR_OFF_GENERATION  , 8, 1 );
+        bootbin_put( rec + MIRROR_OFF_REQUESTED_AT, 8, 20240101000000ULL + i );
+
+        uefi_call_wrapper( RT->SetVariable, 5, name, &steamos_guid,
+                           MIRROR_VAR_ATTRS, sizeof(rec), rec );
+    }
+}
+
+static VOID release (bootloader *chosen)
+{
+    efi_free( chosen->loader_path );
+    free_config( &chosen->config );
+    efi_unmount( &chosen->root );
+}
+
+int main (int argc, char **argv)
+{
+    EFI_GUID fs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+    bench_opts o = { .runs = 20, .images = 2, .loader_bytes = 65536 };
+    UINT64 calls[ MOCK_CALLS ] = { 0 };
+    UINT64 bytes_read = 0;
+    CHAR16 *chose = NULL;
+    UINTN chose_vol = 0;
+    EFI_SYSTEM_TABLE *st;
+    EFI_HANDLE image;
+    UINTN n_dirs = 0;
+    UINTN failed = 0;
+    EFI_STATUS res;
+    int c;
+
+    mockfw_init( &image, &st );
+    InitializeLib( image, st );
+
+    for( c = 1; c < argc && argv[ c ][0] == '-'; c++ )
+    {
+        char opt = argv[ c ][1];
+        char *val = ( c + 1 < argc ) ? argv[ c + 1 ] : NULL;
+
+        if( opt == 'w' || opt == 'm' || opt == 'v' )
+        {
+            if( opt == 'w' )
+                o.warm = 1;
+            else if( opt == 'm' )
+                o.mirrors = 1;
+            else
+                verbose++;
+            continue;
+        }
+
+        if( !val || argv[ c ][2] )
+            return usage( argv[0] );
+
+        c++;
+
+        switch( opt )
+        {
+          case 'n': o.runs         = strtoul( val, NULL, 10 ); break;
+          case 'i': o.images       = strtoul( val, NULL, 10 ); break;
+          case 'd': o.decoys       = strtoul( val, NULL, 10 ); break;
+          case 's': o.loader_bytes = strtoul( val, NULL, 10 ); break;
+          case 'r': mockfw_set_read_rate( strtoul( val, NULL, 10 ) ); break;
+          case 'l':
+            {
+                char *eq = strchr( val, '=' );
+                mock_call call;
+
+                if( !eq )
+                    return usage( argv[0] );
+
+                *eq = '\0';
+                call = mockfw_call_id( (CONST CHAR8 *) val );
+                if( call == MOCK_CALLS )
+                    return usage( argv[0] );
+
+                mockfw_set_latency( call, strtoul( eq + 1, NULL, 10 ) );
+            }
+            break;
+          default:
+            return usage( argv[0] );
+        }
+    }
+
+    if( o.runs < 1 || o.runs > MAX_RUNS ||
+        1 + o.images + o.decoys > MOCK_MAX_VOLUMES )
+        return usage( argv[0] );
+
+    initialise( image, verbose );
+    timing_init();
+
+    for( ; c < argc; c++ )
+    {
+        EFI_GUID g = image_guid( 0x200 + n_dirs );
+        CONST CHAR8 *dir = (CONST CHAR8 *) argv[ c ];
+        char *base = strrchr( argv[ c ], '/' );
+
+        res = mockfw_add_volume( dir, (CONST CHAR8 *) ( base ? base + 1 : argv[ c ] ),
+                                 &g, 0, 1 );
+        ERROR_RETURN( res, 1, L"volume %a", dir );
+        n_dirs++;
+    }
+
+    if( !n_dirs )
+    {
+        res = synth_scenario( &o );
+        ERROR_JUMP( res, out, L"scenario not generated" );
+    }
+
+    for( UINTN r = 0; r < o.runs; r++ )
+    {
+        EFI_HANDLE *handles = NULL;
+        UINTN count = 0;
+        bootloader chosen = { NULL };
+        mock_stats s;
+        UINT64 t0, t1, t2;
+
+        if( !o.warm || r == 0 )
+        {
+            mockfw_clear_variables();
+            if( o.mirrors && !n_dirs )
+                seed_mirrors( &o );
+        }
+
+        arena_init();
+        mockfw_stats_reset();
+
+        t0 = mockfw_usec();
+        res = get_protocol_handles( &fs_guid, &handles, &count );
+        t1 = mockfw_usec();
+
+        if( res == EFI_SUCCESS )
+            res = choose_steamos_loader( handles, count, &chosen );
+        t2 = mockfw_usec();
+
+        enum_us[ r ]   = t1 - t0;
+        select_us[ r ] = t2 - t1;
+
+        mockfw_stats_get( &s );
+        for( UINTN i = 0; i < MOCK_CALLS; i++ )
+            calls[ i ] += s.count[ i ];
+        bytes_read += s.bytes_read;
+
+        if( res != EFI_SUCCESS )
+            failed++;
+        else if( !chose )
+        {
+            chose = StrDuplicate( chosen.loader_path );
+            chose_vol = mockfw_volume_index( chosen.partition );
+        }
+
+        release( &chosen );
+        efi_free( handles );
+        arena_shutdown();
+    }
+
+    qsort( enum_us  , o.runs, sizeof(UINT64), cmp_u64 );
+    qsort( select_us, o.runs, sizeof(UINT64), cmp_u64 );
+
+    if( n_dirs )
+        Print( L"scenario: %d volumes from the command line\n", n_dirs );
+    else
+        Print( L"scenario: %d images%s, %d decoys, %d volumes\n",
+               o.images, o.mirrors ? L" (mirrored)" : L"",
+               o.decoys, 1 + o.images + o.decoys );
+
+    Print( L"latency (us):" );
+    for( UINTN i = 0; i < MOCK_CALLS && !mockfw_get_latency( (mock_call) i ); i++ )
+        if( i == MOCK_CALLS - 1 )
+            Print( L" none" );
+    for( UINTN i = 0; i < MOCK_CALLS; i++ )
+        if( mockfw_get_latency( (mock_call) i ) )
+            Print( L" %s=%lu", mockfw_call_name( (mock_call) i ),
+                   mockfw_get_latency( (mock_call) i ) );
+    if( mockfw_get_read_rate() )
+        Print( L" read rate %lu MB/s", mockfw_get_read_rate() );
+    Print( L"\n" );
+
+    Print( L"selection (us): min %lu median %lu max %lu over %d runs, "
+           L"%d failed\n",
+           select_us[ 0 ], select_us[ o.runs / 2 ], select_us[ o.runs - 1 ],
+           o.runs, failed );
+    Print( L"enumeration (us): median %lu\n", enum_us[ o.runs / 2 ] );
+
+    if( chose )
+        Print( L"chose: volume %d %s\n", chose_vol, chose );
+
+    Print( L"firmware calls per run:" );
+    for( UINTN i = 0; i < MOCK_CALLS; i++ )
+        if( calls[ i ] )
+            Print( L" %s %lu", mockfw_call_name( (mock_call) i ),
+                   calls[ i ] / o.runs );
+    Print( L", %lu bytes read\n", bytes_read / o.runs );
+
+out:
+    efi_free( chose );
+    mockfw_scenario_cleanup();
+
+    return ( res == EFI_SUCCESS && !failed ) ? 0 : 1;
+}
@@ -0,0 +1,1210 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#define _GNU_SOURCE
+
+#include <efi.h>
+#include <efilib.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <ftw.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "partition.h"
+#include "mockfw.h"
+
+// the firmware calling convention (see EFI_CALLBACK in util.h, which
+// we can't include here: its sleep() clashes with unistd.h's):
+#if defined(__x86_64__) && !defined(GNU_EFI_USE_MS_ABI)
+#define MOCKAPI __attribute__((ms_abi))
+#else
+#define MOCKAPI EFIAPI
+#endif
+
+#define MOCK_SLOT(slot, fn) ( (slot) = (VOID *) (fn) )
+
+typedef struct
+{
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL fs; // first: OpenVolume's this is us
+    char *root;
+    EFI_DEVICE_PATH *dp;
+    partition_info pi;
+} mock_volume;
+
+typedef struct
+{
+    EFI_FILE_PROTOCOL fp; // first: every file call's this is us
+    mock_volume *vol;
+    char *path;
+    int fd;   // -1 for a directory
+    DIR *dir; // NULL for a file
+    UINT64 pos;
+} mock_file;
+
+typedef struct
+{
+    UINT32 type;
+    UINT64 due; // µs, 0 if not armed
+} mock_event;
+
+typedef struct mock_var
+{
+    struct mock_var *next;
+    CHAR16 *name;
+    EFI_GUID guid;
+    UINT32 attr;
+    UINTN size;
+    VOID *data;
+} mock_var;
+
+static EFI_SYSTEM_TABLE st;
+static EFI_BOOT_SERVICES bs;
+static EFI_RUNTIME_SERVICES rt;
+static SIMPLE_TEXT_OUTPUT_INTERFACE con_out;
+static SIMPLE_TEXT_OUTPUT_MODE con_mode;
+static EFI_LOADED_IMAGE self_image;
+static UINTN self_handle;
+
+static mock_volume volumes[ MOCK_MAX_VOLUMES ];
+static UINTN n_volumes;
+static mock_var *variables;
+
+static UINT64 latency[ MOCK_CALLS ];
+static UINT64 read_rate;
+static mock_stats stats;
+
+static char *scenario;
+
+static EFI_GUID sfs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+static EFI_GUID dp_guid  = DEVICE_PATH_PROTOCOL;
+static EFI_GUID lip_guid = LOADED_IMAGE_PROTOCOL;
+static EFI_GUID pi_guid  = PARTITION_INFO_GUID;
+static EFI_GUID esp_type = ESP_TYPE_GUID;
+static EFI_GUID fat_type = BASIC_DATA_TYPE_GUID;
+static EFI_GUID fi_guid  = EFI_FILE_INFO_ID;
+
+static CONST CHAR16 *call_names[ MOCK_CALLS ] =
+{
+    [ MOCK_OPEN_VOLUME     ] = L"OpenVolume",
+    [ MOCK_OPEN            ] = L"Open",
+    [ MOCK_READ            ] = L"Read",
+    [ MOCK_GET_INFO        ] = L"GetInfo",
+    [ MOCK_CLOSE           ] = L"Close",
+    [ MOCK_HANDLE_PROTOCOL ] = L"HandleProtocol",
+    [ MOCK_LOCATE_HANDLE   ] = L"LocateHandle",
+    [ MOCK_GET_VARIABLE    ] = L"GetVariable",
+    [ MOCK_SET_VARIABLE    ] = L"SetVariable",
+};
+
+// =========================================================================
+// accounting and latency
+
+UINT64 mockfw_usec (VOID)
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (UINT64) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static VOID delay (UINT64 usec)
+{
+    struct timespec t = { .tv_sec  = usec / 1000000,
+                          .tv_nsec = ( usec % 1000000 ) * 1000 };
+
+    if( usec )
+        while( nanosleep( &t, &t ) )
+            ;
+}
+
+static VOID charge (mock_call call, UINT64 bytes)
+{
+    stats.count[ call ]++;
+
+    if( call == MOCK_READ )
+        stats.bytes_read += bytes;
+
+    // bytes / (MB/s) is µs:
+    delay( latency[ call ] + ( read_rate ? bytes / read_rate : 0 ) );
+}
+
+CONST CHAR16 *mockfw_call_name (mock_call call)
+{
+    return ( call < MOCK_CALLS ) ? call_names[ call ] : L"-";
+}
+
+mock_call mockfw_call_id (CONST CHAR8 *name)
+{
+    for( UINTN i = 0; i < MOCK_CALLS; i++ )
+    {
+        CONST CHAR16 *c = call_names[ i ];
+        CONST CHAR8 *n = name;
+
+        while( *c && *n && ( ( *c | 0x20 ) == ( *n | 0x20 ) ) )
+            c++, n++;
+
+        if( !*c && !*n )
+            return (mock_call) i;
+    }
+
+    return MOCK_CALLS;
+}
+
+VOID mockfw_set_latency (mock_call call, UINT64 usec)
+{
+    if( call < MOCK_CALLS )
+        latency[ call ] = usec;
+}
+
+UINT64 mockfw_get_latency (mock_call call)
+{
+    return ( call < MOCK_CALLS ) ? latency[ call ] : 0;
+}
+
+VOID mockfw_set_read_rate (UINT64 mbps)
+{
+    read_rate = mbps;
+}
+
+UINT64 mockfw_get_read_rate (VOID)
+{
+    return read_rate;
+}
+
+VOID mockfw_stats_reset (VOID)
+{
+    memset( &stats, 0, sizeof(stats) );
+}
+
+VOID mockfw_stats_get (OUT mock_stats *out)
+{
+    *out = stats;
+}
+
+// =========================================================================
+// boot services
+
+static EFI_STATUS MOCKAPI unsupported (VOID)
+{
+    return EFI_UNSUPPORTED;
+}
+
+static EFI_STATUS MOCKAPI allocate_pool (EFI_MEMORY_TYPE type,
+                                         UINTN size,
+                                         VOID **buf)
+{
+    (VOID) type;
+
+    return ( *buf = malloc( size ?: 1 ) ) ? EFI_SUCCESS : EFI_OUT_OF_RESOURCES;
+}
+
+static EFI_STATUS MOCKAPI free_pool (VOID *buf)
+{
+    free( buf );
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI allocate_pages (EFI_ALLOCATE_TYPE how,
+                                          EFI_MEMORY_TYPE type,
+                                          UINTN pages,
+                                          EFI_PHYSICAL_ADDRESS *addr)
+{
+    VOID *buf = NULL;
+
+    (VOID) type;
+
+    if( how != AllocateAnyPages )
+        return EFI_UNSUPPORTED;
+
+    if( posix_memalign( &buf, EFI_PAGE_SIZE, pages * EFI_PAGE_SIZE ) )
+        return EFI_OUT_OF_RESOURCES;
+
+    *addr = (EFI_PHYSICAL_ADDRESS) (UINTN) buf;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI free_pages (EFI_PHYSICAL_ADDRESS addr, UINTN pages)
+{
+    (VOID) pages;
+    free( (VOID *) (UINTN) addr );
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI stall (UINTN usec)
+{
+    delay( usec );
+
+    return EFI_SUCCESS;
+}
+
+static mock_volume *as_volume (EFI_HANDLE handle)
+{
+    mock_volume *v = handle;
+
+    if( v >= &volumes[0] && v < &volumes[ n_volumes ] )
+        return v;
+
+    return NULL;
+}
+
+UINTN mockfw_volume_index (EFI_HANDLE handle)
+{
+    mock_volume *v = as_volume( handle );
+
+    return v ? (UINTN) ( v - &volumes[0] ) : (UINTN) -1;
+}
+
+static EFI_STATUS MOCKAPI handle_protocol (EFI_HANDLE handle,
+                                           EFI_GUID *guid,
+                                           VOID **iface)
+{
+    mock_volume *v = as_volume( handle );
+
+    charge( MOCK_HANDLE_PROTOCOL, 0 );
+
+    if( handle == &self_handle && !CompareGuid( guid, &lip_guid ) )
+        *iface = &self_image;
+    else if( v && !CompareGuid( guid, &sfs_guid ) )
+        *iface = &v->fs;
+    else if( v && !CompareGuid( guid, &dp_guid ) )
+        *iface = v->dp;
+    else if( v && !CompareGuid( guid, &pi_guid ) )
+        *iface = &v->pi;
+    else
+        return EFI_UNSUPPORTED;
+
+    return EFI_SUCCESS;
+}
+
+static UINTN volume_protocol (EFI_GUID *guid)
+{
+    return ( !CompareGuid( guid, &sfs_guid ) ||
+             !CompareGuid( guid, &dp_guid  ) ||
+             !CompareGuid( guid, &pi_guid  ) );
+}
+
+static EFI_STATUS MOCKAPI locate_handle (EFI_LOCATE_SEARCH_TYPE how,
+                                         EFI_GUID *guid,
+                                         VOID *key,
+                                         UINTN *size,
+                                         EFI_HANDLE *buf)
+{
+    UINTN need;
+
+    (VOID) key;
+    charge( MOCK_LOCATE_HANDLE, 0 );
+
+    if( how != ByProtocol || !volume_protocol( guid ) || !n_volumes )
+        return EFI_NOT_FOUND;
+
+    need = n_volumes * sizeof(EFI_HANDLE);
+
+    if( *size < need )
+    {
+        *size = need;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    for( UINTN i = 0; i < n_volumes; i++ )
+        buf[ i ] = &volumes[ i ];
+
+    *size = need;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI locate_handle_buffer (EFI_LOCATE_SEARCH_TYPE how,
+                                                EFI_GUID *guid,
+                                                VOID *key,
+                                                UINTN *count,
+                                                EFI_HANDLE **buf)
+{
+    UINTN size = n_volumes * sizeof(EFI_HANDLE);
+    EFI_STATUS res;
+
+    *count = 0;
+    *buf = malloc( size ?: 1 );
+    if( !*buf )
+        return EFI_OUT_OF_RESOURCES;
+
+    res = locate_handle( how, guid, key, &size, *buf );
+    if( res != EFI_SUCCESS )
+    {
+        free( *buf );
+        *buf = NULL;
+        return res;
+    }
+
+    *count = size / sizeof(EFI_HANDLE);
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI create_event (UINT32 type,
+                                        EFI_TPL tpl,
+                                        EFI_EVENT_NOTIFY notify,
+                                        VOID *context,
+                                        EFI_EVENT *event)
+{
+    mock_event *e;
+
+    (VOID) tpl;
+    (VOID) context;
+
+    // only plain timers: we never complete anything asynchronously
+    if( notify || !( type & EVT_TIMER ) )
+        return EFI_UNSUPPORTED;
+
+    if( !(e = calloc( 1, sizeof(*e) )) )
+        return EFI_OUT_OF_RESOURCES;
+
+    e->type = type;
+    *event = e;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI set_timer (EFI_EVENT event,
+                                     EFI_TIMER_DELAY how,
+                                     UINT64 ticks)
+{
+    mock_event *e = event;
+
+    if( how == TimerPeriodic )
+        return EFI_UNSUPPORTED;
+
+    // ticks are 100ns:
+    e->due = ( how == TimerCancel ) ? 0 : mockfw_usec() + ticks / 10 + 1;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI check_event (EFI_EVENT event)
+{
+    mock_event *e = event;
+
+    if( !e->due || mockfw_usec() < e->due )
+        return EFI_NOT_READY;
+
+    e->due = 0;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI wait_for_event (UINTN n,
+                                          EFI_EVENT *events,
+                                          UINTN *index)
+{
+    UINT64 soonest = 0;
+    UINTN which = 0;
+
+    for( UINTN i = 0; i < n; i++ )
+    {
+        mock_event *e = events[ i ];
+
+        if( e->due && ( !soonest || e->due < soonest ) )
+        {
+            soonest = e->due;
+            which   = i;
+        }
+    }
+
+    // nothing armed would never fire:
+    if( !soonest )
+        return EFI_UNSUPPORTED;
+
+    while( check_event( events[ which ] ) != EFI_SUCCESS )
+        delay( soonest - mockfw_usec() );
+
+    *index = which;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI close_event (EFI_EVENT event)
+{
+    free( event );
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI locate_protocol (EFI_GUID *guid,
+                                           VOID *key,
+                                           VOID **iface)
+{
+    (VOID) guid;
+    (VOID) key;
+    *iface = NULL;
+
+    return EFI_NOT_FOUND;
+}
+
+// =========================================================================
+// runtime services
+
+static mock_var **find_var (CHAR16 *name, EFI_GUID *guid)
+{
+    mock_var **v = &variables;
+
+    for( ; *v; v = &(*v)->next )
+        if( !CompareGuid( &(*v)->guid, guid ) && !StrCmp( (*v)->name, name ) )
+            break;
+
+    return v;
+}
+
+static EFI_STATUS MOCKAPI get_variable (CHAR16 *name,
+                                        EFI_GUID *guid,
+                                        UINT32 *attr,
+                                        UINTN *size,
+                                        VOID *data)
+{
+    mock_var *v = *find_var( name, guid );
+
+    charge( MOCK_GET_VARIABLE, 0 );
+
+    if( !v )
+        return EFI_NOT_FOUND;
+
+    if( attr )
+        *attr = v->attr;
+
+    if( *size < v->size )
+    {
+        *size = v->size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    memcpy( data, v->data, v->size );
+    *size = v->size;
+
+    return EFI_SUCCESS;
+}
+
+static VOID free_var (mock_var *v)
+{
+    free( v->name );
+    free( v->data );
+    free( v );
+}
+
+static EFI_STATUS MOCKAPI set_variable (CHAR16 *name,
+                                        EFI_GUID *guid,
+                                        UINT32 attr,
+                                        UINTN size,
+                                        VOID *data)
+{
+    mock_var **slot = find_var( name, guid );
+    mock_var *v = *slot;
+
+    charge( MOCK_SET_VARIABLE, 0 );
+
+    if( v )
+    {
+        *slot = v->next;
+        free_var( v );
+    }
+
+    if( !size )
+        return v ? EFI_SUCCESS : EFI_NOT_FOUND;
+
+    if( !(v = calloc( 1, sizeof(*v) )) )
+        return EFI_OUT_OF_RESOURCES;
+
+    v->name = malloc( ( StrLen( name ) + 1 ) * sizeof(CHAR16) );
+    v->data = malloc( size );
+
+    if( !v->name || !v->data )
+    {
+        free_var( v );
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    StrCpy( v->name, name );
+    memcpy( v->data, data, size );
+    v->guid = *guid;
+    v->attr = attr;
+    v->size = size;
+    v->next = variables;
+    variables = v;
+
+    return EFI_SUCCESS;
+}
+
+VOID mockfw_clear_variables (VOID)
+{
+    while( variables )
+    {
+        mock_var *v = variables;
+
+        variables = v->next;
+        free_var( v );
+    }
+}
+
+// wall clock, as a PC RTC keeps it:
+static VOID to_efi_time (time_t when, EFI_TIME *t)
+{
+    struct tm tm;
+
+    localtime_r( &when, &tm );
+    memset( t, 0, sizeof(*t) );
+    t->Year     = tm.tm_year + 1900;
+    t->Month    = tm.tm_mon + 1;
+    t->Day      = tm.tm_mday;
+    t->Hour     = tm.tm_hour;
+    t->Minute   = tm.tm_min;
+    t->Second   = tm.tm_sec;
+    t->TimeZone = EFI_UNSPECIFIED_TIMEZONE;
+}
+
+static EFI_STATUS MOCKAPI get_time (EFI_TIME *t, EFI_TIME_CAPABILITIES *caps)
+{
+    (VOID) caps;
+    to_efi_time( time( NULL ), t );
+
+    return EFI_SUCCESS;
+}
+
+// =========================================================================
+// console
+
+static EFI_STATUS MOCKAPI output_string (SIMPLE_TEXT_OUTPUT_INTERFACE *this,
+                                         CHAR16 *str)
+{
+    (VOID) this;
+
+    for( ; *str; str++ )
+        if( *str != L'\r' )
+            putchar( *str < 0x80 ? (char) *str : '?' );
+
+    return EFI_SUCCESS;
+}
+
+// =========================================================================
+// files
+
+static EFI_STATUS MOCKAPI file_open (EFI_FILE_PROTOCOL *this,
+                                     EFI_FILE_PROTOCOL **new,
+                                     CHAR16 *name,
+                                     UINT64 mode,
+                                     UINT64 attr);
+static EFI_STATUS MOCKAPI file_close (EFI_FILE_PROTOCOL *this);
+static EFI_STATUS MOCKAPI file_read (EFI_FILE_PROTOCOL *this,
+                                     UINTN *size,
+                                     VOID *buf);
+static EFI_STATUS MOCKAPI file_get_info (EFI_FILE_PROTOCOL *this,
+                                         EFI_GUID *type,
+                                         UINTN *size,
+                                         VOID *buf);
+static EFI_STATUS MOCKAPI file_set_position (EFI_FILE_PROTOCOL *this,
+                                             UINT64 pos);
+static EFI_STATUS MOCKAPI file_get_position (EFI_FILE_PROTOCOL *this,
+                                             UINT64 *pos);
+
+static mock_file *new_file (mock_volume *vol, char *path)
+{
+    struct stat st;
+    mock_file *f;
+
+    if( stat( path, &st ) || !(f = calloc( 1, sizeof(*f) )) )
+    {
+        free( path );
+        return NULL;
+    }
+
+    f->vol  = vol;
+    f->path = path;
+    f->fd   = -1;
+
+    if( S_ISDIR( st.st_mode ) )
+        f->dir = opendir( path );
+    else
+        f->fd = open( path, O_RDONLY );
+
+    if( !f->dir && f->fd < 0 )
+    {
+        free( path );
+        free( f );
+        return NULL;
+    }
+
+    // revision 1: no OpenEx/ReadEx, so every read is synchronous
+    f->fp.Revision = EFI_FILE_PROTOCOL_REVISION;
+    MOCK_SLOT( f->fp.Open       , file_open );
+    MOCK_SLOT( f->fp.Close      , file_close );
+    MOCK_SLOT( f->fp.Delete     , unsupported );
+    MOCK_SLOT( f->fp.Read       , file_read );
+    MOCK_SLOT( f->fp.Write      , unsupported );
+    MOCK_SLOT( f->fp.GetPosition, file_get_position );
+    MOCK_SLOT( f->fp.SetPosition, file_set_position );
+    MOCK_SLOT( f->fp.GetInfo    , file_get_info );
+    MOCK_SLOT( f->fp.SetInfo    , unsupported );
+    MOCK_SLOT( f->fp.Flush      , unsupported );
+
+    return f;
+}
+
+// the entry in dir matching name case-insensitively, as FAT would:
+static char *lookup (const char *dir, const char *name)
+{
+    struct dirent *d;
+    char *path = NULL;
+    DIR *dh;
+
+    if( !(dh = opendir( dir )) )
+        return NULL;
+
+    while( !path && (d = readdir( dh )) )
+    {
+        if( strcasecmp( d->d_name, name ) )
+            continue;
+
+        path = malloc( strlen( dir ) + strlen( d->d_name ) + 2 );
+        sprintf( path, "%s/%s", dir, d->d_name );
+    }
+
+    closedir( dh );
+
+    return path;
+}
+
+// host path of name (absolute, or relative to from), or NULL:
+static char *host_path (mock_file *from, CONST CHAR16 *name)
+{
+    size_t rlen = strlen( from->vol->root );
+    char *path;
+    char comp[ 256 ];
+
+    if( *name == L'\\' || *name == L'/' )
+        path = strdup( from->vol->root );
+    else
+        path = strdup( from->path );
+
+    while( path && *name )
+    {
+        size_t n = 0;
+        char *next;
+
+        while( *name == L'\\' || *name == L'/' )
+            name++;
+
+        while( *name && *name != L'\\' && *name != L'/' && n < sizeof(comp) - 1 )
+            comp[ n++ ] = ( *name < 0x80 ) ? (char) *name++ : ( name++, '?' );
+        comp[ n ] = '\0';
+
+        if( n == 0 || !strcmp( comp, "." ) )
+            continue;
+
+        if( !strcmp( comp, ".." ) )
+        {
+            char *slash = strrchr( path, '/' );
+
+            if( slash && (size_t) ( slash - path ) >= rlen )
+                *slash = '\0';
+            continue;
+        }
+
+        next = lookup( path, comp );
+        free( path );
+        path = next;
+    }
+
+    return path;
+}
+
+static EFI_STATUS MOCKAPI file_open (EFI_FILE_PROTOCOL *this,
+                                     EFI_FILE_PROTOCOL **new,
+                                     CHAR16 *name,
+                                     UINT64 mode,
+                                     UINT64 attr)
+{
+    mock_file *from = (mock_file *) this;
+    mock_file *f;
+    char *path;
+
+    (VOID) attr;
+    charge( MOCK_OPEN, 0 );
+
+    if( mode != EFI_FILE_MODE_READ )
+        return EFI_WRITE_PROTECTED;
+
+    if( !(path = host_path( from, name )) )
+        return EFI_NOT_FOUND;
+
+    if( !(f = new_file( from->vol, path )) )
+        return EFI_DEVICE_ERROR;
+
+    *new = &f->fp;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI file_close (EFI_FILE_PROTOCOL *this)
+{
+    mock_file *f = (mock_file *) this;
+
+    charge( MOCK_CLOSE, 0 );
+
+    if( f->dir )
+        closedir( f->dir );
+    if( f->fd >= 0 )
+        close( f->fd );
+
+    free( f->path );
+    free( f );
+
+    return EFI_SUCCESS;
+}
+
+// fill in an EFI_FILE_INFO for path in buf if it fits: returns the
+// size it needs, or 0 if path can't be stat'd:
+static UINTN file_info (const char *path, const char *name, VOID *buf, UINTN space)
+{
+    EFI_FILE_INFO *info = buf;
+    UINTN len = strlen( name );
+    UINTN need = SIZE_OF_EFI_FILE_INFO + ( len + 1 ) * sizeof(CHAR16);
+    struct stat st;
+
+    if( stat( path, &st ) )
+        return 0;
+
+    if( space < need )
+        return need;
+
+    memset( info, 0, need );
+    info->Size         = need;
+    info->FileSize     = S_ISDIR( st.st_mode ) ? 0 : st.st_size;
+    info->PhysicalSize = info->FileSize;
+    info->Attribute    = S_ISDIR( st.st_mode ) ? EFI_FILE_DIRECTORY : 0;
+    to_efi_time( st.st_mtime, &info->CreateTime );
+    to_efi_time( st.st_mtime, &info->LastAccessTime );
+    to_efi_time( st.st_mtime, &info->ModificationTime );
+
+    for( UINTN i = 0; i < len; i++ )
+        info->FileName[ i ] = (UINT8) name[ i ];
+
+    return need;
+}
+
+static EFI_STATUS MOCKAPI file_read (EFI_FILE_PROTOCOL *this,
+                                     UINTN *size,
+                                     VOID *buf)
+{
+    mock_file *f = (mock_file *) this;
+    struct dirent *d;
+    ssize_t got;
+
+    if( f->fd >= 0 )
+    {
+        got = pread( f->fd, buf, *size, f->pos );
+        if( got < 0 )
+            return EFI_DEVICE_ERROR;
+
+        charge( MOCK_READ, got );
+        f->pos += got;
+        *size = got;
+
+        return EFI_SUCCESS;
+    }
+
+    charge( MOCK_READ, 0 );
+
+    // directories read as one EFI_FILE_INFO per entry, 0 bytes at the end:
+    for( long at = telldir( f->dir ); (d = readdir( f->dir )); at = telldir( f->dir ) )
+    {
+        char *path;
+        UINTN need;
+
+        if( !strcmp( d->d_name, "." ) || !strcmp( d->d_name, ".." ) )
+            continue;
+
+        path = malloc( strlen( f->path ) + strlen( d->d_name ) + 2 );
+        sprintf( path, "%s/%s", f->path, d->d_name );
+        need = file_info( path, d->d_name, buf, *size );
+        free( path );
+
+        if( !need )
+            continue;
+
+        if( need > *size )
+        {
+            seekdir( f->dir, at );
+            *size = need;
+            return EFI_BUFFER_TOO_SMALL;
+        }
+
+        *size = need;
+        return EFI_SUCCESS;
+    }
+
+    *size = 0;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI file_get_info (EFI_FILE_PROTOCOL *this,
+                                         EFI_GUID *type,
+                                         UINTN *size,
+                                         VOID *buf)
+{
+    mock_file *f = (mock_file *) this;
+    const char *name = strrchr( f->path, '/' );
+    UINTN need;
+
+    charge( MOCK_GET_INFO, 0 );
+
+    if( CompareGuid( type, &fi_guid ) )
+        return EFI_UNSUPPORTED;
+
+    need = file_info( f->path, name ? name + 1 : f->path, buf, *size );
+    if( !need )
+        return EFI_DEVICE_ERROR;
+
+    if( need > *size )
+    {
+        *size = need;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    *size = need;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI file_set_position (EFI_FILE_PROTOCOL *this, UINT64 pos)
+{
+    mock_file *f = (mock_file *) this;
+    struct stat st;
+
+    if( f->dir )
+    {
+        if( pos )
+            return EFI_UNSUPPORTED;
+        rewinddir( f->dir );
+        return EFI_SUCCESS;
+    }
+
+    if( pos == 0xFFFFFFFFFFFFFFFFULL )
+        pos = fstat( f->fd, &st ) ? 0 : st.st_size;
+
+    f->pos = pos;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI file_get_position (EFI_FILE_PROTOCOL *this, UINT64 *pos)
+{
+    mock_file *f = (mock_file *) this;
+
+    if( f->dir )
+        return EFI_UNSUPPORTED;
+
+    *pos = f->pos;
+
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS MOCKAPI open_volume (EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *this,
+                                       EFI_FILE_PROTOCOL **root)
+{
+    mock_volume *vol = (mock_volume *) this;
+    mock_file *f;
+    char *path = strdup( vol->root );
+
+    charge( MOCK_OPEN_VOLUME, 0 );
+
+    if( !path || !(f = new_file( vol, path )) )
+        return EFI_DEVICE_ERROR;
+
+    *root = &f->fp;
+
+    return EFI_SUCCESS;
+}
+
+// =========================================================================
+// setup
+
+static UINT8 *put_node (UINT8 *p, UINT8 type, UINT8 subtype, UINT16 len)
+{
+    p[0] = type;
+    p[1] = subtype;
+    p[2] = len & 0xff;
+    p[3] = len >> 8;
+
+    return p + 4;
+}
+
+// PCI(0|disk) / HD(part, GPT, guid) / end, laid out by hand as the
+// firmware would (gnu-efi's node structs aren't all packed):
+static EFI_DEVICE_PATH *volume_path (UINTN disk, UINTN part, CONST EFI_GUID *guid)
+{
+    UINT8 *dp = calloc( 1, 6 + 42 + 4 );
+    UINT8 *p = dp;
+    UINT32 number = part + 1;
+    UINT64 start = 2048 + part * 0x100000;
+    UINT64 size = 0x100000;
+
+    if( !dp )
+        return NULL;
+
+    p = put_node( p, HARDWARE_DEVICE_PATH, HW_PCI_DP, 6 );
+    p[0] = 0;
+    p[1] = disk;
+    p += 2;
+
+    p = put_node( p, MEDIA_DEVICE_PATH, MEDIA_HARDDRIVE_DP, 42 );
+    memcpy( p, &number, 4 );
+    memcpy( p + 4, &start, 8 );
+    memcpy( p + 12, &size, 8 );
+    memcpy( p + 20, guid, 16 );
+    p[36] = MBR_TYPE_EFI_PARTITION_TABLE_HEADER;
+    p[37] = SIGNATURE_TYPE_GUID;
+    p += 38;
+
+    put_node( p, END_DEVICE_PATH_TYPE, END_ENTIRE_DEVICE_PATH_SUBTYPE, 4 );
+
+    return (EFI_DEVICE_PATH *) dp;
+}
+
+EFI_STATUS mockfw_add_volume (CONST CHAR8 *root,
+                              CONST CHAR8 *label,
+                              CONST EFI_GUID *part_guid,
+                              UINTN disk,
+                              UINTN esp)
+{
+    mock_volume *v;
+    UINTN i;
+
+    if( n_volumes >= MOCK_MAX_VOLUMES )
+        return EFI_OUT_OF_RESOURCES;
+
+    v = &volumes[ n_volumes ];
+    memset( v, 0, sizeof(*v) );
+
+    v->root = realpath( (const char *) root, NULL );
+    v->dp   = volume_path( disk, n_volumes, part_guid );
+
+    if( !v->root || !v->dp )
+    {
+        free( v->root );
+        free( v->dp );
+        return EFI_NOT_FOUND;
+    }
+
+    v->fs.Revision = EFI_FILE_IO_INTERFACE_REVISION;
+    MOCK_SLOT( v->fs.OpenVolume, open_volume );
+
+    v->pi.revision = 0x1000;
+    v->pi.type     = PARTITION_TYPE_GPT;
+    v->pi.system   = esp ? 1 : 0;
+    v->pi.info.gpt.type   = esp ? esp_type : fat_type;
+    v->pi.info.gpt.unique = *part_guid;
+
+    for( i = 0; label[ i ] && i < 35; i++ )
+        v->pi.info.gpt.name[ i ] = label[ i ];
+
+    // the chainloader lives on the first volume added:
+    if( n_volumes == 0 )
+        self_image.DeviceHandle = v;
+
+    n_volumes++;
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS mockfw_init (OUT EFI_HANDLE *image, OUT EFI_SYSTEM_TABLE **table)
+{
+    // anything we don't implement fails cleanly rather than crashing:
+    for( VOID **f = (VOID **) ( &bs.Hdr + 1 ); f < (VOID **) ( &bs + 1 ); f++ )
+        *f = (VOID *) unsupported;
+    for( VOID **f = (VOID **) ( &rt.Hdr + 1 ); f < (VOID **) ( &rt + 1 ); f++ )
+        *f = (VOID *) unsupported;
+    for( VOID **f = (VOID **) &con_out; f < (VOID **) &con_out.Mode; f++ )
+        *f = (VOID *) unsupported;
+
+    MOCK_SLOT( bs.AllocatePool      , allocate_pool );
+    MOCK_SLOT( bs.FreePool          , free_pool );
+    MOCK_SLOT( bs.AllocatePages     , allocate_pages );
+    MOCK_SLOT( bs.FreePages         , free_pages );
+    MOCK_SLOT( bs.Stall             , stall );
+    MOCK_SLOT( bs.HandleProtocol    , handle_protocol );
+    MOCK_SLOT( bs.LocateHandle      , locate_handle );
+    MOCK_SLOT( bs.LocateHandleBuffer, locate_handle_buffer );
+    MOCK_SLOT( bs.LocateProtocol    , locate_protocol );
+    MOCK_SLOT( bs.CreateEvent       , create_event );
+    MOCK_SLOT( bs.SetTimer          , set_timer );
+    MOCK_SLOT( bs.CheckEvent        , check_event );
+    MOCK_SLOT( bs.WaitForEvent      , wait_for_event );
+    MOCK_SLOT( bs.CloseEvent        , close_event );
+
+    MOCK_SLOT( rt.GetVariable, get_variable );
+    MOCK_SLOT( rt.SetVariable, set_variable );
+    MOCK_SLOT( rt.GetTime    , get_time );
+
+    MOCK_SLOT( con_out.OutputString, output_string );
+    con_out.Mode = &con_mode;
+
+    self_image.Revision      = EFI_IMAGE_INFORMATION_REVISION;
+    self_image.SystemTable   = &st;
+    self_image.ImageDataType = EfiLoaderData;
+    self_image.ImageCodeType = EfiLoaderCode;
+
+    st.Hdr.Signature  = EFI_SYSTEM_TABLE_SIGNATURE;
+    st.FirmwareVendor = L"steamcl-hostbench";
+    st.ConOut         = &con_out;
+    st.RuntimeServices = &rt;
+    st.BootServices    = &bs;
+
+    *image = &self_handle;
+    *table = &st;
+
+    return EFI_SUCCESS;
+}
+
+// =========================================================================
+// synthetic scenarios
+
+CONST CHAR8 *mockfw_scenario_dir (VOID)
+{
+    if( !scenario )
+    {
+        char tmpl[] = "/tmp/steamcl-bench.XXXXXX";
+
+        if( mkdtemp( tmpl ) )
+            scenario = strdup( tmpl );
+    }
+
+    return (CONST CHAR8 *) scenario;
+}
+
+static int write_file (const char *root, const char *rel, const void *data, size_t size)
+{
+    char *path = malloc( strlen( root ) + strlen( rel ) + 2 );
+    int rv = -1;
+    int fd;
+
+    sprintf( path, "%s/%s", root, rel );
+
+    // make the parent directories:
+    for( char *s = path + strlen( root ) + 1; (s = strchr( s, '/' )); *s++ = '/' )
+    {
+        *s = '\0';
+        mkdir( path, 0755 );
+    }
+
+    fd = open( path, O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+    if( fd >= 0 )
+    {
+        rv = ( write( fd, data, size ) == (ssize_t) size ) ? 0 : -1;
+        close( fd );
+    }
+
+    free( path );
+
+    return rv;
+}
+
+// a file the chainloader will accept as an x86_64 PE32+ loader:
+static int write_stub_loader (const char *root, UINTN bytes)
+{
+    UINT8 *pe;
+    int rv;
+
+    bytes = ( bytes < 512 ) ? 512 : bytes;
+    if( !(pe = calloc( 1, bytes )) )
+        return -1;
+
+    pe[0] = 'M';
+    pe[1] = 'Z';
+    pe[ 0x3c ] = 0x80;
+    memcpy( pe + 0x80, "PE\0\0", 4 );
+    pe[ 0x84 ] = 0x64;
+    pe[ 0x85 ] = 0x86;
+
+    rv = write_file( root, "EFI/steamos/grubx64.efi", pe, bytes );
+    free( pe );
+
+    return rv;
+}
+
+EFI_STATUS mockfw_synth_volume (CONST CHAR8 *name,
+                                CONST EFI_GUID *guid,
+                                UINTN disk,
+                                UINTN esp,
+                                CONST CHAR8 *bootconf,
+                                UINTN loader_bytes)
+{
+    const char *top = (const char *) mockfw_scenario_dir();
+    char *root;
+    EFI_STATUS res = EFI_SUCCESS;
+
+    if( !top )
+        return EFI_DEVICE_ERROR;
+
+    root = malloc( strlen( top ) + strlen( (const char *) name ) + 2 );
+    sprintf( root, "%s/%s", top, name );
+    mkdir( root, 0755 );
+
+    if( bootconf &&
+        ( write_file( root, "SteamOS/bootconf",
+                      bootconf, strlena( bootconf ) ) ||
+          write_stub_loader( root, loader_bytes ) ) )
+        res = EFI_DEVICE_ERROR;
+
+    if( res == EFI_SUCCESS )
+        res = mockfw_add_volume( (CONST CHAR8 *) root, name, guid, disk, esp );
+
+    free( root );
+
+    return res;
+}
+
+static int remove_entry (const char *path,
+                         const struct stat *st,
+                         int type,
+                         struct FTW *ftw)
+{
+    (void) st;
+    (void) type;
+    (void) ftw;
+
+    return remove( path );
+}
+
+VOID mockfw_scenario_cleanup (VOID)
+{
+    if( scenario )
+        nftw( scenario, remove_entry, 16, FTW_DEPTH|FTW_PHYS );
+
+    free( scenario );
+    scenario = NULL;
+}
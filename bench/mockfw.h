@@ -0,0 +1,87 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <efi.h>
+
+// A mock of just enough of the firmware (boot services, runtime
+// variables and time, the console, simple file system and file
+// protocols) for the chainloader's selection code to run as an ordinary
+// Linux process, each volume backed by a host directory.
+// Nothing here may include util.h: see bench/hostbench.c.
+
+#define MOCK_MAX_VOLUMES 64
+
+// the firmware entry points we count and can slow down:
+typedef enum
+{
+    MOCK_OPEN_VOLUME,
+    MOCK_OPEN,
+    MOCK_READ,
+    MOCK_GET_INFO,
+    MOCK_CLOSE,
+    MOCK_HANDLE_PROTOCOL,
+    MOCK_LOCATE_HANDLE,
+    MOCK_GET_VARIABLE,
+    MOCK_SET_VARIABLE,
+    MOCK_CALLS,
+} mock_call;
+
+typedef struct
+{
+    UINT64 count[ MOCK_CALLS ];
+    UINT64 bytes_read;
+} mock_stats;
+
+EFI_STATUS mockfw_init (OUT EFI_HANDLE *image, OUT EFI_SYSTEM_TABLE **st);
+
+// disk 0 is the one the chainloader was "loaded from" (volume 0):
+EFI_STATUS mockfw_add_volume (CONST CHAR8 *root,
+                              CONST CHAR8 *label,
+                              CONST EFI_GUID *part_guid,
+                              UINTN disk,
+                              UINTN esp);
+
+CONST CHAR16 *mockfw_call_name (mock_call call);
+mock_call mockfw_call_id (CONST CHAR8 *name);
+
+// per-call latency in µs, and the read rate in MB/s (0: instant):
+VOID mockfw_set_latency (mock_call call, UINT64 usec);
+UINT64 mockfw_get_latency (mock_call call);
+VOID mockfw_set_read_rate (UINT64 mbps);
+UINT64 mockfw_get_read_rate (VOID);
+
+VOID mockfw_stats_reset (VOID);
+VOID mockfw_stats_get (OUT mock_stats *stats);
+VOID mockfw_clear_variables (VOID);
+
+UINTN mockfw_volume_index (EFI_HANDLE handle);
+UINT64 mockfw_usec (VOID);
+
+// synthetic scenarios, under a temporary directory:
+CONST CHAR8 *mockfw_scenario_dir (VOID);
+EFI_STATUS mockfw_synth_volume (CONST CHAR8 *name,
+                                CONST EFI_GUID *guid,
+                                UINTN disk,
+                                UINTN esp,
+                                CONST CHAR8 *bootconf,
+                                UINTN loader_bytes);
+VOID mockfw_scenario_cleanup (VOID);
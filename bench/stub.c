@@ -0,0 +1,50 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+// Stand-in for grub under util/steamcl-boottime: prints the timings the
+// chainloader published just before starting us, then powers off.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "util.h"
+
+EFI_STATUS
+EFIAPI
+efi_main (EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *sys_table)
+{
+    static EFI_GUID steamos_guid = STEAMOS_VENDOR_GUID;
+    CHAR16 *phases;
+    CHAR16 *probes;
+
+    InitializeLib( image_handle, sys_table );
+
+    phases = LibGetVariable( L"ChainloaderTimeUSec", &steamos_guid );
+    probes = LibGetVariable( L"ChainloaderProbeUSec", &steamos_guid );
+
+    // one line, so the serial log is easy to pick apart:
+    Print( L"steamcl-stub: %s probes:%s\n",
+           phases ?: L"-", ( probes && *probes ) ? probes : L"-" );
+
+    uefi_call_wrapper( RT->ResetSystem, 4, EfiResetShutdown, EFI_SUCCESS,
+                       0, NULL );
+
+    return EFI_SUCCESS;
+}
@@ -4,15 +4,43 @@
 #include <stdarg.h>
 #include <limits.h>
 #include <time.h>
+#include <dirent.h>
+#include <ctype.h>
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #include <unistd.h>
 
 #include "bootconf.h"
 #include <chainloader/config.h>
 #include "config-extra.h"
+#include <chainloader/epoch.h>
+#include <chainloader/mirror.h>
 
 #define DEFAULT_OUTPUT     -3
 #define OVERWRITE_INPUT    -2
+
+// when overwriting the input, what to do about <input>.bin:
+typedef enum
+{
+    SIDECAR_AUTO = 0, // rewrite it if it exists
+    SIDECAR_WRITE,    // always write it
+    SIDECAR_NONE,     // leave it alone
+} sidecar_mode;
+
+// likewise the NVRAM mirror of the ranking fields (chainloader/mirror.h):
+typedef enum
+{
+    MIRROR_AUTO = 0, // rewrite it if it exists
+    MIRROR_WRITE,    // always write it
+    MIRROR_NONE,     // delete it if it exists (rather than leave it stale)
+} mirror_mode;
+
+#define EFIVARFS "/sys/firmware/efi/efivars"
+// the chainloader's remembered loader choice (LOADER_CACHE_VAR, cache.h):
+#define LOADER_CACHE_EFIVAR \
+    EFIVARFS "/ChainloaderLastGood-" STEAMOS_VENDOR_GUID_STR
+#define PARTUUID_DIR "/dev/disk/by-partuuid"
 #define NO_BOOTCONF_OUTPUT -1
 
 typedef enum
@@ -33,6 +61,8 @@ typedef struct
 
 UINTN verbose = 0;
 int output_fd;
+static sidecar_mode sidecar;
+static mirror_mode efivar_mirror;
 static const char *progname;
 static const char *input_file;
 static int file_arg;
@@ -41,6 +71,8 @@ static int set_entry   (int n, int argc, char **argv, cfg_entry *cfg);
 static int get_entry   (int n, int argc, char **argv, cfg_entry *cfg);
 static int del_entry   (int n, int argc, char **argv, cfg_entry *cfg);
 static int set_output  (int n, int argc, char **argv, cfg_entry *cfg);
+static int set_sidecar (int n, int argc, char **argv, cfg_entry *cfg);
+static int set_mirror  (int n, int argc, char **argv, cfg_entry *cfg);
 static int set_mode    (int n, int argc, char **argv, cfg_entry *cfg);
 static int set_window  (int n, int argc, char **argv, cfg_entry *cfg);
 static int show_help   (unused int n,
@@ -56,6 +88,8 @@ static arg_handler arg_handlers[] =
     { "--get"          , 1, get_entry   , ARG_STD   },
     { "--del"          , 1, del_entry   , ARG_STD   },
     { "--output-to"    , 1, set_output  , ARG_EARLY },
+    { "--sidecar"      , 1, set_sidecar , ARG_EARLY },
+    { "--efivar-mirror", 1, set_mirror  , ARG_EARLY },
     { "--mode"         , 1, set_mode    , ARG_STD   },
     { "--update-window", 2, set_window  , ARG_STD   },
     { NULL }
@@ -150,6 +184,8 @@ static int usage (const char *msg, ...)
     --mode <update|update-other|shutdown|reboot|reboot-other|booted>         \n\
     --update-window <0|START> <0|END>                                        \n\
     --output-to <stdout|nowhere|input>                                       \n\
+    --sidecar <auto|write|none>                                              \n\
+    --efivar-mirror <auto|write|none>                                        \n\
                                                                              \n\
 If an error occurs before final output, the bootconf file will not be        \n\
 rewritten. It is still possible that an error during the writing of said     \n\
@@ -173,7 +209,20 @@ START and END may be:                                                        \n\
   nowhere - not emitted (useful if you are using --get)                      \n\
   input   - the input path will be overwritten with the modified data        \n\
   NOTE: this does not affect output from --get commands and similar - only   \n\
-  the destination of the full modified bootconf data.\n"
+  the destination of the full modified bootconf data.                        \n\
+                                                                             \n\
+--sidecar controls the binary copy (/path/to/bootconf.bin) the chainloader   \n\
+  can read instead of parsing the text, when the input is overwritten:       \n\
+  auto    - rewrite it if it already exists (the default)                    \n\
+  write   - always write it                                                  \n\
+  none    - leave it alone (the chainloader ignores a stale sidecar)         \n\
+                                                                             \n\
+--efivar-mirror controls the EFI variable the chainloader ranks images by    \n\
+  without mounting them (SteamOSBootconf-<PARTUUID of the input's fs>),      \n\
+  when the input is overwritten:                                             \n\
+  auto    - rewrite it if it already exists (the default)                    \n\
+  write   - always write it                                                  \n\
+  none    - delete it if it exists, rather than leave it stale\n"
            );
 
     return msg ? -1 : 0;
@@ -224,18 +273,18 @@ static int set_entry (int n, int argc, char **argv, cfg_entry *cfg)
     {
       case cfg_uint:
       case cfg_bool:
-        if( !set_conf_uint( c, name, nval ) )
+        if( !set_conf_uint( cfg, name, nval ) )
             error( EINVAL, "Error: could not set %s to %lu", name, nval );
         break;
 
       case cfg_stamp:
-        if( !set_conf_stamp( c, name, nval ) )
+        if( !set_conf_stamp( cfg, name, nval ) )
             error( EINVAL, "Error: could not set %s to %lu", name, nval );
         break;
 
       case cfg_string:
       case cfg_path:
-        if( !set_conf_string( c, name, value ) )
+        if( !set_conf_string( cfg, name, value ) )
             error( EINVAL, "Error: could not set %s to '%s'", name, value );
         break;
 
@@ -312,6 +361,182 @@ static int set_output (int n, int argc, char **argv, unused cfg_entry *cfg)
     return 1;
 }
 
+static int set_sidecar (int n, int argc, char **argv, unused cfg_entry *cfg)
+{
+    if( n + 1 >= argc )
+        return usage( "Error: %s requires 1 argument", argv[ n ] );
+
+    const char *what = argv[ n + 1 ];
+
+    if( strcmp( what, "auto" ) == 0 )
+        sidecar = SIDECAR_AUTO;
+    else if( strcmp( what, "write" ) == 0 )
+        sidecar = SIDECAR_WRITE;
+    else if( strcmp( what, "none" ) == 0 )
+        sidecar = SIDECAR_NONE;
+    else
+        return usage( "Unknown --sidecar value '%s'", what );
+
+    return 1;
+}
+
+static int set_mirror (int n, int argc, char **argv, unused cfg_entry *cfg)
+{
+    if( n + 1 >= argc )
+        return usage( "Error: %s requires 1 argument", argv[ n ] );
+
+    const char *what = argv[ n + 1 ];
+
+    if( strcmp( what, "auto" ) == 0 )
+        efivar_mirror = MIRROR_AUTO;
+    else if( strcmp( what, "write" ) == 0 )
+        efivar_mirror = MIRROR_WRITE;
+    else if( strcmp( what, "none" ) == 0 )
+        efivar_mirror = MIRROR_NONE;
+    else
+        return usage( "Unknown --efivar-mirror value '%s'", what );
+
+    return 1;
+}
+
+// the efivarfs path of the mirror for the partition cfg_fd lives on,
+// found by matching its device against the by-partuuid symlinks:
+static char *efivar_mirror_path (int cfg_fd)
+{
+    struct stat input = {};
+    struct dirent *d;
+    char *path = NULL;
+    DIR *dir;
+
+    if( fstat( cfg_fd, &input ) )
+        return NULL;
+
+    if( !(dir = opendir( PARTUUID_DIR )) )
+        return NULL;
+
+    while( !path && (d = readdir( dir )) )
+    {
+        struct stat part = {};
+
+        if( strlen( d->d_name ) != 36 ||
+            fstatat( dirfd( dir ), d->d_name, &part, 0 ) ||
+            !S_ISBLK( part.st_mode ) ||
+            part.st_rdev != input.st_dev )
+            continue;
+
+        // the chainloader prints the guid in lower case:
+        for( char *c = d->d_name; *c; c++ )
+            *c = tolower( *c );
+
+        path = calloc( sizeof(EFIVARFS "/" MIRROR_VAR_PREFIX "-") +
+                       36 + sizeof(STEAMOS_VENDOR_GUID_STR), 1 );
+        sprintf( path, "%s/%s%.36s-%s", EFIVARFS,
+                 MIRROR_VAR_PREFIX, d->d_name, STEAMOS_VENDOR_GUID_STR );
+    }
+
+    closedir( dir );
+
+    return path;
+}
+
+// efivarfs marks variables it doesn't know to be harmless immutable:
+static void efivar_make_writable (const char *path)
+{
+    int fd = open( path, O_RDONLY );
+    int flags;
+
+    if( fd < 0 )
+        return;
+
+    if( ioctl( fd, FS_IOC_GETFLAGS, &flags ) == 0 &&
+        (flags & FS_IMMUTABLE_FL) )
+    {
+        flags &= ~FS_IMMUTABLE_FL;
+        ioctl( fd, FS_IOC_SETFLAGS, &flags );
+    }
+
+    close( fd );
+}
+
+static int write_mirror (const char *path, const cfg_entry *cfg)
+{
+    int fd;
+    int ok;
+
+    efivar_make_writable( path );
+
+    fd = open( path, O_WRONLY|O_CREAT, 0644 );
+    if( fd < 0 )
+    {
+        perror( "EFI variable mirror not written" );
+        return 0;
+    }
+
+    ok = write_efivar_mirror( fd, cfg ) != 0;
+    if( !ok )
+        perror( "EFI variable mirror not written" );
+
+    close( fd );
+
+    return ok;
+}
+
+// the chainloader only checks the generation of the mirror it picks, so
+// a mirror we are not rewriting must not be left behind to go stale:
+static void drop_mirror (const char *path)
+{
+    efivar_make_writable( path );
+
+    if( unlink( path ) && errno != ENOENT )
+        perror( "Stale EFI variable mirror not deleted" );
+}
+
+// the chainloader only checks its cached choice against that image's own
+// bootconf, so rewriting any bootconf (eg another image's, to switch to
+// it) has to make it do a full scan on the next boot:
+static void drop_loader_cache (void)
+{
+    efivar_make_writable( LOADER_CACHE_EFIVAR );
+
+    if( unlink( LOADER_CACHE_EFIVAR ) && errno != ENOENT )
+        perror( "Chainloader loader cache not cleared" );
+}
+
+// <input>.bin, for the text we just wrote to cfg_fd:
+static void write_sidecar (int cfg_fd, const cfg_entry *cfg)
+{
+    struct stat text = {};
+    char *path = NULL;
+    int fd;
+
+    if( sidecar == SIDECAR_NONE )
+        return;
+
+    path = calloc( strlen( input_file ) + 5, 1 );
+    sprintf( path, "%s.bin", input_file );
+
+    if( sidecar == SIDECAR_AUTO && access( path, F_OK ) )
+        goto out;
+
+    if( fstat( cfg_fd, &text ) )
+        goto out;
+
+    fd = open( path, O_WRONLY|O_CREAT|O_TRUNC, 0644 );
+    if( fd < 0 )
+    {
+        perror( "Sidecar not written" );
+        goto out;
+    }
+
+    if( !write_bootbin( fd, cfg, &text ) )
+        perror( "Sidecar not written" );
+
+    close( fd );
+
+out:
+    free( path );
+}
+
 static int set_timestamped_note (cfg_entry *cfg, const char *note)
 {
     char stamp[32];
@@ -331,7 +556,7 @@ static int set_timestamped_note (cfg_entry *cfg, const char *note)
 
     str = calloc( strlen( prefix ) + strlen( note ) + 1, 1 );
     sprintf( str, "%s%s", prefix, note );
-    rv = set_conf_string( cfg, "comment", str );
+    rv = cfg_set_comment( cfg, str );
     free( str );
 
     return rv;
@@ -347,9 +572,9 @@ static int set_mode (int n, int argc, char **argv, cfg_entry *cfg)
     // to update the _other_ partition we must boot this one:
     if( strcmp( action, "update-other" ) == 0 )
     {
-        set_conf_uint( cfg, "boot-other", 0 );
-        set_conf_uint( cfg, "update",     1 );
-        set_conf_stamp_time( cfg, "boot-requested-at", time(NULL) );
+        cfg_set_boot_other( cfg, 0 );
+        cfg_set_update( cfg, 1 );
+        cfg_set_boot_requested_at_time( cfg, time(NULL) );
         set_timestamped_note( cfg, "bootconf mode: update (other)" );
         return 1;
     }
@@ -357,46 +582,45 @@ static int set_mode (int n, int argc, char **argv, cfg_entry *cfg)
     // similarly to update this partition we must boot the other one:
     if( strcmp( action, "update") == 0 )
     {
-        set_conf_uint( cfg, "boot-other", 1 );
-        set_conf_uint( cfg, "update",     1 );
-        set_conf_stamp_time( cfg, "boot-requested-at", time(NULL) );
+        cfg_set_boot_other( cfg, 1 );
+        cfg_set_update( cfg, 1 );
+        cfg_set_boot_requested_at_time( cfg, time(NULL) );
         set_timestamped_note( cfg, "bootconf mode: update (self)" );
         return 1;
     }
 
     if( strcmp( action, "shutdown") == 0 )
     {
-        set_conf_uint( cfg, "boot-other", 0 );
-        set_conf_uint( cfg, "update",     0 );
+        cfg_set_boot_other( cfg, 0 );
+        cfg_set_update( cfg, 0 );
         set_timestamped_note( cfg, "bootconf mode: shutdown" );
         return 1;
     }
 
     if( strcmp( action, "reboot") == 0 )
     {
-        set_conf_uint( cfg, "boot-other", 0 );
-        set_conf_uint( cfg, "update",     0 );
-        set_conf_stamp_time( cfg, "boot-requested-at", time(NULL) );
+        cfg_set_boot_other( cfg, 0 );
+        cfg_set_update( cfg, 0 );
+        cfg_set_boot_requested_at_time( cfg, time(NULL) );
         set_timestamped_note( cfg, "bootconf mode: reboot (self)" );
         return 1;
     }
 
     if( strcmp( action, "reboot-other") == 0 )
     {
-        set_conf_uint( cfg, "boot-other", 1 );
-        set_conf_uint( cfg, "update",     0 );
-        set_conf_stamp_time( cfg, "boot-requested-at", time(NULL) );
+        cfg_set_boot_other( cfg, 1 );
+        cfg_set_update( cfg, 0 );
+        cfg_set_boot_requested_at_time( cfg, time(NULL) );
         set_timestamped_note( cfg, "bootconf mode: reboot (other)" );
         return 1;
     }
 
     if( strcmp( action, "booted") == 0 )
     {
-        uint64_t nth = get_conf_uint( cfg, "boot-count" );
-        set_conf_uint( cfg, "invalid"      , 0 );
-        set_conf_uint( cfg, "boot-attempts", 0 );
-        set_conf_uint( cfg, "boot-count"   , nth + 1 );
-        set_conf_stamp_time( cfg, "boot-time", time(NULL) );
+        uint64_t nth = cfg_boot_count( cfg );
+        cfg_set_boot_attempts( cfg, 0 );
+        cfg_set_boot_count( cfg, nth + 1 );
+        cfg_set_boot_time_time( cfg, time(NULL) );
         set_timestamped_note( cfg, "bootconf mode: boot-ok" );
         return 1;
     }
@@ -404,63 +628,55 @@ static int set_mode (int n, int argc, char **argv, cfg_entry *cfg)
     return usage( "Unknown --action value '%s'", action );
 }
 
+// seconds east of UTC in the local timezone at when:
+static long utc_offset (time_t when)
+{
+    struct tm tm;
+
+    localtime_r( &when, &tm );
+
+    return tm.tm_gmtoff;
+}
+
+// local wall clock seconds to epoch seconds, with the offset in effect
+// at that moment (which may not be the current one, eg across DST):
+static INT64 local_to_epoch (INT64 local)
+{
+    return local - utc_offset( (time_t) ( local - utc_offset( local ) ) );
+}
+
 static unsigned long timestamp_to_datestamp (unsigned long hhmm,
                                              unsigned long after)
 {
-    time_t tloc = 0;
-    struct tm *now;
-    unsigned long hhmm_now;
-    unsigned long stamp;
-
-    // when is an integer but it's actually an HHMM timestamp
-    // we'd use time_t values and seconds but EFI doesn't have
-    // decent time API so we have to calculate YYYYmmDDHHMMSS
-    // style integer stamps like a 14th century peasant.
+    time_t now = time( NULL );
+    INT64 local;
+    INT64 target;
+    UINT64 today;
+
+    // when is an integer but it's actually an HHMM timestamp.
+    // The datestamp arithmetic is the chainloader's own (epoch.h), so
+    // both sides agree on what any given stamp means.
     if( hhmm >= 2359 )
         return hhmm;
 
     int mm = hhmm % 100;
     int hh = (hhmm - mm) / 100;
 
-    time( &tloc );
-    now = localtime( &tloc );
-    hhmm_now = (now->tm_hour * 100) + now->tm_min;
+    // HH:MM today, interpreted as a local time:
+    local  = (INT64) now + utc_offset( now );
+    today  = epoch_to_datestamp( local ) / 1000000 * 1000000;
+    target = datestamp_to_epoch( today + hh * 10000 + mm * 100 );
 
-    // easy case, the time requested, interpreted as a local time in the
-    // current day, is later than the current local time:
-    if( hhmm > hhmm_now )
-    {
-        now->tm_hour = hh;
-        now->tm_min  = mm;
-        now->tm_sec  = 0;
-        stamp = structtm_to_stamp( now );
-    }
-    else
-    {
-        // jump to the next day:
-        tloc += 86400;
-        now = localtime( &tloc );
-        now->tm_hour = hh;
-        now->tm_min  = mm;
-        now->tm_sec  = 0;
-        stamp = structtm_to_stamp( now );
-    }
+    // if that's already passed, jump to the next day:
+    if( target <= local )
+        target += SECS_PER_DAY;
 
-    // if we must be fter a certain time but we aren't, jump another
+    // if we must be after a certain time but we aren't, jump another
     // 24 hours into the future:
-    if( stamp < after )
-    {
-        tloc += 86400;
-        now = localtime( &tloc );
-        now->tm_hour = hh;
-        now->tm_min  = mm;
-        now->tm_sec  = 0;
-    }
+    if( after && local_to_epoch( target ) < datestamp_to_epoch( after ) )
+        target += SECS_PER_DAY;
 
-    tloc = mktime( now );
-    now  = gmtime( &tloc );
-
-    return structtm_to_stamp( now );
+    return epoch_to_datestamp( local_to_epoch( target ) );
 }
 
 static int set_window (int n, int argc, char **argv, cfg_entry *cfg)
@@ -485,8 +701,8 @@ static int set_window (int n, int argc, char **argv, cfg_entry *cfg)
     if( !strcmp( end, "0000") || ((wend > 0) && (wend < 2360)) )
         wend = timestamp_to_datestamp( wend, wbeg );
 
-    if( !set_conf_uint( cfg, "update-window-start", wbeg ) ||
-        !set_conf_uint( cfg, "update-window-end"  , wend ) )
+    if( !cfg_set_update_window_start( cfg, wbeg ) ||
+        !cfg_set_update_window_end( cfg, wend ) )
         error( EINVAL, "Could not set update window (internal error?)" );
 
     return 1;
@@ -545,6 +761,8 @@ int main (int argc, char **argv)
 {
     int cfg_fd = -1;
     cfg_entry *config = NULL;
+    char *mirror = NULL;
+    int rewrite_mirror = 0;
 
     progname = argv[0];
 
@@ -582,6 +800,19 @@ int main (int argc, char **argv)
         // that to happen given opened it just above, and if you
         // used this on a fifo you get to keep the pieces:
         lseek( cfg_fd, SEEK_SET, 0 );
+
+        // any mirror there is of this file is out of date from here on:
+        // it is either rewritten with the new generation or deleted:
+        mirror = efivar_mirror_path( cfg_fd );
+        rewrite_mirror = ( mirror && efivar_mirror != MIRROR_NONE &&
+                           ( efivar_mirror == MIRROR_WRITE ||
+                             access( mirror, F_OK ) == 0 ) );
+        if( rewrite_mirror )
+            cfg_set_mirror_generation( config,
+                                       cfg_mirror_generation( config ) + 1 );
+        else if( efivar_mirror == MIRROR_WRITE )
+            fprintf( stderr, "No PARTUUID for '%s': "
+                             "EFI variable mirror not written\n", input_file );
         break;
 
       default:
@@ -595,8 +826,19 @@ int main (int argc, char **argv)
         // if we're overwriting our input it may end up shrinking:
         if( (output_fd == cfg_fd) && ftruncate( output_fd, written ) )
             perror( "Output file not truncated - may be the wrong size" );
+
+        if( output_fd == cfg_fd )
+        {
+            write_sidecar( cfg_fd, config );
+            drop_loader_cache();
+        }
+
+        if( output_fd == cfg_fd && mirror &&
+            !( rewrite_mirror && write_mirror( mirror, config ) ) )
+            drop_mirror( mirror );
     }
 
+    free( mirror );
     free_config( &config );
 
     return 0;
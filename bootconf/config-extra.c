@@ -3,8 +3,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 
 #include "config-extra.h"
+#include <chainloader/epoch.h>
+#include <chainloader/bootbin.h>
+#include <chainloader/mirror.h>
 
 #define S(x) ((const char *)(x).value.string.bytes ?: (const char *)"<NULL>")
 
@@ -36,9 +43,14 @@ void dump_config (cfg_entry *c)
         }
 }
 
-uint64_t set_conf_uint (const cfg_entry *cfg, const char *name, uint64_t val)
+// name based setters are for keys from the command line: everything else
+// should use the typed cfg_set_* accessors (config-extra.h), which index
+// the config directly:
+#define KEY_OF(cfg, c) ( (bootspec_key) ( (c) - (cfg) ) )
+
+uint64_t set_key_uint (const cfg_entry *cfg, bootspec_key key, uint64_t val)
 {
-    cfg_entry *c = (cfg_entry *) get_conf_item (cfg, (unsigned char *)name);
+    cfg_entry *c = (cfg_entry *) cfg_item( cfg, key );
 
     if (!c)
         return 0;
@@ -61,9 +73,16 @@ uint64_t set_conf_uint (const cfg_entry *cfg, const char *name, uint64_t val)
     return 1;
 }
 
-uint64_t set_conf_string (const cfg_entry *cfg, const char *name, const char *val)
+uint64_t set_conf_uint (const cfg_entry *cfg, const char *name, uint64_t val)
 {
-    cfg_entry *c = (cfg_entry *) get_conf_item (cfg, (unsigned char *)name);
+    const cfg_entry *c = get_conf_item (cfg, (unsigned char *)name);
+
+    return c ? set_key_uint( cfg, KEY_OF( cfg, c ), val ) : 0;
+}
+
+uint64_t set_key_string (const cfg_entry *cfg, bootspec_key key, const char *val)
+{
+    cfg_entry *c = (cfg_entry *) cfg_item( cfg, key );
 
     if (!c)
         return 0;
@@ -77,7 +96,14 @@ uint64_t set_conf_string (const cfg_entry *cfg, const char *name, const char *va
         // .size does NOT include the terminating NULL of the initial contents:
         // this may not hold true if a shorter string has been assigned since
         // but that's not a case that need concern us here:
-        if( c->value.string.size < l)
+        // values parsed from the file are slices of the config's arena,
+        // which can't grow in place, so they get a buffer of their own:
+        if( conf_value_in_arena( cfg, c->value.string.bytes ) )
+        {
+            c->value.string.bytes = calloc( 1, l + 1 );
+            c->value.string.size  = l;
+        }
+        else if( c->value.string.size < l)
         {
             c->value.string.bytes = realloc( c->value.string.bytes, l + 1 );
             c->value.string.size  = l;
@@ -94,31 +120,31 @@ uint64_t set_conf_string (const cfg_entry *cfg, const char *name, const char *va
     return 1;
 }
 
-uint64_t set_conf_stamp (const cfg_entry *cfg, const char *name, uint64_t val)
+uint64_t set_conf_string (const cfg_entry *cfg, const char *name, const char *val)
 {
-    if( (val != 0) && (val < 19700101000000) )
-        return 0;
+    const cfg_entry *c = get_conf_item (cfg, (unsigned char *)name);
 
-    return set_conf_uint (cfg, name, val);
+    return c ? set_key_string( cfg, KEY_OF( cfg, c ), val ) : 0;
 }
 
-uint64_t structtm_to_stamp (const struct tm *when)
+uint64_t set_key_stamp (const cfg_entry *cfg, bootspec_key key, uint64_t val)
 {
-    return ( when->tm_sec                     +
-             when->tm_min           * 100         +
-             when->tm_hour          * 10000       +
-             when->tm_mday          * 1000000     +
-             (when->tm_mon  + 1)    * 100000000   +
-             (when->tm_year + 1900) * 10000000000 );
+    if( (val != 0) && (val < 19700101000000) )
+        return 0;
+
+    return set_key_uint (cfg, key, val);
 }
 
-uint64_t set_conf_stamp_time(const cfg_entry *cfg, const char *name, time_t when)
+uint64_t set_conf_stamp (const cfg_entry *cfg, const char *name, uint64_t val)
 {
-    const struct tm *now = gmtime( &when );
+    const cfg_entry *c = get_conf_item (cfg, (unsigned char *)name);
 
-    uint64_t stamp = structtm_to_stamp( now );
+    return c ? set_key_stamp( cfg, KEY_OF( cfg, c ), val ) : 0;
+}
 
-    return set_conf_stamp( cfg, name, stamp );
+uint64_t set_key_stamp_time (const cfg_entry *cfg, bootspec_key key, time_t when)
+{
+    return set_key_stamp( cfg, key, epoch_to_datestamp( (INT64) when ) );
 }
 
 uint64_t del_conf_item (const cfg_entry *cfg, const char *name)
@@ -128,7 +154,8 @@ uint64_t del_conf_item (const cfg_entry *cfg, const char *name)
     if( !c )
         return 1;
 
-    free( c->value.string.bytes );
+    if( !conf_value_in_arena( cfg, c->value.string.bytes ) )
+        free( c->value.string.bytes );
     c->value.string.bytes = NULL;
     c->value.string.size  = 0;
     c->value.number.u     = 0;
@@ -190,6 +217,21 @@ write_item (char **buf, size_t *size, size_t offset, const cfg_entry *cfg)
     return w;
 }
 
+static int write_all (int fd, const unsigned char *buf, size_t size)
+{
+    for( size_t out = size; out > 0; )
+    {
+        ssize_t o = write( fd, buf + (size - out), out );
+
+        if( o < 0 )
+            return 0;
+
+        out -= o;
+    }
+
+    return 1;
+}
+
 size_t write_config (int fd, const cfg_entry *cfg)
 {
     int flags = 0;
@@ -219,15 +261,8 @@ size_t write_config (int fd, const cfg_entry *cfg)
         written += w;
     }
 
-    for( size_t out = written; out > 0; )
-    {
-        ssize_t o = write( fd, buf + (written - out), out );
-
-        if( o < 0 )
-            goto fail;
-
-        out -= o;
-    }
+    if( !write_all( fd, (unsigned char *)buf, written ) )
+        goto fail;
 
     free( buf );
     return written;
@@ -236,3 +271,173 @@ fail:
     free( buf );
     return -1;
 }
+
+// minutes west of UTC that vfat on dev shifts timestamps by (as the
+// kernel's fat_tz_offset does): the time_offset= or tz=UTC mount option
+// if there is one, otherwise the kernel's timezone. glibc (2.31 on)
+// always zeroes gettimeofday's timezone, so that has to be the syscall:
+static long fat_minuteswest (dev_t dev)
+{
+    struct timeval tv;
+    struct timezone tz = { 0 };
+    char line[ 4096 ];
+    long west = 0;
+    int found = 0;
+    FILE *mounts = fopen( "/proc/self/mountinfo", "r" );
+
+    while( mounts && !found && fgets( line, sizeof(line), mounts ) )
+    {
+        unsigned int maj, min;
+        const char *opts;
+        const char *o;
+
+        // id parent major:minor root mount-point options ... - type source super-options
+        if( sscanf( line, "%*d %*d %u:%u", &maj, &min ) != 2 ||
+            maj != major( dev ) || min != minor( dev ) )
+            continue;
+
+        if( !(opts = strstr( line, " - " )) )
+            continue;
+
+        if( (o = strstr( opts, ",time_offset=" )) )
+            west = -strtol( o + strlen( ",time_offset=" ), NULL, 10 );
+        else if( strstr( opts, ",tz=UTC" ) )
+            west = 0;
+        else
+            break;
+
+        found = 1;
+    }
+
+    if( mounts )
+        fclose( mounts );
+
+    if( found )
+        return west;
+
+#ifdef SYS_gettimeofday
+    syscall( SYS_gettimeofday, &tv, &tz );
+#else
+    gettimeofday( &tv, &tz );
+#endif
+
+    return tz.tz_minuteswest;
+}
+
+// Write the binary sidecar (see chainloader/bootbin.h) for cfg, which
+// has just been written out as text to a file whose stat is text.
+// The mtime is recorded the way the ESP's FAT will have stored it: as
+// wall clock time, shifted by whatever timezone vfat applies there:
+size_t write_bootbin (int fd, const cfg_entry *cfg, const struct stat *text)
+{
+    size_t size = BOOTBIN_OFF_STRINGS( bootspec_key_count );
+    uint64_t present = 0;
+    uint64_t mtime;
+    unsigned char *buf;
+    size_t pos;
+
+    if( !cfg )
+        return 0;
+
+    for( uint i = 0; i < bootspec_key_count; i++ )
+        if( cfg[i].type == cfg_string || cfg[i].type == cfg_path )
+            size += 4 + ( cfg[i].name ? cfg[i].value.string.size : 0 ) + 1;
+
+    buf = calloc( 1, size );
+    if( !buf )
+        return 0;
+
+    mtime = epoch_to_datestamp( text->st_mtime -
+                                fat_minuteswest( text->st_dev ) * 60 );
+
+    memcpy( buf, BOOTBIN_MAGIC, 4 );
+    bootbin_put( buf + BOOTBIN_OFF_VERSION, 2, BOOTBIN_VERSION );
+    bootbin_put( buf + BOOTBIN_OFF_KEYS   , 2, bootspec_key_count );
+    bootbin_put( buf + BOOTBIN_OFF_SIZE   , 4, size );
+    bootbin_put( buf + BOOTBIN_OFF_MTIME  , 8, BOOTBIN_MTIME( mtime ) );
+    bootbin_put( buf + BOOTBIN_OFF_TSIZE  , 8, text->st_size );
+
+    pos = BOOTBIN_OFF_STRINGS( bootspec_key_count );
+
+    for( uint i = 0; i < bootspec_key_count; i++ )
+    {
+        const cfg_entry *c = cfg_item( cfg, i );
+        size_t len = 0;
+
+        if( c )
+            present |= 1ULL << i;
+
+        switch( cfg[i].type )
+        {
+          case cfg_uint:
+          case cfg_bool:
+          case cfg_stamp:
+            bootbin_put( buf + BOOTBIN_OFF_NUMBERS + 8 * i, 8,
+                         c ? c->value.number.u : 0 );
+            break;
+
+          case cfg_string:
+          case cfg_path:
+            // .size may be larger than the current string (see set_conf_string)
+            if( c && c->value.string.bytes )
+                len = strnlen( (const char *)c->value.string.bytes,
+                               c->value.string.size );
+            bootbin_put( buf + pos, 4, len );
+            if( len )
+                memcpy( buf + pos + 4, c->value.string.bytes, len );
+            pos += 4 + len + 1;
+            break;
+
+          default:
+            break;
+        }
+    }
+
+    // strings shorter than their allocation leave slack at the end:
+    size = pos;
+    bootbin_put( buf + BOOTBIN_OFF_SIZE, 4, size );
+    bootbin_put( buf + BOOTBIN_OFF_PRESENT, 8, present );
+    bootbin_put( buf + BOOTBIN_OFF_CRC, 4,
+                 bootbin_crc32( buf + BOOTBIN_OFF_MTIME,
+                                size - BOOTBIN_OFF_MTIME ) );
+
+    if( !write_all( fd, buf, size ) )
+        size = 0;
+
+    free( buf );
+
+    return size;
+}
+
+// Write the NVRAM mirror of cfg (see chainloader/mirror.h) to fd, an
+// efivarfs file: efivarfs wants the attributes and the value in a
+// single write:
+size_t write_efivar_mirror (int fd, const cfg_entry *cfg)
+{
+    unsigned char buf[ 4 + MIRROR_SIZE ] = { 0 };
+    unsigned char *rec = buf + 4;
+    uint32_t flags = 0;
+
+    if( !cfg )
+        return 0;
+
+    if( cfg_boot_other( cfg ) )
+        flags |= MIRROR_BOOT_OTHER;
+    if( cfg_image_invalid( cfg ) )
+        flags |= MIRROR_IMAGE_INVALID;
+    if( cfg_update( cfg ) )
+        flags |= MIRROR_UPDATE;
+
+    bootbin_put( buf, 4, MIRROR_VAR_ATTRS );
+    bootbin_put( rec + MIRROR_OFF_VERSION     , 4, MIRROR_VERSION );
+    bootbin_put( rec + MIRROR_OFF_GENERATION  , 8, cfg_mirror_generation( cfg ) );
+    bootbin_put( rec + MIRROR_OFF_REQUESTED_AT, 8, cfg_boot_requested_at( cfg ) );
+    bootbin_put( rec + MIRROR_OFF_WINDOW_START, 8, cfg_update_window_start( cfg ) );
+    bootbin_put( rec + MIRROR_OFF_WINDOW_END  , 8, cfg_update_window_end( cfg ) );
+    bootbin_put( rec + MIRROR_OFF_FLAGS       , 4, flags );
+
+    if( write( fd, buf, sizeof(buf) ) != (ssize_t) sizeof(buf) )
+        return 0;
+
+    return sizeof(buf);
+}
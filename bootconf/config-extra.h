@@ -1,6 +1,7 @@
 #pragma once
 
 #include "bootconf.h"
+#include <sys/stat.h>
 #include <chainloader/config.h>
 
 void dump_config (cfg_entry *config);
@@ -10,8 +11,35 @@ uint64_t set_conf_string (const cfg_entry *cfg, const char *name, const char *va
 uint64_t set_conf_stamp  (const cfg_entry *cfg, const char *name, uint64_t val);
 uint64_t del_conf_item   (const cfg_entry *cfg, const char *name);
 size_t   write_config    (int fd, const cfg_entry *cfg);
+size_t   write_bootbin   (int fd, const cfg_entry *cfg, const struct stat *text);
+size_t   write_efivar_mirror (int fd, const cfg_entry *cfg);
 ssize_t  snprint_item    (const char *buf, size_t space, const cfg_entry *c);
 
-uint64_t set_conf_stamp_time(const cfg_entry *cfg, const char *name, time_t when);
-uint64_t structtm_to_stamp  (const struct tm *when);
+
+uint64_t set_key_uint       (const cfg_entry *cfg, bootspec_key key, uint64_t val);
+uint64_t set_key_string     (const cfg_entry *cfg, bootspec_key key, const char *val);
+uint64_t set_key_stamp      (const cfg_entry *cfg, bootspec_key key, uint64_t val);
+uint64_t set_key_stamp_time (const cfg_entry *cfg, bootspec_key key, time_t when);
+
+// typed setters to go with the getters in config.h:
+// cfg_set_boot_other( cfg, 1 ), cfg_set_boot_time_time( cfg, time(NULL) ) etc.
+#define CFG_NUMBER_SETTER(id) \
+    static inline uint64_t cfg_set_##id (const cfg_entry *cfg, uint64_t val) \
+    { return set_key_uint( cfg, bootspec_##id, val ); }
+
+#define CFG_STRING_SETTER(id) \
+    static inline uint64_t cfg_set_##id (const cfg_entry *cfg, const char *val) \
+    { return set_key_string( cfg, bootspec_##id, val ); }
+
+#define CFG_SETTER_cfg_uint(id)   CFG_NUMBER_SETTER(id)
+#define CFG_SETTER_cfg_bool(id)   CFG_NUMBER_SETTER(id)
+#define CFG_SETTER_cfg_string(id) CFG_STRING_SETTER(id)
+#define CFG_SETTER_cfg_path(id)   CFG_STRING_SETTER(id)
+#define CFG_SETTER_cfg_stamp(id)  CFG_NUMBER_SETTER(id) \
+    static inline uint64_t cfg_set_##id##_time (const cfg_entry *cfg, time_t when) \
+    { return set_key_stamp_time( cfg, bootspec_##id, when ); }
+
+#define CFG_SETTER(t, id, n) CFG_SETTER_##t(id)
+
+BOOTSPEC_KEYS(CFG_SETTER)
 
@@ -23,6 +23,7 @@
 #define strcmpa(x,y)    strcmp((char *)x,(char *)y)
 #define CopyMem(d,s,l)  memcpy(d,s,l)
 #define efi_alloc(s)    calloc(1, s)
+#define efi_alloc_raw(s) malloc(s)
 #define efi_free(p)     free(p)
 
 #define EFI_SUCCESS 0
@@ -32,8 +33,11 @@
 typedef unsigned int EFI_STATUS;
 typedef void VOID;
 typedef unsigned char CHAR8;
+typedef uint32_t UINT32;
 typedef uint64_t UINT64;
 typedef uint64_t UINTN;
+typedef int64_t INTN;
+typedef int64_t INT64;
 typedef char16_t CHAR16;
 
 int Print(const char16_t *f, ...);
@@ -0,0 +1,212 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "err.h"
+#include "util.h"
+#include "arena.h"
+#include "alloctrace.h"
+
+#if ALLOC_TRACE
+
+typedef struct
+{
+    CONST CHAR8 *file;
+    UINTN line;
+    UINT64 allocs;
+    UINT64 bytes;
+    UINTN live;
+    UINT64 live_bytes;
+} alloc_site;
+
+typedef struct
+{
+    VOID *p;
+    UINTN size;
+    alloc_site *site;
+} alloc_block;
+
+static alloc_site sites[ ALLOC_TRACE_SITES ];
+static alloc_block blocks[ ALLOC_TRACE_BLOCKS ];
+static UINTN n_sites;
+static UINTN n_blocks;
+
+static struct
+{
+    UINT64 allocs;
+    UINT64 frees;
+    UINT64 live;
+    UINT64 peak;
+    UINT64 untracked; // allocations we had no room to remember
+} totals;
+
+// __FILE__ is a string constant, so the pointer is enough to tell
+// sites apart (and all the allocating files are in one directory):
+static alloc_site *site_of (CONST CHAR8 *file, UINTN line)
+{
+    for( UINTN i = 0; i < n_sites; i++ )
+        if( sites[ i ].line == line && sites[ i ].file == file )
+            return &sites[ i ];
+
+    if( n_sites >= ALLOC_TRACE_SITES )
+        return NULL;
+
+    sites[ n_sites ].file = file;
+    sites[ n_sites ].line = line;
+
+    return &sites[ n_sites++ ];
+}
+
+static VOID drop_block (UINTN i)
+{
+    alloc_site *site = blocks[ i ].site;
+
+    if( site )
+    {
+        site->live--;
+        site->live_bytes -= blocks[ i ].size;
+    }
+
+    totals.live -= blocks[ i ].size;
+    blocks[ i ] = blocks[ --n_blocks ];
+}
+
+VOID *alloc_trace_alloc (UINTN size, UINTN zero, CONST CHAR8 *file, UINTN line)
+{
+    VOID *p = arena_alloc( size, zero );
+    alloc_site *site;
+
+    if( !p )
+        return NULL;
+
+    totals.allocs++;
+    site = site_of( file, line );
+
+    if( site )
+    {
+        site->allocs++;
+        site->bytes += size;
+    }
+
+    if( n_blocks >= ALLOC_TRACE_BLOCKS )
+    {
+        totals.untracked++;
+        return p;
+    }
+
+    blocks[ n_blocks ].p    = p;
+    blocks[ n_blocks ].size = size;
+    blocks[ n_blocks ].site = site;
+    n_blocks++;
+
+    if( site )
+    {
+        site->live++;
+        site->live_bytes += size;
+    }
+
+    totals.live += size;
+    if( totals.live > totals.peak )
+        totals.peak = totals.live;
+
+    return p;
+}
+
+// also takes pool memory that libefi allocated (StrDuplicate,
+// LibLocateHandle etc), which we never saw and just free:
+VOID alloc_trace_free (VOID *p)
+{
+    if( !p )
+        return;
+
+    // most frees are of recent allocations:
+    for( UINTN i = n_blocks; i > 0; i-- )
+        if( blocks[ i - 1 ].p == p )
+        {
+            totals.frees++;
+            drop_block( i - 1 );
+            break;
+        }
+
+    if( !arena_free( p ) )
+        FreePool( p );
+}
+
+// for arena_release, which discards a range of allocations wholesale:
+VOID alloc_trace_forget (VOID *from, VOID *to)
+{
+    for( UINTN i = n_blocks; i > 0; i-- )
+        if( (UINT8 *) blocks[ i - 1 ].p >= (UINT8 *) from &&
+            (UINT8 *) blocks[ i - 1 ].p <  (UINT8 *) to )
+            drop_block( i - 1 );
+}
+
+static CONST CHAR8 *site_file (CONST alloc_site *site)
+{
+    CONST CHAR8 *base = site->file;
+
+    for( CONST CHAR8 *c = site->file; *c; c++ )
+        if( *c == '/' )
+            base = c + 1;
+
+    return base;
+}
+
+// blocks still allocated are leaks if this runs just before the loader
+// starts: those in the pool stay in the memory map it is handed, those
+// in the arena went back to the firmware with it:
+VOID alloc_trace_dump (VOID)
+{
+    UINTN in_pool = 0;
+    UINT64 pool_bytes = 0;
+    CHAR16 where[ 32 ];
+
+    for( UINTN i = 0; i < n_blocks; i++ )
+        if( !arena_contains( blocks[ i ].p ) )
+        {
+            in_pool++;
+            pool_bytes += blocks[ i ].size;
+        }
+
+    Print( L"Allocations: %lu made, %lu freed, %lu bytes at peak, "
+           L"%lu bytes in %d blocks live (%lu bytes in %d pool blocks)\n",
+           totals.allocs, totals.frees, totals.peak,
+           totals.live, n_blocks, pool_bytes, in_pool );
+
+    if( totals.untracked || n_sites >= ALLOC_TRACE_SITES )
+        Print( L"  (%lu allocations not tracked, %d sites max)\n",
+               totals.untracked, ALLOC_TRACE_SITES );
+
+    Print( L"  %-20s %8s %10s %6s %10s\n",
+           L"site", L"allocs", L"bytes", L"live", L"live bytes" );
+
+    for( UINTN i = 0; i < n_sites; i++ )
+    {
+        alloc_site *s = &sites[ i ];
+
+        SPrint( where, sizeof(where), L"%a:%d", site_file( s ), s->line );
+        Print( L"  %-20s %8lu %10lu %6d %10lu\n",
+               where, s->allocs, s->bytes, s->live, s->live_bytes );
+    }
+}
+
+#endif
@@ -0,0 +1,51 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <efi.h>
+
+// 1: efi_alloc, efi_alloc_raw, efi_free (and so ALLOC_OR_GOTO) keep
+//    count of live and peak bytes, allocations per call site and which
+//    blocks are still allocated when the loader starts (alloc_trace_dump)
+// 0: they are plain functions (util.c)
+// Set at build time with eg -DALLOC_TRACE=1 (steamcl-bench.efi has it on)
+#ifndef ALLOC_TRACE
+#define ALLOC_TRACE 0
+#endif
+
+// blocks tracked at once, and distinct call sites: anything past these
+// is still allocated and freed, but only counted:
+#define ALLOC_TRACE_BLOCKS 1024
+#define ALLOC_TRACE_SITES  128
+
+#if ALLOC_TRACE
+
+VOID *alloc_trace_alloc (UINTN size, UINTN zero, CONST CHAR8 *file, UINTN line);
+VOID alloc_trace_free (VOID *p);
+VOID alloc_trace_forget (VOID *from, VOID *to);
+VOID alloc_trace_dump (VOID);
+
+#else
+
+#define alloc_trace_forget(from, to) do { } while( 0 )
+static inline VOID alloc_trace_dump (VOID) { }
+
+#endif
@@ -0,0 +1,142 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "err.h"
+#include "util.h"
+#include "arena.h"
+
+// allocations are never freed individually: the bump pointer only moves
+// back via arena_release (or if the most recent allocation is freed).
+// Anything that doesn't fit, or is allocated before arena_init or after
+// arena_shutdown, comes from the pool instead.
+static struct
+{
+    UINT8 *base;
+    UINTN size;
+    UINTN used;
+    UINTN last;  // offset of the most recent allocation
+    UINTN live;  // base..base+size is ours (cleared by arena_shutdown)
+    UINTN peak;
+} arena;
+
+VOID arena_init (VOID)
+{
+    EFI_PHYSICAL_ADDRESS addr = 0;
+    EFI_STATUS res;
+
+    if( !ALLOC_ARENA || arena.live )
+        return;
+
+    res = uefi_call_wrapper( BS->AllocatePages, 4, AllocateAnyPages,
+                             EfiLoaderData,
+                             EFI_SIZE_TO_PAGES( ALLOC_ARENA_SIZE ), &addr );
+    WARN_STATUS( res, L"arena: falling back to pool allocation" );
+
+    if( res != EFI_SUCCESS )
+        return;
+
+    arena.base = (UINT8 *) (UINTN) addr;
+    arena.size = ALLOC_ARENA_SIZE;
+    arena.used = 0;
+    arena.last = 0;
+    arena.peak = 0;
+    arena.live = 1;
+}
+
+// hand the whole region back to the firmware. Pointers into it are still
+// recognised by arena_free (and ignored) afterwards, so cleanup code
+// that runs if the loader returns to us is harmless:
+VOID arena_shutdown (VOID)
+{
+    if( !arena.live )
+        return;
+
+    if( verbose )
+        Print( L"arena: %lu of %lu bytes used at peak\n",
+               (UINT64) arena.peak, (UINT64) arena.size );
+
+    arena.live = 0;
+    uefi_call_wrapper( BS->FreePages, 2,
+                       (EFI_PHYSICAL_ADDRESS) (UINTN) arena.base,
+                       EFI_SIZE_TO_PAGES( arena.size ) );
+}
+
+// true of arena allocations even after arena_shutdown:
+UINTN arena_contains (VOID *p)
+{
+    return ( arena.base &&
+             (UINT8 *) p >= arena.base &&
+             (UINT8 *) p <  arena.base + arena.size ) ? 1 : 0;
+}
+
+VOID *arena_alloc (UINTN size, UINTN zero)
+{
+    UINTN start = ( arena.used + ALLOC_ALIGN - 1 ) & ~(UINTN) ( ALLOC_ALIGN - 1 );
+    VOID *p;
+
+    if( !arena.live || size > arena.size || start > arena.size - size )
+        return zero ? AllocateZeroPool( size ) : AllocatePool( size );
+
+    p = arena.base + start;
+    arena.last = start;
+    arena.used = start + size;
+
+    if( arena.used > arena.peak )
+        arena.peak = arena.used;
+
+    if( zero )
+        ZeroMem( p, size );
+
+    return p;
+}
+
+// returns 0 if p is not an arena allocation (and is the caller's to free)
+UINTN arena_free (VOID *p)
+{
+    if( !arena_contains( p ) )
+        return 0;
+
+    // cheap to undo the last allocation, eg a temporary path:
+    if( arena.live && (UINT8 *) p == arena.base + arena.last )
+        arena.used = arena.last;
+
+    return 1;
+}
+
+UINTN arena_mark (VOID)
+{
+    return arena.used;
+}
+
+// forget everything allocated since mark: only for scopes whose
+// allocations are all dead, already freed, and not still being written
+// to by the firmware (eg abandoned async reads):
+VOID arena_release (UINTN mark)
+{
+    if( arena.live && mark <= arena.used )
+    {
+        alloc_trace_forget( arena.base + mark, arena.base + arena.used );
+        arena.used = mark;
+        arena.last = mark;
+    }
+}
@@ -0,0 +1,47 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <efi.h>
+
+// 1: efi_alloc & co. bump-allocate from one AllocatePages region
+// 0: every allocation is a separate AllocatePool call (for comparison)
+#ifndef ALLOC_ARENA
+#define ALLOC_ARENA 1
+#endif
+
+// the arena only holds small things (paths, configs, headers): loader
+// and initrd images have their own page allocations (efi_alloc_pages)
+#ifndef ALLOC_ARENA_SIZE
+#define ALLOC_ARENA_SIZE ( 2 * 1024 * 1024 )
+#endif
+
+#define ALLOC_ALIGN 16
+
+VOID arena_init (VOID);
+VOID arena_shutdown (VOID);
+
+VOID *arena_alloc (UINTN size, UINTN zero);
+UINTN arena_free (VOID *p);
+UINTN arena_contains (VOID *p);
+
+UINTN arena_mark (VOID);
+VOID arena_release (UINTN mark);
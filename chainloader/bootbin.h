@@ -0,0 +1,76 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+// SteamOS\bootconf.bin: a binary copy of SteamOS\bootconf, written by
+// steamos-bootconf, that the chainloader can use without parsing.
+// All integers are little endian:
+//
+//   0  magic    "SBC1"
+//   4  version  u16 BOOTBIN_VERSION
+//   6  keys     u16 number of bootspec keys (must match ours)
+//   8  size     u32 total size of the file
+//  12  crc32    u32 of bytes 16 .. size
+//  16  mtime    u64 the text file's mtime as a datestamp, even seconds
+//  24  tsize    u64 the text file's size
+//  32  present  u64 bit N set: key N is present (ie not deleted)
+//  40  numbers  u64 × keys: the value of each numeric key (0 otherwise)
+//  ..  strings  for each string or path key, in bootspec order:
+//               u32 length, length bytes, NUL
+//
+// The sidecar is only used if it is intact and was written for the
+// text file as it is now (same size and mtime): otherwise the text is
+// parsed as usual.
+
+#define BOOTBIN_PATH    L"SteamOS\\bootconf.bin"
+#define BOOTBIN_MAGIC   "SBC1"
+#define BOOTBIN_VERSION 1
+
+#define BOOTBIN_OFF_VERSION  4
+#define BOOTBIN_OFF_KEYS     6
+#define BOOTBIN_OFF_SIZE     8
+#define BOOTBIN_OFF_CRC      12
+#define BOOTBIN_OFF_MTIME    16
+#define BOOTBIN_OFF_TSIZE    24
+#define BOOTBIN_OFF_PRESENT  32
+#define BOOTBIN_OFF_NUMBERS  40
+#define BOOTBIN_OFF_STRINGS(keys) ( BOOTBIN_OFF_NUMBERS + 8 * (keys) )
+
+// FAT only keeps mtimes to 2 seconds:
+#define BOOTBIN_MTIME(stamp) ( (stamp) - ( (stamp) % 100 ) % 2 )
+
+static inline UINT64 bootbin_get (CONST CHAR8 *p, UINTN bytes)
+{
+    UINT64 v = 0;
+
+    while( bytes-- )
+        v = ( v << 8 ) | p[ bytes ];
+
+    return v;
+}
+
+static inline VOID bootbin_put (CHAR8 *p, UINTN bytes, UINT64 v)
+{
+    for( UINTN i = 0; i < bytes; i++, v >>= 8 )
+        p[ i ] = (CHAR8) ( v & 0xff );
+}
+
+UINT32 bootbin_crc32 (CONST CHAR8 *data, UINTN size);
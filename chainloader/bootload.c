@@ -24,10 +24,20 @@
 
 #include "err.h"
 #include "util.h"
+#include "epoch.h"
 #include "fileio.h"
 #include "bootload.h"
 #include "debug.h"
 #include "exec.h"
+#include "timing.h"
+#include "fwtrace.h"
+#include "cache.h"
+#include "partition.h"
+#include "linux.h"
+#include "lz4.h"
+#include "sha256.h"
+#include "arena.h"
+#include "mirror.h"
 
 // this is x86_64 specific
 #define EFI_STUB_ARCH 0x8664
@@ -36,21 +46,56 @@ EFI_STATUS valid_efi_binary (EFI_FILE_PROTOCOL *dir, CONST CHAR16 *path)
 {
     EFI_STATUS res;
     EFI_FILE_PROTOCOL *bin = NULL;
-    CHAR8 header[512] = { '0','x','d','e','a','d','b','e','e','f', 0, 0 };
+    CHAR8 header[PE_HEADER_SIZE] = { '0','x','d','e','a','d','b','e','e','f', 0 };
     CONST UINTN hsize = sizeof(header);
     UINTN bytes = hsize;
-    UINTN s;
-    UINT16 arch;
 
     res = efi_file_open( dir, &bin, path, 0, 0 );
     ERROR_RETURN( res, res, L"open( %s )", path );
 
     res = efi_file_read( bin, (CHAR8 *)header, &bytes );
+    efi_file_close( bin );
     ERROR_RETURN( res, res, L"read( %s, %u )", path, hsize );
 
-    efi_file_close( bin );
+    return valid_loader_header( header, bytes );
+}
+
+// a compressed loader can only be checked properly once it has been
+// decompressed (see read_loader), so just accept the frame magic here:
+EFI_STATUS valid_loader_header (CONST CHAR8 *header, UINTN bytes)
+{
+    if( lz4_frame_magic( (CONST UINT8 *) header, bytes ) )
+        return EFI_SUCCESS;
+
+    return valid_efi_header( header, bytes );
+}
+
+// path + ".lz4", or NULL if path already has that suffix:
+static CHAR16 *compressed_path (CONST CHAR16 *path)
+{
+    UINTN plen = StrLen( path );
+    UINTN slen = StrLen( LZ4_SUFFIX );
+    CHAR16 *lz = NULL;
+
+    if( plen >= slen && !StriCmp( (CHAR16 *) path + plen - slen, LZ4_SUFFIX ) )
+        return NULL;
+
+    lz = efi_alloc_raw( ( plen + slen + 1 ) * sizeof(CHAR16) );
+    if( lz )
+    {
+        StrCpy( lz, path );
+        StrCat( lz, LZ4_SUFFIX );
+    }
+
+    return lz;
+}
+
+EFI_STATUS valid_efi_header (CONST CHAR8 *header, UINTN bytes)
+{
+    UINTN s;
+    UINT16 arch;
 
-    if( bytes < hsize )
+    if( bytes < PE_HEADER_SIZE )
         return EFI_END_OF_FILE;
 
     if( header[0] != 'M' || header[1] != 'Z' )
@@ -78,17 +123,20 @@ typedef struct
 {
     EFI_HANDLE partition;
     EFI_DEVICE_PATH device_path;
+    EFI_FILE_PROTOCOL *root;
     CHAR16 *loader;
-    cfg_entry *cfg;
+    cfg_entry *cfg; // NULL until needed in lazy mode, see found_config
+    cfg_summary sum;
     UINT64 at;
+    UINT64 generation; // of the NVRAM mirror it was ranked from, if any
 } found_cfg;
 
-static UINTN update_scheduled_now (const cfg_entry *conf)
+static UINTN update_scheduled_now (const cfg_summary *sum)
 {
-    if( get_conf_uint( conf, "update" ) )
+    if( sum->update )
     {
-        UINT64 beg = get_conf_uint( conf, "update-window-start" );
-        UINT64 end = get_conf_uint( conf, "update-window-end"   );
+        UINT64 beg = sum->window_start;
+        UINT64 end = sum->window_end;
 
         // no beginning or end of update window specified,
         // update mode is unconditional:
@@ -99,11 +147,11 @@ static UINTN update_scheduled_now (const cfg_entry *conf)
 
         // only a window end is specified, update if we are before it:
         if( !beg )
-            return ( now <= beg ) ? 1 : 0;
+            return ( now <= end ) ? 1 : 0;
 
         // only a window start is specified, upate if we are after it:
         if( !end )
-            return ( now >= end ) ? 1 : 0;
+            return ( now >= beg ) ? 1 : 0;
 
         // both specified, update mode only if within time window:
         return (( now >= beg ) && ( now <= end )) ? 1 : 0;
@@ -114,22 +162,25 @@ static UINTN update_scheduled_now (const cfg_entry *conf)
 
 static VOID dump_found (found_cfg *c)
 {
-    for(UINTN i = 0; c && c->cfg; c++)
+    for(UINTN i = 0; c && c->partition; c++)
         Print( L"#%u %x @%lu %s%s[%s]\n",
                i++,
                c->partition,
                c->at,
-               get_conf_uint( c->cfg, "boot-other" ) ? L"OTHER " : L"",
-               update_scheduled_now( c->cfg )        ? L"UPDATE ": L"",
-               c->loader );
+               c->sum.boot_other               ? L"OTHER " : L"",
+               update_scheduled_now( &c->sum ) ? L"UPDATE ": L"",
+               c->loader ?: L"-" );
 }
 
 #define COPY_FOUND(src,dst) \
     ({ dst.cfg         = src.cfg;         \
+       dst.sum         = src.sum;         \
        dst.at          = src.at;          \
        dst.partition   = src.partition;   \
        dst.loader      = src.loader;      \
        dst.device_path = src.device_path; \
+       dst.root        = src.root;        \
+       dst.generation  = src.generation;  \
        dst.at          = src.at;          })
 
 UINTN swap_cfgs (found_cfg *f, UINTN a, UINTN b)
@@ -143,96 +194,406 @@ UINTN swap_cfgs (found_cfg *f, UINTN a, UINTN b)
     return 1;
 }
 
-EFI_STATUS choose_steamos_loader (EFI_HANDLE *handles,
-                                  CONST UINTN n_handles,
-                                  OUT bootloader *chosen)
+// overall budget for choose_steamos_loader: once it has passed we stop
+// probing and boot the best of whatever we have found so far:
+static deadline select_budget;
+static UINTN probes_timed_out;
+
+static UINTN already_found (found_cfg *found, UINTN j, EFI_HANDLE handle)
+{
+    for( UINTN i = 0; i < j; i++ )
+        if( found[ i ].partition == handle )
+            return 1;
+
+    return 0;
+}
+
+typedef struct
+{
+    probe_target *target;
+    EFI_FILE_PROTOCOL *root;
+    EFI_DEVICE_PATH *dp;
+    cfg_entry *conf;
+    cfg_summary sum;
+    CHAR16 *loader;
+    UINT64 done;
+    UINTN timed_out;
+    UINTN stuck; // firmware may still be using root: don't close it
+} probe_slot;
+
+// the loader named by the config (if any) or the default one:
+CHAR16 *candidate_loader (const cfg_summary *sum)
+{
+    CHAR8 *alt_cfg = sum->loader;
+
+    if( alt_cfg && *alt_cfg )
+    {
+        CHAR16 *alt_ldr = resolve_path( alt_cfg, BOOTCONFPATH, 1 );
+
+        if( alt_ldr )
+            return alt_ldr;
+    }
+
+    // a kernel command line or initrd but no loader: boot the kernel
+    // from its well-known location, skipping grub entirely:
+    if( sum->has_cmdline || sum->has_initrd )
+        return StrDuplicate( UKILDR );
+
+    return StrDuplicate( STEAMOSLDR );
+}
+
+// Summarise a candidate's bootconf text (which we own) and work out its
+// loader. In lazy mode the summary is all we keep: only the winner's
+// bootconf is fully parsed, by found_config. Otherwise the config takes
+// ownership of the text as before:
+static EFI_STATUS probe_config (probe_slot *s, CHAR8 *text, UINTN bytes)
+{
+    EFI_STATUS res;
+
+#if LAZY_BOOTCONF
+    res = summarise_config( text, bytes, &s->sum );
+#else
+    s->conf = new_config();
+    res = set_config_from_buffer( s->conf, text, bytes );
+    text = NULL;
+
+    if( res == EFI_SUCCESS )
+        config_summary( s->conf, &s->sum );
+#endif
+
+    // entry is known-bad. ignore it
+    if( res == EFI_SUCCESS && s->sum.image_invalid )
+        res = EFI_LOAD_ERROR;
+
+    if( res == EFI_SUCCESS )
+    {
+        s->loader = candidate_loader( &s->sum );
+        if( !s->loader )
+            res = EFI_OUT_OF_RESOURCES;
+    }
+
+    // the loader path in the summary may point into text:
+    s->sum.loader = NULL;
+    efi_free( text );
+
+    if( res != EFI_SUCCESS )
+        free_config( &s->conf );
+
+    return res;
+}
+
+// a candidate's full config, parsed on first use if we only have its
+// summary. NULL if it can't be had (the accessors treat that as empty):
+static cfg_entry *found_config (found_cfg *f)
+{
+    EFI_STATUS res;
+
+    if( f->cfg || !f->root )
+        return f->cfg;
+
+    res = parse_config( f->root, &f->cfg );
+    WARN_STATUS( res, L"bootconf re-read failed" );
+
+    if( res != EFI_SUCCESS )
+        free_config( &f->cfg );
+
+    return f->cfg;
+}
+
+// mount a batch of targets at a time and collect the ones with a valid
+// config and loader into found[j...] until there are limit entries,
+// returning the new number of entries.
+// The bootconf and loader header reads for all the volumes in a batch
+// are in flight together where the firmware supports it.
+// Each batch gets PROBE_TIMEOUT_MS, after which any volume that hasn't
+// answered is abandoned, and no new batch is started once the overall
+// selection budget has passed:
+static UINTN probe_targets (probe_target *targets,
+                            CONST UINTN n_targets,
+                            found_cfg *found,
+                            UINTN j,
+                            UINTN limit)
 {
     EFI_STATUS res;
-    EFI_FILE_PROTOCOL *root_dir = NULL;
     static EFI_GUID fs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
     static EFI_GUID dp_guid = DEVICE_PATH_PROTOCOL;
-    cfg_entry *conf = NULL;
-    UINTN j = 0;
-    found_cfg found[MAX_BOOTCONFS + 1] = { { NULL } };
+    probe_slot slot[ PROBE_BATCH ];
+    efi_read_req req[ PROBE_BATCH ];  // bootconfs
+    efi_read_req hreq[ PROBE_BATCH ]; // loader headers
+    UINTN map[ PROBE_BATCH ];
+    UINTN t = 0;
 
-    chosen->partition = NULL;
-    chosen->loader_path = NULL;
-    chosen->args = NULL;
-    chosen->config = NULL;
+    if( limit > MAX_BOOTCONFS )
+        limit = MAX_BOOTCONFS;
 
-    for ( UINTN i = 0; i < n_handles && j < MAX_BOOTCONFS; i++ )
+    while( t < n_targets && j < limit )
     {
-        EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs = NULL;
+        UINT64 start = read_tsc();
+        UINTN want = limit - j;
+        UINTN n = 0;
+        UINTN nh = 0;
+        UINTN found_before = j;
+        UINTN stuck = 0;
+        UINTN mark = arena_mark();
+        deadline batch;
+
+        if( deadline_passed( &select_budget ) )
+        {
+            if( verbose )
+                Print( L"Selection budget exhausted, %u targets unprobed\n",
+                       n_targets - t );
+            break;
+        }
 
-        efi_unmount( &root_dir );
+        res = deadline_start( &batch, PROBE_TIMEOUT_MS );
+        WARN_STATUS( res, L"no probe timeout available" );
 
-        res = get_handle_protocol( &handles[i], &fs_guid, (VOID **)&fs );
-        ERROR_CONTINUE( res, L"handle #%u: no simple file system protocol", i );
+        if( want > PROBE_BATCH )
+            want = PROBE_BATCH;
 
-        res = efi_mount( fs, &root_dir );
-        ERROR_CONTINUE( res, L"partition #%u not opened", i );
+        for( ; t < n_targets && n < want; t++ )
+        {
+            EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs = NULL;
+            EFI_HANDLE *handle = &targets[ t ].handle;
+            UINTN i = targets[ t ].index;
+            probe_slot *s = &slot[ n ];
 
-        res = get_handle_protocol( &handles[ i ], &dp_guid,
-                                   (VOID **)&found[ i ].device_path );
-        ERROR_CONTINUE( res, L"partition #%u has no device path (what?)", i );
+            if( already_found( found, j, *handle ) )
+                continue;
 
-        res = efi_file_exists( root_dir, BOOTCONFPATH );
-        if( res != EFI_SUCCESS )
-            continue;
+            ZeroMem( s, sizeof(*s) );
+            s->target = &targets[ t ];
 
-        if( parse_config( root_dir, &conf ) != EFI_SUCCESS )
-            continue;
+            res = get_handle_protocol( handle, &fs_guid, (VOID **)&fs );
+            ERROR_CONTINUE( res, L"handle #%u: no simple file system protocol", i );
 
-        // entry is known-bad. ignore it
-        if( get_conf_uint( conf, "image-invalid" ) > 0 )
-        {
-            free_config( &conf );
-            continue;
+            res = get_handle_protocol( handle, &dp_guid, (VOID **)&s->dp );
+            ERROR_CONTINUE( res, L"partition #%u has no device path (what?)", i );
+
+            res = efi_mount( fs, &s->root );
+            ERROR_CONTINUE( res, L"partition #%u not opened", i );
+
+            n++;
+
+            // a slow mount eats into the batch: probe what we have
+            if( deadline_passed( &batch ) )
+            {
+                t++;
+                break;
+            }
         }
 
-        // TODO? allow the 'loader' config entry to specify an alternative
-        // bootloader. This code was causing EFI runtime service errors
-        // that made the kernel explode on boot, so it's been backed out for
-        // now. May drop this feature entirely from the spec.
-        CHAR8 *alt_cfg = get_conf_str( conf, "loader" );
-        if( alt_cfg && *alt_cfg )
+        for( UINTN b = 0; b < n; b++ )
+            efi_read_req_init( &req[ b ], slot[ b ].root, BOOTCONFPATH, 0 );
+
+        res = efi_file_read_many( &req[0], n, &batch );
+        WARN_STATUS( res, L"bootconf reads" );
+
+        for( UINTN b = 0; b < n; b++ )
         {
-            CHAR16 *alt_ldr =
-              resolve_path( alt_cfg, BOOTCONFPATH, 1 );
+            probe_slot *s = &slot[ b ];
+
+            s->done      = req[ b ].completed;
+            s->timed_out = ( req[ b ].status == EFI_TIMEOUT );
+            s->stuck     = req[ b ].abandoned;
 
-            if( valid_efi_binary( root_dir, alt_ldr ) == EFI_SUCCESS )
-                found[ j ].loader = alt_ldr;
+            // probe_config takes ownership of the bootconf buffer:
+            if( req[ b ].status == EFI_SUCCESS )
+                probe_config( s, req[ b ].buf, req[ b ].bytes );
             else
-                efi_free( alt_ldr );
+                efi_free( req[ b ].buf );
+
+            req[ b ].buf = NULL;
+
+            if( !s->loader )
+                continue;
+
+            // a separate array: req[ b ] may be abandoned, and is never reused
+            efi_read_req_init( &hreq[ nh ], s->root, s->loader, PE_HEADER_SIZE );
+            map[ nh++ ] = b;
         }
-        efi_free( alt_cfg );
 
-        // use the default bootloader:
-        if( !found[ j ].loader )
-            if( valid_efi_binary( root_dir, STEAMOSLDR ) == EFI_SUCCESS )
-                found[ j ].loader = StrDuplicate( STEAMOSLDR );
+        res = efi_file_read_many( &hreq[0], nh, &batch );
+        WARN_STATUS( res, L"loader header reads" );
 
-        if( !found[ j ].loader )
+        for( UINTN h = 0; h < nh; h++ )
         {
-            free_config( &conf );
-            continue;
+            probe_slot *s = &slot[ map[ h ] ];
+
+            s->done       = hreq[ h ].completed;
+            s->timed_out |= ( hreq[ h ].status == EFI_TIMEOUT );
+            s->stuck     |= hreq[ h ].abandoned;
+            res = hreq[ h ].status;
+
+            if( res == EFI_SUCCESS )
+                res = valid_loader_header( hreq[ h ].buf, hreq[ h ].bytes );
+
+            efi_free( hreq[ h ].buf );
+
+            if( res == EFI_SUCCESS )
+                continue;
+
+            // only a compressed copy of the loader installed?
+            if( res == EFI_NOT_FOUND &&
+                !s->timed_out &&
+                !deadline_passed( &batch ) )
+            {
+                CHAR16 *lz = compressed_path( s->loader );
+
+                if( lz && valid_efi_binary( s->root, lz ) == EFI_SUCCESS )
+                {
+                    efi_free( s->loader );
+                    s->loader = lz;
+                    s->done   = read_tsc();
+                    continue;
+                }
+
+                efi_free( lz );
+            }
+
+            // an invalid alternative loader falls back to the default one:
+            if( !s->timed_out &&
+                !deadline_passed( &batch ) &&
+                StrCmp( s->loader, STEAMOSLDR ) &&
+                valid_efi_binary( s->root, STEAMOSLDR ) == EFI_SUCCESS )
+            {
+                efi_free( s->loader );
+                s->loader = StrDuplicate( STEAMOSLDR );
+                s->done   = read_tsc();
+                continue;
+            }
+
+            efi_free( s->loader );
+            s->loader = NULL;
         }
 
-        found[ j ].cfg       = conf;
-        found[ j ].partition = handles[ i ];
-        found[ j ].at        = get_conf_uint( conf, "boot-requested-at" );
-        j++;
+        for( UINTN b = 0; b < n; b++ )
+        {
+            probe_slot *s = &slot[ b ];
+
+            if( s->loader )
+            {
+                found[ j ].cfg         = s->conf;
+                found[ j ].sum         = s->sum;
+                found[ j ].loader      = s->loader;
+                found[ j ].partition   = s->target->handle;
+                found[ j ].device_path = *s->dp;
+                found[ j ].root        = s->root;
+                found[ j ].at          = s->sum.requested_at;
+                s->root = NULL;
+                j++;
+            }
+            else
+            {
+                free_config( &s->conf );
+                efi_free( s->loader );
+            }
+
+            if( s->timed_out )
+            {
+                probes_timed_out++;
+                WARN_STATUS( EFI_TIMEOUT, L"partition #%u probe abandoned",
+                             s->target->index );
+            }
+
+            if( !s->stuck )
+                efi_unmount( &s->root );
+            else
+                stuck++;
+
+            timing_probe_record( s->target->index,
+                                 ( s->done ?: read_tsc() ) - start );
+        }
+
+        deadline_stop( &batch );
+
+        // a batch that found nothing leaves nothing behind, so everything
+        // it allocated can go, unless the firmware may still write to it:
+        if( j == found_before && !stuck )
+            arena_release( mark );
     }
 
-    found[ j ].cfg = NULL;
-    efi_unmount( &root_dir );
+    found[ j ].cfg    = NULL;
+    found[ j ].loader = NULL;
 
-    if( verbose )
+    return j;
+}
+
+// The 'partitions' entry lists the unique partition guids of the sibling
+// images: turn it into a list of probe targets, skipping the partition
+// the config came from. Any unparseable or missing entry invalidates it.
+static EFI_STATUS directed_targets (found_cfg *from,
+                                   EFI_HANDLE *handles,
+                                   CONST UINTN n_handles,
+                                   OUT probe_target *targets,
+                                   OUT UINTN *n_targets)
+{
+    CHAR8 *list = cfg_partitions( found_config( from ) );
+    UINTN n = 0;
+
+    *n_targets = 0;
+
+    if( !list || !*list )
+        return EFI_NOT_FOUND;
+
+    while( *list )
     {
-        Print( L"Went through %u filesystems, %u SteamOS loaders found\n", n_handles, j);
-        dump_found( &found[0] );
+        EFI_GUID wanted;
+        UINTN found = 0;
+        UINTN used;
+
+        if( *list == ' ' || *list == ',' || *list == '\t' )
+        {
+            list++;
+            continue;
+        }
+
+        used = parse_guid( list, &wanted );
+        if( !used )
+            return EFI_INVALID_PARAMETER;
+
+        list += used;
+
+        for( UINTN i = 0; !found && i < n_handles; i++ )
+        {
+            EFI_GUID guid;
+
+            if( get_partition_guid( handles[ i ], &guid ) != EFI_SUCCESS )
+                continue;
+
+            if( CompareMem( &guid, &wanted, sizeof(guid) ) )
+                continue;
+
+            found = 1;
+
+            if( handles[ i ] == from->partition )
+                continue;
+
+            if( n >= MAX_PROBE_TARGETS )
+                return EFI_BUFFER_TOO_SMALL;
+
+            ZeroMem( &targets[ n ], sizeof(targets[ n ]) );
+            targets[ n ].handle = handles[ i ];
+            targets[ n ].index  = i;
+            targets[ n ].flags  = PART_GPT;
+            CopyMem( &targets[ n ].guid, &guid, sizeof(guid) );
+            n++;
+        }
+
+        if( !found )
+            return EFI_NOT_FOUND;
     }
 
+    *n_targets = n;
+
+    return n ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+// sort found[0 .. j-1] (oldest to newest) and pick the one to boot,
+// following boot-other: returns its index, or -1.
+// update is set if an update should happen on this boot:
+static INTN select_found (found_cfg *found, UINTN j, OUT UINTN *update)
+{
     // yes I know, bubble sort is terribly gauche, but we really don't care:
     // usually there will be only two entries (and at most 16, which would be
     // a fairly psychosis-inducing setup):
@@ -248,7 +609,8 @@ EFI_STATUS choose_steamos_loader (EFI_HANDLE *handles,
     // we now have a sorted (oldest to newest) list of configs
     // and their respective partition handles, none of which are known-bad.
     INTN selected = -1;
-    UINTN update  = 0;
+
+    *update = 0;
 
     // pick the newest entry to start with.
     // if boot-other is set, we need to bounce along to the next entry:
@@ -256,12 +618,12 @@ EFI_STATUS choose_steamos_loader (EFI_HANDLE *handles,
     {
         selected = i;
 
-        if( get_conf_uint( found[i].cfg, "boot-other" ) )
+        if( found[i].sum.boot_other )
         {
             // if boot-other is set, update should persist until we get to
             // a non-boot-other entry:
-            if( !update)
-                update = update_scheduled_now( found[i].cfg );
+            if( !*update )
+                *update = update_scheduled_now( &found[i].sum );
             continue;
         }
 
@@ -269,31 +631,296 @@ EFI_STATUS choose_steamos_loader (EFI_HANDLE *handles,
         break;
     }
 
-    if( selected > -1 )
+    // we never un-set an update we inherited from boot-other
+    // but we might have it set in our own config:
+    if( selected > -1 && !*update )
+        *update = update_scheduled_now( &found[selected].sum );
+
+    return selected;
+}
+
+// hand found[selected] over to chosen and free the rest:
+static VOID take_found (found_cfg *found,
+                        UINTN j,
+                        INTN selected,
+                        UINTN update,
+                        OUT bootloader *chosen)
+{
+    chosen->device_path = found[selected].device_path;
+    chosen->loader_path = found[selected].loader;
+    chosen->partition   = found[selected].partition;
+    chosen->config      = found_config( &found[selected] );
+    chosen->root        = found[selected].root;
+
+    found[selected].cfg    = NULL;
+    found[selected].loader = NULL;
+    found[selected].root   = NULL;
+
+    if( update )
+        chosen->args = L" steamos-update=1 ";
+
+    // only the plain "newest entry wins" decision is safe to replay
+    // without looking at the other candidates:
+    update_loader_cache( ( selected == (INTN) j - 1 && !update ) ?
+                         chosen : NULL );
+
+    // free the unused configs:
+    for( INTN i = 0; i < (INTN) j; i++ )
+    {
+        efi_free( found[ i ].loader );
+        free_config( &found[ i ].cfg );
+        efi_unmount( &found[ i ].root );
+    }
+}
+
+static UINTN same_ranking (const cfg_summary *a, const cfg_summary *b)
+{
+    return ( a->requested_at  == b->requested_at  &&
+             a->window_start  == b->window_start  &&
+             a->window_end    == b->window_end    &&
+             a->boot_other    == b->boot_other    &&
+             a->image_invalid == b->image_invalid &&
+             a->update        == b->update );
+}
+
+// open a mirrored image's partition and check the mirror is of the
+// bootconf that is there now:
+static EFI_STATUS mirror_in_sync (found_cfg *f)
+{
+    static EFI_GUID fs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+    static EFI_GUID dp_guid = DEVICE_PATH_PROTOCOL;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs = NULL;
+    EFI_DEVICE_PATH *dp = NULL;
+    EFI_STATUS res;
+
+    res = get_handle_protocol( &f->partition, &fs_guid, (VOID **) &fs );
+    ERROR_RETURN( res, res, L"mirror: no simple file system protocol" );
+
+    res = get_handle_protocol( &f->partition, &dp_guid, (VOID **) &dp );
+    ERROR_RETURN( res, res, L"mirror: no device path" );
+    f->device_path = *dp;
+
+    res = efi_mount( fs, &f->root );
+    ERROR_RETURN( res, res, L"mirror: partition not opened" );
+
+    if( !found_config( f ) )
+        res = EFI_NOT_FOUND;
+    ERROR_RETURN( res, res, L"mirror: bootconf not parsed" );
+
+    if( cfg_mirror_generation( f->cfg ) != f->generation )
+        res = EFI_NOT_FOUND;
+    ERROR_RETURN( res, res, L"mirror: out of sync with bootconf" );
+
+    return EFI_SUCCESS;
+}
+
+// Rank candidates from their NVRAM bootconf mirrors (see mirror.h) and
+// mount only the winner. If there are no mirrors, the winner's is out of
+// sync with its bootconf, a sibling it lists has no mirror, or its
+// loader isn't there, we fall back to the full scan:
+static EFI_STATUS choose_mirrored_loader (EFI_HANDLE *handles,
+                                          CONST UINTN n_handles,
+                                          OUT bootloader *chosen)
+{
+    found_cfg found[MAX_BOOTCONFS + 1] = { { NULL } };
+    probe_target targets[MAX_PROBE_TARGETS];
+    probe_target siblings[MAX_PROBE_TARGETS];
+    found_cfg *win = NULL;
+    cfg_summary sum;
+    UINTN n_targets;
+    UINTN n_siblings = 0;
+    UINTN unmirrored = 0;
+    UINTN update = 0;
+    UINTN j = 0;
+    INTN selected;
+    EFI_STATUS res = EFI_SUCCESS;
+
+    n_targets = order_probe_targets( handles, n_handles, PROBE_POLICY, targets );
+
+    for( UINTN i = 0; i < n_targets && j < MAX_BOOTCONFS; i++ )
     {
-        chosen->device_path = found[selected].device_path;
-        chosen->loader_path = found[selected].loader;
-        chosen->partition   = found[selected].partition;
-        chosen->config      = found[selected].cfg;
+        probe_target *t = &targets[ i ];
+
+        if( !( t->flags & PART_GPT ) )
+            continue;
+
+        // an image partition with no mirror (freshly installed, or written
+        // with --efivar-mirror none) might hold the newest image, so the
+        // ordered probe has to look at everything. Other partitions
+        // without one are assumed not to be images at all:
+        if( read_bootconf_mirror( &t->guid, &found[ j ].sum,
+                                  &found[ j ].generation ) != EFI_SUCCESS )
+        {
+            if( t->flags & PART_EFI_LABEL )
+                unmirrored++;
+            continue;
+        }
+
+        // entry is known-bad. ignore it
+        if( found[ j ].sum.image_invalid )
+            continue;
 
-        found[selected].cfg    = NULL;
-        found[selected].loader = NULL;
+        found[ j ].partition = t->handle;
+        found[ j ].at        = found[ j ].sum.requested_at;
+        j++;
+    }
+
+    // keep found[ j ] zeroed as the list terminator:
+    ZeroMem( &found[ j ], sizeof(found[ j ]) );
 
-        // we never un-set an update we inherited from boot-other
-        // but we might have it set in our own config:
-        if( !update )
-            update = update_scheduled_now( chosen->config );
+    if( j == 0 )
+        return EFI_NOT_FOUND;
 
-        if( update )
-            chosen->args = L" steamos-update=1 ";
+    if( verbose )
+        Print( L"%u bootconf mirrors in NVRAM, %u image partitions without\n",
+               j, unmirrored );
+
+    if( unmirrored )
+        res = EFI_NOT_FOUND;
+    ERROR_JUMP( res, out, L"mirror: not every image is mirrored" );
+
+    selected = select_found( &found[0], j, &update );
+    res = ( selected > -1 ) ? EFI_SUCCESS : EFI_NOT_FOUND;
+    ERROR_JUMP( res, out, L"mirror: nothing to boot" );
+
+    win = &found[ selected ];
+
+    // steamos-bootconf never leaves a stale mirror behind for the others
+    // (it deletes one it doesn't rewrite), so only the winner is mounted:
+    res = mirror_in_sync( win );
+    if( res != EFI_SUCCESS )
+        goto out;
+
+    // every sibling image the bootconf lists must have been ranked too:
+    if( directed_targets( win, handles, n_handles,
+                          siblings, &n_siblings ) == EFI_SUCCESS )
+        for( UINTN i = 0; i < n_siblings; i++ )
+            if( !already_found( &found[0], j, siblings[ i ].handle ) )
+                res = EFI_NOT_FOUND;
+    ERROR_JUMP( res, out, L"mirror: not every listed image is mirrored" );
+
+    // belt and braces: the fields we ranked by must also still agree:
+    config_summary( win->cfg, &sum );
+    if( !same_ranking( &sum, &win->sum ) )
+        res = EFI_NOT_FOUND;
+    ERROR_JUMP( res, out, L"mirror: ranking fields differ from bootconf" );
+
+    win->loader = candidate_loader( &sum );
+    res = win->loader ? valid_efi_binary( win->root, win->loader )
+                      : EFI_OUT_OF_RESOURCES;
+
+    if( res == EFI_NOT_FOUND )
+    {
+        CHAR16 *lz = compressed_path( win->loader );
 
-        // free the unused configs:
-        for( INTN i = 0; i < (INTN) j; i++ )
+        if( lz && valid_efi_binary( win->root, lz ) == EFI_SUCCESS )
         {
-            efi_free( found[ i ].loader );
-            free_config( &found[ i ].cfg );
+            efi_free( win->loader );
+            win->loader = lz;
+            res = EFI_SUCCESS;
         }
+        else
+        {
+            efi_free( lz );
+        }
+    }
+    ERROR_JUMP( res, out, L"mirror: no valid loader" );
+
+    take_found( &found[0], j, selected, update, chosen );
+
+    if( verbose )
+        Print( L"Chose %s from NVRAM bootconf mirrors\n", chosen->loader_path );
 
+    return EFI_SUCCESS;
+
+out:
+    for( UINTN i = 0; i < j; i++ )
+    {
+        efi_free( found[ i ].loader );
+        free_config( &found[ i ].cfg );
+        efi_unmount( &found[ i ].root );
+    }
+
+    return res;
+}
+
+EFI_STATUS choose_steamos_loader (EFI_HANDLE *handles,
+                                  CONST UINTN n_handles,
+                                  OUT bootloader *chosen)
+{
+    UINTN j = 0;
+    found_cfg found[MAX_BOOTCONFS + 1] = { { NULL } };
+    probe_target targets[MAX_PROBE_TARGETS];
+    probe_target directed[MAX_PROBE_TARGETS];
+    UINTN n_targets;
+    UINTN n_directed;
+    UINTN update = 0;
+    INTN selected;
+    EFI_STATUS res;
+
+    chosen->partition = NULL;
+    chosen->root = NULL;
+    chosen->loader_path = NULL;
+    chosen->args = NULL;
+    chosen->config = NULL;
+
+    if( choose_cached_loader( handles, n_handles, chosen ) == EFI_SUCCESS )
+        return EFI_SUCCESS;
+
+    if( choose_mirrored_loader( handles, n_handles, chosen ) == EFI_SUCCESS )
+        return EFI_SUCCESS;
+
+    probes_timed_out = 0;
+    res = deadline_start( &select_budget, SELECT_BUDGET_MS );
+    WARN_STATUS( res, L"no selection budget available" );
+
+    n_targets = order_probe_targets( handles, n_handles, PROBE_POLICY, targets );
+
+    // the first config we find may tell us exactly where its siblings are:
+    j = probe_targets( targets, n_targets, &found[0], 0, 1 );
+
+    res = ( j == 1 ) ? directed_targets( &found[0], handles, n_handles,
+                                         directed, &n_directed )
+                     : EFI_NOT_FOUND;
+
+    if( res == EFI_SUCCESS )
+    {
+        UINTN listed = j + n_directed;
+
+        j = probe_targets( directed, n_directed, &found[0], j, listed );
+
+        // a listed partition had no usable config or loader:
+        if( j < listed )
+            res = EFI_NOT_FOUND;
+        WARN_STATUS( res, L"partitions list in bootconf not usable" );
+    }
+
+    if( res != EFI_SUCCESS )
+        j = probe_targets( targets, n_targets, &found[0], j, PROBE_STOP_AFTER );
+
+    // nothing on the preferred media: fall back to everything we can see
+    if( j == 0 && PROBE_POLICY != PROBE_ALLOW_ALL )
+    {
+        n_targets = order_probe_targets( handles, n_handles,
+                                         PROBE_ALLOW_ALL, targets );
+        j = probe_targets( targets, n_targets, &found[0], 0, PROBE_STOP_AFTER );
+    }
+
+    deadline_stop( &select_budget );
+
+    if( verbose )
+    {
+        Print( L"Went through %u filesystems, %u SteamOS loaders found\n", n_handles, j);
+        if( probes_timed_out )
+            Print( L"%u probes timed out\n", probes_timed_out );
+        dump_found( &found[0] );
+    }
+
+    selected = select_found( &found[0], j, &update );
+
+    if( selected > -1 )
+    {
+        take_found( &found[0], j, selected, update, chosen );
         return EFI_SUCCESS;
     }
 
@@ -325,6 +952,232 @@ static VOID dump_bootloader_paths (EFI_DEVICE_PATH *target)
     FreePool( this );
 }
 
+// the expected sha256 of a loader file: the bootconf's loader-sha256
+// entry if there is one, otherwise the first word of a file.sha256 file
+// next to it (sha256sum output or steamcl.version style):
+static UINTN loader_digest (EFI_FILE_PROTOCOL *root,
+                            CONST CHAR16 *file,
+                            const cfg_entry *conf,
+                            OUT UINT8 *digest)
+{
+    CHAR8 *hex = cfg_loader_sha256( conf );
+    CHAR8 buf[ SHA256_DIGEST_SIZE * 2 + 1 ];
+    UINTN bytes = sizeof(buf);
+    EFI_FILE_PROTOCOL *fh = NULL;
+    CHAR16 *sidecar = NULL;
+    UINTN found = 0;
+
+    if( hex && *hex )
+        return sha256_parse_hex( hex, strlena( hex ), digest );
+
+    sidecar = efi_alloc_raw( ( StrLen( file ) + 8 ) * sizeof(CHAR16) );
+    if( !sidecar )
+        return 0;
+
+    StrCpy( sidecar, file );
+    StrCat( sidecar, L".sha256" );
+
+    if( efi_file_open( root, &fh, sidecar, 0, 0 ) == EFI_SUCCESS )
+    {
+        if( efi_file_read( fh, buf, &bytes ) == EFI_SUCCESS )
+            found = sha256_parse_hex( buf, bytes, digest );
+        efi_file_close( fh );
+    }
+
+    efi_free( sidecar );
+
+    return found;
+}
+
+static VOID hash_chunk (VOID *ctx, CONST CHAR8 *data, UINTN bytes)
+{
+    sha256_update( ctx, data, bytes );
+}
+
+// read file into pages, checking it against its expected sha256 (if it
+// has one) as we go. A mismatch is EFI_SECURITY_VIOLATION:
+static EFI_STATUS read_verified (EFI_FILE_PROTOCOL *root,
+                                 CONST CHAR16 *file,
+                                 const cfg_entry *conf,
+                                 OUT CHAR8 **buf,
+                                 OUT UINTN *size,
+                                 OUT UINTN *pages)
+{
+    UINT8 want[ SHA256_DIGEST_SIZE ];
+    UINT8 got[ SHA256_DIGEST_SIZE ];
+    UINTN check = 0;
+    sha256_ctx ctx;
+    EFI_STATUS res = EFI_SUCCESS;
+
+    if( VERIFY_LOADER )
+        check = loader_digest( root, file, conf, want );
+
+    if( !check && VERIFY_LOADER > 1 )
+        res = EFI_SECURITY_VIOLATION;
+    ERROR_RETURN( res, res, L"%s: no sha256 to verify against", file );
+
+    sha256_init( &ctx );
+
+    res = efi_file_to_pages( root, file, buf, size, pages,
+                             check ? hash_chunk : NULL, &ctx );
+    if( res != EFI_SUCCESS || !check )
+        return res;
+
+    sha256_final( &ctx, got );
+
+    if( CompareMem( want, got, SHA256_DIGEST_SIZE ) )
+    {
+        efi_free_pages( buf, *pages );
+        res = EFI_SECURITY_VIOLATION;
+    }
+    ERROR_RETURN( res, res, L"%s: sha256 mismatch", file );
+
+    if( verbose )
+        Print( L"%s: sha256 verified (%s)\n", file, sha256_engine() );
+
+    return EFI_SUCCESS;
+}
+
+// whether the loader must not be run unless we have read and checked it
+// ourselves, ie the firmware may not load it from its path unverified:
+static UINTN verification_required (EFI_FILE_PROTOCOL *root,
+                                    CONST CHAR16 *path,
+                                    const cfg_entry *conf)
+{
+    UINT8 digest[ SHA256_DIGEST_SIZE ];
+    CHAR8 *hex = cfg_loader_sha256( conf );
+    CHAR16 *lz = NULL;
+    UINTN found = 0;
+
+    if( !VERIFY_LOADER )
+        return 0;
+
+    if( VERIFY_LOADER > 1 || ( hex && *hex ) )
+        return 1;
+
+    if( !root )
+        return 0;
+
+    if( loader_digest( root, path, conf, digest ) )
+        return 1;
+
+    lz = compressed_path( path );
+    if( lz )
+        found = loader_digest( root, lz, conf, digest );
+    efi_free( lz );
+
+    return found;
+}
+
+// read file (verified) into pages, decompressing it if it's an lz4 frame:
+static EFI_STATUS read_unpacked (EFI_FILE_PROTOCOL *root,
+                                 CONST CHAR16 *file,
+                                 const cfg_entry *conf,
+                                 OUT CHAR8 **image,
+                                 OUT UINTN *size,
+                                 OUT UINTN *pages)
+{
+    EFI_STATUS res;
+    CHAR8 *packed = NULL;
+    UINTN psize = 0;
+    UINTN ppages = 0;
+    UINTN bound = 0;
+
+    res = read_verified( root, file, conf, &packed, &psize, &ppages );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    if( !lz4_frame_magic( (UINT8 *) packed, psize ) )
+    {
+        *image = packed;
+        *size  = psize;
+        *pages = ppages;
+        return EFI_SUCCESS;
+    }
+
+    res = lz4_frame_bound( (UINT8 *) packed, psize, &bound );
+    ERROR_JUMP( res, out, L"lz4: bad frame header" );
+
+    res = efi_alloc_pages( bound, image, pages );
+    ERROR_JUMP( res, out, L"lz4: %lu bytes", (UINT64) bound );
+
+    res = lz4_frame_decode( (UINT8 *) packed, psize,
+                            (UINT8 *) *image, bound, size );
+    if( res != EFI_SUCCESS )
+        efi_free_pages( image, *pages );
+    ERROR_JUMP( res, out, L"lz4: decompression failed" );
+
+    if( verbose )
+        Print( L"Decompressed loader: %lu → %lu bytes\n",
+               (UINT64) psize, (UINT64) *size );
+
+out:
+    efi_free_pages( &packed, ppages );
+
+    return res;
+}
+
+// read the loader into pages, preferring a compressed copy (path.lz4)
+// if there is one. The bootconf has one loader-sha256 for whichever of
+// the two is installed, so a compressed copy that is stale (fails
+// verification) or corrupt (fails to decode) is passed over for the
+// plain loader, which is verified in its own right:
+static EFI_STATUS read_loader (EFI_FILE_PROTOCOL *root,
+                               CONST CHAR16 *path,
+                               const cfg_entry *conf,
+                               OUT CHAR8 **image,
+                               OUT UINTN *size,
+                               OUT UINTN *pages)
+{
+    EFI_STATUS res = EFI_NOT_FOUND;
+    EFI_STATUS lz_res = EFI_NOT_FOUND;
+    CHAR16 *lz = compressed_path( path );
+
+    if( lz )
+        res = lz_res = read_unpacked( root, lz, conf, image, size, pages );
+
+    if( res != EFI_SUCCESS && lz_res != EFI_NOT_FOUND )
+        WARN_STATUS( lz_res, L"%s unusable, trying %s", lz, path );
+
+    if( res != EFI_SUCCESS )
+        res = read_unpacked( root, path, conf, image, size, pages );
+
+    efi_free( lz );
+
+    // only a compressed copy, and a bad one: that's the error to report
+    if( res == EFI_NOT_FOUND && lz_res != EFI_NOT_FOUND )
+        res = lz_res;
+
+    return res;
+}
+
+static CHAR16 *linux_cmdline (const cfg_entry *conf, CONST CHAR16 *args)
+{
+    CHAR8 *narrow = cfg_cmdline( conf );
+    CHAR16 *wide = ( narrow && *narrow ) ? strwiden( narrow ) : NULL;
+    CHAR16 *cmdline = NULL;
+    UINTN len = 0;
+
+    if( !args )
+        return wide;
+
+    if( wide )
+        len = StrLen( wide );
+
+    cmdline = efi_alloc_raw( ( len + StrLen( args ) + 1 ) * sizeof(CHAR16) );
+    if( cmdline )
+    {
+        cmdline[ 0 ] = L'\0';
+        if( wide )
+            StrCpy( cmdline, wide );
+        StrCat( cmdline, args );
+    }
+
+    efi_free( wide );
+
+    return cmdline;
+}
+
 EFI_STATUS exec_bootloader (bootloader *boot)
 {
     EFI_STATUS res = EFI_SUCCESS;
@@ -333,6 +1186,14 @@ EFI_STATUS exec_bootloader (bootloader *boot)
     EFI_DEVICE_PATH *dpath = NULL;
     UINTN esize;
     CHAR16 *edata = NULL;
+    CHAR8 *image = NULL;
+    UINTN isize = 0;
+    UINTN ipages = 0;
+    CHAR8 *initrd = NULL;
+    UINTN rsize = 0;
+    UINTN rpages = 0;
+    CHAR16 *cmdline = NULL;
+    UINTN direct = 0;
 
     dpath = make_absolute_device_path( boot->partition, boot->loader_path );
     if( !dpath )
@@ -345,21 +1206,116 @@ EFI_STATUS exec_bootloader (bootloader *boot)
     if( verbose )
         dump_bootloader_paths( dpath );
 
-    res = load_image( dpath, &efi_app );
+    // read the loader once through the volume we already have open and
+    // hand the firmware the buffer instead of having it re-resolve dpath
+    // and read the image again itself:
+    if( boot->root )
+    {
+        res = read_loader( boot->root, boot->loader_path, boot->config,
+                           &image, &isize, &ipages );
+
+        // it's there but not what it's supposed to be: don't run it
+        if( res == EFI_SECURITY_VIOLATION )
+        {
+            Print( L"Loader %s failed verification\n", boot->loader_path );
+            goto unload;
+        }
+
+        // the firmware would load it unchecked: only if there's no check
+        if( res != EFI_SUCCESS &&
+            verification_required( boot->root, boot->loader_path,
+                                   boot->config ) )
+        {
+            Print( L"Loader %s could not be read to verify it: %s\n",
+                   boot->loader_path, efi_statstr( res ) );
+            goto unload;
+        }
+
+        WARN_STATUS( res, L"loader not read, firmware will load it" );
+
+        if( res == EFI_SUCCESS )
+        {
+            res = valid_efi_header( image, isize );
+            ERROR_JUMP( res, unload, L"loader %s is not a valid EFI binary",
+                        boot->loader_path );
+
+            direct = is_linux_image( image, isize );
+        }
+
+        // an EFI-stub kernel or UKI: we have to supply the command line
+        // and initrd that grub would otherwise have set up:
+        if( direct )
+        {
+            CHAR16 *rpath = resolve_path( cfg_initrd( boot->config ),
+                                          BOOTCONFPATH, 1 );
+
+            if( rpath )
+            {
+                res = efi_file_to_pages( boot->root, rpath,
+                                         &initrd, &rsize, &rpages, NULL, NULL );
+                efi_free( rpath );
+                ERROR_JUMP( res, unload, L"initrd not read" );
+
+                res = install_initrd( initrd, rsize );
+                ERROR_JUMP( res, unload, L"initrd not installed" );
+            }
+
+            cmdline = linux_cmdline( boot->config, boot->args );
+
+            if( verbose )
+                Print( L"Direct kernel boot: initrd %lu bytes, cmdline '%s'\n",
+                       (UINT64) rsize, cmdline ?: L"" );
+        }
+
+        efi_unmount( &boot->root );
+    }
+    else if( verification_required( NULL, boot->loader_path, boot->config ) )
+    {
+        res = EFI_SECURITY_VIOLATION;
+        Print( L"Loader %s can't be verified: its volume is not open\n",
+               boot->loader_path );
+        goto unload;
+    }
+
+    res = load_image( dpath, image, isize, &efi_app );
     ERROR_JUMP( res, unload, L"load-image failed" );
 
+    // LoadImage has its own copy now:
+    efi_free_pages( &image, ipages );
+
     // TODO: do the self-reload trick to keep shim + EFI happy
     // we don't can't support secureboot yet because of the NVIDIA
     // module/dkms/initrd problem, but if we ever fix that, we'll
     // need to do what refind.main.c@394 does.
 
-    res = set_image_cmdline( &efi_app, boot->args, &child );
+    res = set_image_cmdline( &efi_app, direct ? cmdline : boot->args, &child );
     ERROR_JUMP( res, unload, L"command line not set" );
 
-#if DEBUG_ABORT
-    res = EFI_ABORTED;
-    ERROR_JUMP( res, unload, L"aborting deliberately to show config data" );
-#endif
+    // the child has its own copy of the command line, and dpath was only
+    // needed by LoadImage: done with both, so they don't show up below:
+    efi_free( cmdline );
+    efi_free( dpath );
+    cmdline = NULL;
+    dpath   = NULL;
+
+    timing_mark( TS_EXEC );
+    timing_publish();
+    fwtrace_publish();
+
+    if( verbose )
+    {
+        timing_dump();
+        fwtrace_dump();
+    }
+
+    // nothing the loader needs lives in the arena (the load options are
+    // copied, the initrd has its own pages), so give it all back:
+    arena_shutdown();
+
+    // whatever is still allocated now, apart from the caller's handle
+    // list and the chosen bootloader entry, is a leak:
+    if( verbose )
+        alloc_trace_dump();
 
     res = exec_image( efi_app, &esize, &edata );
     WARN_STATUS( res, L"start image returned with exit code: %u; data @ 0x%x",
@@ -375,6 +1331,11 @@ unload:
         WARN_STATUS( r2, L"unload of image failed" );
     }
 
+    uninstall_initrd();
+    efi_free_pages( &initrd, rpages );
+    efi_free_pages( &image, ipages );
+    efi_unmount( &boot->root );
+    efi_free( cmdline );
     efi_free( dpath );
 
     return res;
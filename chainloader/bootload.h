@@ -24,16 +24,40 @@
 
 #define MAX_BOOTCONFS 16
 
+// how much of a loader we read to check it's a plausible PE32+ binary:
+#define PE_HEADER_SIZE 512
+
+// 0: don't check loader checksums
+// 1: check the loader's sha256 if there's one to check against
+// 2: refuse to boot a loader without a sha256 to check against
+#ifndef VERIFY_LOADER
+#define VERIFY_LOADER 1
+#endif
+
+// 1: rank candidates from a summary of their bootconfs (cfg_summary)
+//    and only fully parse the chosen one
+// 0: fully parse and keep every candidate's bootconf
+#ifndef LAZY_BOOTCONF
+#define LAZY_BOOTCONF 1
+#endif
+
+// how many volumes we probe concurrently:
+#define PROBE_BATCH 4
+
 typedef struct
 {
     EFI_HANDLE partition;
     EFI_DEVICE_PATH device_path;
+    EFI_FILE_PROTOCOL *root; // partition's volume, still open (or NULL)
     CHAR16 *loader_path;
     cfg_entry *config;
     CONST CHAR16 *args;
 } bootloader;
 
 EFI_STATUS valid_efi_binary (EFI_FILE_PROTOCOL *dir, CONST CHAR16 *path);
+EFI_STATUS valid_efi_header (CONST CHAR8 *header, UINTN bytes);
+EFI_STATUS valid_loader_header (CONST CHAR8 *header, UINTN bytes);
+CHAR16 *candidate_loader (const cfg_summary *sum);
 EFI_STATUS choose_steamos_loader (EFI_HANDLE *handles,
                                   CONST UINTN n_handles,
                                   OUT bootloader *chosen);
@@ -0,0 +1,99 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+// Build-time generator (runs on the build machine, not the target):
+// finds a seed for which bootspec_hash_slot() maps every bootspec key to
+// a distinct slot in the smallest possible power-of-two table, and
+// writes that table out as C. See bootspec.h.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bootspec.h"
+
+#define KEY_NAME(type, id, name) name,
+
+static const char *keys[] = { BOOTSPEC_KEYS(KEY_NAME) };
+
+#define N_KEYS ( sizeof(keys) / sizeof(keys[0]) )
+#define MAX_SEED ( 1u << 24 )
+
+static uint32_t key_hash (const char *key, uint32_t seed)
+{
+    uint32_t h = BOOTSPEC_HASH_INIT( seed );
+
+    for( const char *c = key; *c; c++ )
+        h = bootspec_hash_step( h, (unsigned char) *c );
+
+    return h;
+}
+
+static int try_seed (uint32_t seed, uint32_t size, unsigned char *slots)
+{
+    memset( slots, 0, size );
+
+    for( size_t i = 0; i < N_KEYS; i++ )
+    {
+        uint32_t s = bootspec_hash_slot( key_hash( keys[i], seed ), size );
+
+        if( slots[s] )
+            return 0;
+
+        slots[s] = (unsigned char) ( i + 1 );
+    }
+
+    return 1;
+}
+
+int main (void)
+{
+    unsigned char slots[ 256 ];
+    uint32_t size = 1;
+
+    while( size < N_KEYS )
+        size <<= 1;
+
+    for( ; size <= sizeof(slots); size <<= 1 )
+        for( uint32_t seed = 0; seed < MAX_SEED; seed++ )
+        {
+            if( !try_seed( seed, size, slots ) )
+                continue;
+
+            printf( "// generated by bootspec-gen from bootspec.h: do not edit\n\n"
+                    "#pragma once\n\n"
+                    "#define BOOTSPEC_HASH_SEED 0x%08xu\n"
+                    "#define BOOTSPEC_HASH_SIZE %u\n\n"
+                    "// slot → bootspec index + 1, 0 for no key:\n"
+                    "static const unsigned char bootspec_slots[BOOTSPEC_HASH_SIZE] =\n  {",
+                    seed, size );
+
+            for( uint32_t s = 0; s < size; s++ )
+                printf( "%s%s%2u", s ? "," : "", ( s % 16 ) ? " " : "\n    ",
+                        slots[s] );
+
+            printf( " };\n" );
+
+            return 0;
+        }
+
+    fprintf( stderr, "bootspec-gen: no perfect hash for %zu keys\n", N_KEYS );
+
+    return 1;
+}
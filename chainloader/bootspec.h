@@ -0,0 +1,73 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+// The bootspec schema: the one place bootconf keys are defined.
+// chainloader/config.c builds its cfg_entry table from this, and
+// bootspec-gen builds the key lookup table (bootspec-hash.h) from it
+// at build time. Keys are listed as X( type, id, name ): id names the
+// key's enum value (bootspec_<id>) and typed accessors (cfg_<id>, see
+// config.h) so code that knows which key it wants never looks it up.
+// Order matters: it's the order steamos-bootconf writes keys out in.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BOOTSPEC_KEYS(X)                                              \
+    X( cfg_stamp , boot_requested_at  , "boot-requested-at"   )      \
+    X( cfg_bool  , boot_other         , "boot-other"          )      \
+    X( cfg_uint  , boot_attempts      , "boot-attempts"       )      \
+    X( cfg_uint  , boot_count         , "boot-count"          )      \
+    X( cfg_stamp , boot_time          , "boot-time"           )      \
+    X( cfg_bool  , image_invalid      , "image-invalid"       )      \
+    X( cfg_bool  , update             , "update"              )      \
+    X( cfg_stamp , update_window_start, "update-window-start" )      \
+    X( cfg_stamp , update_window_end  , "update-window-end"   )      \
+    X( cfg_path  , loader             , "loader"              )      \
+    X( cfg_string, loader_sha256      , "loader-sha256"       )      \
+    X( cfg_string, partitions         , "partitions"          )      \
+    X( cfg_string, cmdline            , "cmdline"             )      \
+    X( cfg_path  , initrd             , "initrd"              )      \
+    X( cfg_string, comment            , "comment"             )      \
+    X( cfg_uint  , mirror_generation  , "mirror-generation"   )
+
+// a key's enum value is also its index in a parsed config:
+#define BOOTSPEC_ENUM(t, id, n) bootspec_##id,
+
+typedef enum
+{
+    BOOTSPEC_KEYS(BOOTSPEC_ENUM)
+    bootspec_key_count
+} bootspec_key;
+
+// seeded FNV-1a, folded down to a table slot. The parser feeds key bytes
+// in one at a time as it scans the line:
+#define BOOTSPEC_HASH_INIT(seed) ( 2166136261u ^ (uint32_t) (seed) )
+
+static inline uint32_t bootspec_hash_step (uint32_t h, unsigned char c)
+{
+    return ( h ^ c ) * 16777619u;
+}
+
+static inline uint32_t bootspec_hash_slot (uint32_t h, uint32_t size)
+{
+    return ( h ^ ( h >> 15 ) ) & ( size - 1 );
+}
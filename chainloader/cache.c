@@ -0,0 +1,237 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <efiprot.h>
+
+#include "err.h"
+#include "util.h"
+#include "epoch.h"
+#include "fileio.h"
+#include "config.h"
+#include "bootload.h"
+#include "cache.h"
+
+static EFI_GUID steamos_guid = STEAMOS_VENDOR_GUID;
+
+static EFI_STATUS read_loader_cache (OUT loader_cache *cache)
+{
+    UINTN size = sizeof(*cache);
+    UINT32 attr = 0;
+    EFI_STATUS res;
+
+    ZeroMem( cache, sizeof(*cache) );
+
+    res = get_efi_variable( LOADER_CACHE_VAR, &steamos_guid,
+                            &attr, &size, cache );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    if( size != sizeof(*cache) || cache->version != LOADER_CACHE_VERSION )
+        return EFI_INCOMPATIBLE_VERSION;
+
+    // make sure a corrupted/hand-edited entry is still a terminated string:
+    cache->loader[ LOADER_CACHE_PATHLEN - 1 ] = L'\0';
+
+    return EFI_SUCCESS;
+}
+
+// fill in everything except the partition guid and loader path:
+static EFI_STATUS bootconf_fingerprint (EFI_FILE_PROTOCOL *root_dir,
+                                        OUT loader_cache *cache)
+{
+    EFI_FILE_PROTOCOL *cffile = NULL;
+    EFI_FILE_INFO *info = NULL;
+    UINTN isize = 0;
+    EFI_STATUS res;
+
+    res = efi_file_open( root_dir, &cffile, BOOTCONFPATH, 0, 0 );
+    ERROR_RETURN( res, res, L"cache: open " BOOTCONFPATH );
+
+    res = efi_file_stat( cffile, &info, &isize );
+    ERROR_JUMP( res, out, L"cache: stat " BOOTCONFPATH );
+
+    cache->version       = LOADER_CACHE_VERSION;
+    cache->conf_size     = info->FileSize;
+    cache->conf_mtime    = efi_time_to_datestamp( &info->ModificationTime );
+    cache->conf_mtime_ns = info->ModificationTime.Nanosecond;
+
+out:
+    efi_free( info );
+    efi_file_close( cffile );
+
+    return res;
+}
+
+static EFI_HANDLE find_partition (EFI_HANDLE *handles,
+                                  CONST UINTN n_handles,
+                                  CONST EFI_GUID *wanted)
+{
+    for( UINTN i = 0; i < n_handles; i++ )
+    {
+        EFI_GUID guid;
+
+        if( get_partition_guid( handles[ i ], &guid ) != EFI_SUCCESS )
+            continue;
+
+        if( CompareMem( &guid, wanted, sizeof(guid) ) == 0 )
+            return handles[ i ];
+    }
+
+    return NULL;
+}
+
+EFI_STATUS choose_cached_loader (EFI_HANDLE *handles,
+                                 CONST UINTN n_handles,
+                                 OUT bootloader *chosen)
+{
+    static EFI_GUID fs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+    static EFI_GUID dp_guid = DEVICE_PATH_PROTOCOL;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs = NULL;
+    EFI_DEVICE_PATH *dp = NULL;
+    EFI_FILE_PROTOCOL *root_dir = NULL;
+    EFI_HANDLE partition = NULL;
+    cfg_entry *conf = NULL;
+    loader_cache cached;
+    loader_cache current;
+    EFI_STATUS res;
+
+    res = read_loader_cache( &cached );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    partition = find_partition( handles, n_handles, &cached.partition );
+    res = partition ? EFI_SUCCESS : EFI_NOT_FOUND;
+    ERROR_RETURN( res, res, L"cache: cached partition not present" );
+
+    res = get_handle_protocol( &partition, &fs_guid, (VOID **) &fs );
+    ERROR_RETURN( res, res, L"cache: no simple file system protocol" );
+
+    res = get_handle_protocol( &partition, &dp_guid, (VOID **) &dp );
+    ERROR_RETURN( res, res, L"cache: no device path" );
+
+    res = efi_mount( fs, &root_dir );
+    ERROR_RETURN( res, res, L"cache: partition not opened" );
+
+    ZeroMem( &current, sizeof(current) );
+    res = bootconf_fingerprint( root_dir, &current );
+    ERROR_JUMP( res, out, L"cache: no bootconf" );
+
+    if( current.conf_size     != cached.conf_size  ||
+        current.conf_mtime    != cached.conf_mtime ||
+        current.conf_mtime_ns != cached.conf_mtime_ns )
+        res = EFI_NOT_FOUND;
+    ERROR_JUMP( res, out, L"cache: bootconf has changed" );
+
+    res = parse_config( root_dir, &conf );
+    ERROR_JUMP( res, out, L"cache: bootconf not parsed" );
+
+    // any of these means a non-trivial decision: do the full scan
+    if( cfg_image_invalid( conf ) ||
+        cfg_boot_other( conf ) ||
+        cfg_update( conf ) )
+        res = EFI_NOT_FOUND;
+    ERROR_JUMP( res, out, L"cache: bootconf requires a full scan" );
+
+    res = valid_efi_binary( root_dir, cached.loader );
+    ERROR_JUMP( res, out, L"cache: loader %s not valid", cached.loader );
+
+    chosen->partition   = partition;
+    chosen->device_path = *dp;
+    chosen->root        = root_dir;
+    chosen->loader_path = StrDuplicate( cached.loader );
+    chosen->config      = conf;
+    chosen->args        = NULL;
+    conf     = NULL;
+    root_dir = NULL;
+
+    if( verbose )
+        Print( L"Using cached loader choice %s\n", chosen->loader_path );
+
+out:
+    free_config( &conf );
+    efi_unmount( &root_dir );
+
+    return res;
+}
+
+// NULL means "this boot was not cacheable": drop any existing entry.
+// SetVariable is slow and wears out flash, so we only write on change:
+VOID update_loader_cache (CONST bootloader *chosen)
+{
+    static EFI_GUID fs_guid = SIMPLE_FILE_SYSTEM_PROTOCOL;
+    CONST UINT32 attr = ( EFI_VARIABLE_NON_VOLATILE       |
+                          EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                          EFI_VARIABLE_RUNTIME_ACCESS     );
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs = NULL;
+    EFI_FILE_PROTOCOL *root_dir = NULL;
+    EFI_HANDLE partition = NULL;
+    loader_cache cached;
+    loader_cache current;
+    EFI_STATUS stored;
+    EFI_STATUS res;
+    UINTN plen;
+
+    stored = read_loader_cache( &cached );
+
+    if( !chosen || !chosen->loader_path )
+        goto uncacheable;
+
+    plen = StrLen( chosen->loader_path );
+    if( plen >= LOADER_CACHE_PATHLEN )
+        goto uncacheable;
+
+    ZeroMem( &current, sizeof(current) );
+
+    partition = chosen->partition;
+    res = get_partition_guid( partition, &current.partition );
+    ERROR_JUMP( res, uncacheable, L"cache: no partition guid" );
+
+    res = get_handle_protocol( &partition, &fs_guid, (VOID **) &fs );
+    ERROR_JUMP( res, uncacheable, L"cache: no simple file system protocol" );
+
+    res = efi_mount( fs, &root_dir );
+    ERROR_JUMP( res, uncacheable, L"cache: partition not opened" );
+
+    res = bootconf_fingerprint( root_dir, &current );
+    efi_unmount( &root_dir );
+    ERROR_JUMP( res, uncacheable, L"cache: no bootconf fingerprint" );
+
+    CopyMem( &current.loader[0], chosen->loader_path, plen * sizeof(CHAR16) );
+
+    if( stored == EFI_SUCCESS &&
+        CompareMem( &cached, &current, sizeof(current) ) == 0 )
+        return;
+
+    res = set_efi_variable( LOADER_CACHE_VAR, &steamos_guid, attr,
+                            sizeof(current), &current );
+    WARN_STATUS( res, L"cache: could not store loader choice" );
+    return;
+
+uncacheable:
+    if( stored == EFI_NOT_FOUND )
+        return;
+
+    // a zero sized write deletes the variable:
+    res = set_efi_variable( LOADER_CACHE_VAR, &steamos_guid, attr, 0, NULL );
+    WARN_STATUS( res, L"cache: could not clear loader choice" );
+}
@@ -0,0 +1,51 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include "bootload.h"
+
+// the last successful (non-update, non-boot-other) loader decision is
+// remembered in NVRAM so that warm boots can check that one candidate
+// and skip the full partition scan.
+// Deleting the variable from the OS forces a full scan on the next boot:
+// steamos-bootconf does so whenever it rewrites a bootconf in place.
+#define LOADER_CACHE_VAR     L"ChainloaderLastGood"
+#define LOADER_CACHE_VERSION 1
+#define LOADER_CACHE_PATHLEN 128
+
+typedef struct
+{
+    UINT32 version;
+    UINT32 reserved;
+    EFI_GUID partition;  // GPT unique partition guid
+    UINT64 conf_size;    // bootconf size as reported by efi_file_stat
+    UINT64 conf_mtime;   // bootconf mtime as a YYYYmmddHHMMSS datestamp
+    UINT32 conf_mtime_ns;
+    UINT32 reserved2;
+    CHAR16 loader[ LOADER_CACHE_PATHLEN ];
+} loader_cache;
+
+EFI_STATUS choose_cached_loader (EFI_HANDLE *handles,
+                                 CONST UINTN n_handles,
+                                 OUT bootloader *chosen);
+
+VOID update_loader_cache (CONST bootloader *chosen);
@@ -23,6 +23,7 @@
 #include <efiprot.h>
 
 #include "chainloader.h"
+#include "arena.h"
 
 EFI_STATUS dump_fs_details (IN EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs)
 {
@@ -98,12 +99,21 @@ efi_main (EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *sys_table)
     EFI_STATUS res = EFI_SUCCESS;
     bootloader steamos;
 
+    timing_mark( TS_ENTRY );
+
     InitializeLib( image_handle, sys_table );
+    arena_init();
     initialise( image_handle, verbose );
+    timing_init();
+
+    if( CONNECT_PARTITIONS )
+        connect_steamos_partitions();
 
     res = get_protocol_handles( &fs_guid, &filesystems, &count );
     ERROR_JUMP( res, cleanup, L"get_fs_handles" );
 
+    timing_mark( TS_ENUMERATED );
+
     for ( int i = 0; i < (int)count; i++ )
     {
         EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs = NULL;
@@ -118,6 +128,8 @@ efi_main (EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *sys_table)
     res = choose_steamos_loader( filesystems, count, &steamos );
     ERROR_JUMP( res, cleanup, L"no valid steamos loader found" );
 
+    timing_mark( TS_SELECTED );
+
     res = exec_bootloader( &steamos );
     ERROR_JUMP( res, cleanup, L"exec failed" );
 
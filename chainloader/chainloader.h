@@ -24,3 +24,5 @@
 #include "util.h"
 #include "fileio.h"
 #include "bootload.h"
+#include "timing.h"
+#include "partition.h"
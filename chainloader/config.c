@@ -28,118 +28,448 @@
 #ifndef NO_EFI_TYPES
 #include "fileio.h"
 #include "bootload.h"
+#include "epoch.h"
 #include <efilib.h>
 #endif
 
 #include "config.h"
+#include "bootspec.h"
+#include "bootspec-hash.h"
+#include "bootbin.h"
+
+#define BOOTSPEC_ENTRY(t, id, n) { .type = t, .name = n },
 
 static cfg_entry bootspec[] =
-  { { .type = cfg_stamp , .name = "boot-requested-at"   },
-    { .type = cfg_bool  , .name = "boot-other"          },
-    { .type = cfg_uint  , .name = "boot-attempts"       },
-    { .type = cfg_uint  , .name = "boot-count"          },
-    { .type = cfg_stamp , .name = "boot-time"           },
-    { .type = cfg_bool  , .name = "image-invalid"       },
-    { .type = cfg_bool  , .name = "update"              },
-    { .type = cfg_stamp , .name = "update-window-start" },
-    { .type = cfg_stamp , .name = "update-window-end"   },
-    { .type = cfg_path  , .name = "loader"              },
-    { .type = cfg_string, .name = "partitions"          },
-    { .type = cfg_string, .name = "comment"             },
+  { BOOTSPEC_KEYS(BOOTSPEC_ENTRY)
     { .type = cfg_end } };
 
-static UINTN set_config_item_from_line (cfg_entry *item, CHAR8 *line)
+#define BOOTSPEC_COUNT ( sizeof(bootspec) / sizeof(bootspec[0]) - 1 )
+
+_Static_assert( BOOTSPEC_COUNT == bootspec_key_count, "bootspec enum mismatch" );
+
+// one bit per key to spot duplicates:
+_Static_assert( BOOTSPEC_COUNT <= 64, "too many bootspec keys" );
+
+// Parsed values are NUL terminated slices of the config's arena: one
+// buffer holding the bootconf text, owned by the config, described by
+// the (otherwise unused) cfg_end entry. free_config releases it in one
+// go. Only values set later (steamos-bootconf --set) have their own
+// allocations.
+#define ARENA(cfg) ( &(cfg)[ BOOTSPEC_COUNT ].value.string )
+
+UINTN conf_value_in_arena (const cfg_entry *config, const CHAR8 *value)
 {
-    UINTN nl = strlena( (CHAR8 *)item->name );
-    UINTN ll = strlena( line );
-    CHAR8 *start = NULL;
-    UINTN vsize = 0;
-    CHAR8 *nstart = NULL;
-    CHAR8 *nend = NULL;
-    UINTN place = 1;
-    // no room for "NAME:"
-    if( ll <= nl + 1 )
-        return 0;
-
-    // beginning of line does not match item->name + ':'
-    if( strncmpa( (CHAR8 *)item->name, line, nl ) )
-        return 0;
-    if( line[nl] != ':' )
-        return 0;
-
-    for( start = line + nl + 1; start < (line + ll) && *start; start++ )
-        if( *start != ' ' )
-            break;
+    const CHAR8 *arena = ARENA( config )->bytes;
 
-    vsize = ll - (start - line);
+    return ( arena && value &&
+             value >= arena &&
+             value <= arena + ARENA( config )->size ) ? 1 : 0;
+}
 
-    for( CHAR8 *c = start + vsize - 1; c >= start; c-- )
-        if( *c == ' ' )
-            vsize--;
-        else
-            break;
+static VOID free_conf_value (cfg_entry *config, cfg_entry *item)
+{
+    if( !conf_value_in_arena( config, item->value.string.bytes ) )
+        efi_free( item->value.string.bytes );
+
+    item->value.string.bytes = NULL;
+    item->value.string.size  = 0;
+    item->value.number.u     = 0;
+}
+
+#define EOL(c) ( (c) == '\n' || (c) == (CHAR8)0 )
+
+// index of the bootspec key of len bytes at key with (seeded) hash h,
+// or -1 if there isn't one: one lookup in the generated table and one
+// comparison to make sure it's not some other string in the same slot.
+static INTN bootspec_index (uint32_t h, CONST CHAR8 *key, UINTN len)
+{
+    UINTN slot = bootspec_slots[ bootspec_hash_slot( h, BOOTSPEC_HASH_SIZE ) ];
+    CONST CHAR8 *name;
+
+    if( !slot )
+        return -1;
+
+    name = (CONST CHAR8 *) bootspec[ slot - 1 ].name;
+
+    if( strlena( name ) != len || strncmpa( name, key, len ) )
+        return -1;
+
+    return slot - 1;
+}
+
+static INTN bootspec_key_index (CONST CHAR8 *key)
+{
+    uint32_t h = BOOTSPEC_HASH_INIT( BOOTSPEC_HASH_SEED );
+    UINTN len = 0;
+
+    for( ; key[ len ]; len++ )
+        h = bootspec_hash_step( h, key[ len ] );
 
-    item->value.string.bytes = ALLOC_OR_GOTO( vsize + 1, allocfail );
+    return bootspec_index( h, key, len );
+}
+
+// a value that isn't all digits is 0:
+static UINT64 conf_uint (CONST CHAR8 *value, UINTN vsize)
+{
+    CONST CHAR8 *nend = value + vsize;
+    UINT64 place = 1;
+    UINT64 u = 0;
+
+    for( nend--; nend >= value; nend-- )
+    {
+        if( *nend < '0' || *nend > '9' )
+            return 0;
+        u += (*nend - '0') * place;
+        place *= 10;
+    }
+
+    return u;
+}
+
+// value is a NUL terminated slice of the config's arena:
+static VOID set_config_item_value (cfg_entry *config,
+                                   cfg_entry *item,
+                                   CHAR8 *value,
+                                   UINTN vsize)
+{
+    // a repeated key replaces the earlier value:
+    free_conf_value( config, item );
+
+    item->value.string.bytes = value;
     item->value.string.size  = vsize;
-    CopyMem( item->value.string.bytes, start, vsize );
-    item->value.string.bytes[ vsize ] = (CHAR8)0;
 
     switch( item->type )
     {
       case cfg_bool:
       case cfg_uint:
       case cfg_stamp: // ← this is not OK on 32 bit. We don't care.
-        nstart = &item->value.string.bytes[ 0 ];
-        nend   = nstart + item->value.string.size;
-        item->value.number.u = 0;
-        for( nend--; nend >= nstart; nend-- )
-        {
-            if( *nend < '0' || *nend > '9' )
-            {
-                item->value.number.u = 0;
-                break;
-            }
-            item->value.number.u += (*nend - '0') * place;
-            place *= 10;
-        }
+        item->value.number.u = conf_uint( value, vsize );
         break;
       default:
         item->value.number.u = 0;
     }
+}
 
-    return 1;
+#define NOT_AN_ENTRY (-2)
 
-allocfail:
-    Print( L"Red alert! alloc of %u bytes failed\n", vsize + 1 );
-    return 0;
+// Scan the "KEY: VALUE" line (terminated by newline or NUL) at *pos,
+// leaving *pos at the start of the next one. The key is hashed as it is
+// scanned and looked up in the generated table: returns its bootspec
+// index, -1 for an unknown key or NOT_AN_ENTRY for a line without a ':'.
+// The value has leading and trailing spaces removed; "KEY:" with
+// nothing after it has an empty value:
+static INTN next_entry (CHAR8 **pos, CHAR8 *end, CHAR8 **val, UINTN *vsize)
+{
+    uint32_t h = BOOTSPEC_HASH_INIT( BOOTSPEC_HASH_SEED );
+    CHAR8 *c = *pos;
+    CONST CHAR8 *key = c;
+    INTN i = NOT_AN_ENTRY;
+
+    for( ; c < end && !EOL( *c ) && *c != ':'; c++ )
+        h = bootspec_hash_step( h, *c );
+
+    if( c < end && *c == ':' )
+    {
+        i = bootspec_index( h, key, c - key );
+
+        for( *val = c + 1; *val < end && **val == ' '; (*val)++ );
+        for( c = *val; c < end && !EOL( *c ); c++ );
+        for( *vsize = c - *val;
+             *vsize && (*val)[ *vsize - 1 ] == ' ';
+             (*vsize)-- );
+    }
+
+    // on to the start of the next line:
+    for( ; c < end && !EOL( *c ); c++ );
+    *pos = c + 1;
+
+    return i;
 }
 
-static UINTN set_config_from_line (cfg_entry *cfg, CHAR8* line)
+// Single pass over "KEY: VALUE" lines (see next_entry).
+// Lines without a ':' and unknown keys (eg from a newer bootconf tool)
+// are skipped. If a key is repeated, the last value wins.
+// The arena's size + 1 bytes are writable: values are NUL terminated
+// in place, so they're slices of the arena rather than copies.
+static EFI_STATUS parse_arena (cfg_entry *cfg)
 {
+    CHAR8 *data = ARENA( cfg )->bytes;
+    CHAR8 *end = data + ARENA( cfg )->size;
+    CHAR8 *c = data;
+    UINT64 seen = 0;
     UINTN found = 0;
+    UINTN unknown = 0;
+    UINTN repeated = 0;
+
+    while( c < end )
+    {
+        CHAR8 *val = NULL;
+        UINTN vsize = 0;
+        INTN i = next_entry( &c, end, &val, &vsize );
+
+        if( i == NOT_AN_ENTRY )
+            continue;
+
+        if( i < 0 )
+        {
+            unknown++;
+            continue;
+        }
+
+        if( seen & ( 1ULL << i ) )
+            repeated++;
+        seen |= 1ULL << i;
+        val[ vsize ] = (CHAR8) 0;
+        set_config_item_value( cfg, &cfg[ i ], val, vsize );
+        found++;
+    }
+
+    if( verbose && ( unknown || repeated ) )
+        Print( L"bootconf: %u unknown keys skipped, %u repeated keys\n",
+               unknown, repeated );
+
+    return found ? EFI_SUCCESS : EFI_END_OF_FILE;
+}
+
+// a config has one arena: drop any earlier one (and values in it)
+static VOID release_arena (cfg_entry *cfg)
+{
+    if( !ARENA( cfg )->bytes )
+        return;
 
-    for( UINTN i = 0; cfg[i].type != cfg_end; i++  )
-        found += set_config_item_from_line( &cfg[i], line );
+    for( UINTN i = 0; i < BOOTSPEC_COUNT; i++ )
+        if( conf_value_in_arena( cfg, cfg[i].value.string.bytes ) )
+            free_conf_value( cfg, &cfg[i] );
 
-    return found;
+    efi_free( ARENA( cfg )->bytes );
+    ARENA( cfg )->bytes = NULL;
+    ARENA( cfg )->size  = 0;
 }
 
+// zero-copy: the config takes ownership of data, which must be freeable
+// with efi_free (efi_alloc or pool memory) and have room for size + 1 bytes. It is freed along
+// with the config (or right away if the config can't take it):
+EFI_STATUS set_config_from_buffer (cfg_entry *cfg, CHAR8 *data, UINTN size)
+{
+    if( !cfg )
+    {
+        efi_free( data );
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    release_arena( cfg );
+
+    ARENA( cfg )->bytes = data;
+    ARENA( cfg )->size  = size;
+    data[ size ] = (CHAR8) 0;
+
+    return parse_arena( cfg );
+}
+
+// data is left alone: the config gets its own copy as its arena
 EFI_STATUS set_config_from_data (cfg_entry *cfg, CHAR8 *data, UINTN size)
 {
+    CHAR8 *arena = efi_alloc_raw( size + 1 );
+
+    if( !arena )
+        return EFI_OUT_OF_RESOURCES;
+
+    CopyMem( arena, data, size );
+
+    return set_config_from_buffer( cfg, arena, size );
+}
+
+// CRC-32 (IEEE 802.3, as zlib and EFI's CalculateCrc32), a nibble at a time
+UINT32 bootbin_crc32 (CONST CHAR8 *data, UINTN size)
+{
+    static const UINT32 nibble[ 16 ] =
+      { 0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c };
+    UINT32 crc = 0xffffffff;
+
+    for( UINTN i = 0; i < size; i++ )
+    {
+        crc ^= data[ i ];
+        crc = ( crc >> 4 ) ^ nibble[ crc & 0xf ];
+        crc = ( crc >> 4 ) ^ nibble[ crc & 0xf ];
+    }
+
+    return ~crc;
+}
+
+#ifndef NO_EFI_TYPES
+// Take a bootconf.bin image (see bootbin.h) as the config's arena: the
+// numbers are copied out of their fixed slots and the string values
+// are used where they lie. mtime and tsize describe the text bootconf
+// it must have been written for. Like set_config_from_buffer the
+// config owns data from here on, even if it turns out to be unusable:
+static EFI_STATUS set_config_from_bootbin (cfg_entry *cfg,
+                                           CHAR8 *data,
+                                           UINTN size,
+                                           UINT64 mtime,
+                                           UINT64 tsize)
+{
+    UINTN pos = BOOTBIN_OFF_STRINGS( BOOTSPEC_COUNT );
+    UINT64 present;
+
+    if( !cfg )
+    {
+        efi_free( data );
+        return EFI_OUT_OF_RESOURCES;
+    }
+
+    release_arena( cfg );
+
+    ARENA( cfg )->bytes = data;
+    ARENA( cfg )->size  = size;
+
+    if( size < pos ||
+        CompareMem( data, BOOTBIN_MAGIC, 4 )                 ||
+        bootbin_get( data + BOOTBIN_OFF_VERSION, 2 ) != BOOTBIN_VERSION ||
+        bootbin_get( data + BOOTBIN_OFF_KEYS, 2 ) != BOOTSPEC_COUNT ||
+        bootbin_get( data + BOOTBIN_OFF_SIZE, 4 ) != size )
+        return EFI_INCOMPATIBLE_VERSION;
+
+    if( bootbin_get( data + BOOTBIN_OFF_CRC, 4 ) !=
+        bootbin_crc32( data + BOOTBIN_OFF_MTIME, size - BOOTBIN_OFF_MTIME ) )
+        return EFI_CRC_ERROR;
+
+    if( bootbin_get( data + BOOTBIN_OFF_MTIME, 8 ) != BOOTBIN_MTIME( mtime ) ||
+        bootbin_get( data + BOOTBIN_OFF_TSIZE, 8 ) != tsize )
+        return EFI_NOT_READY; // stale: the text has changed since
+
+    present = bootbin_get( data + BOOTBIN_OFF_PRESENT, 8 );
+
+    for( UINTN i = 0; i < BOOTSPEC_COUNT; i++ )
+    {
+        UINT64 len;
+
+        switch( cfg[ i ].type )
+        {
+          case cfg_bool:
+          case cfg_uint:
+          case cfg_stamp:
+            if( present & ( 1ULL << i ) )
+                cfg[ i ].value.number.u =
+                  bootbin_get( data + BOOTBIN_OFF_NUMBERS + 8 * i, 8 );
+            break;
+
+          case cfg_string:
+          case cfg_path:
+            if( pos + 4 > size )
+                goto corrupt;
+
+            len = bootbin_get( data + pos, 4 );
+            pos += 4;
+
+            if( len >= size - pos || data[ pos + len ] )
+                goto corrupt;
+
+            if( present & ( 1ULL << i ) )
+            {
+                cfg[ i ].value.string.bytes = data + pos;
+                cfg[ i ].value.string.size  = len;
+            }
+
+            pos += len + 1;
+            break;
+
+          default:
+            break;
+        }
+    }
+
+    return EFI_SUCCESS;
+
+corrupt:
+    // the crc was fine, so the writer was broken: drop what we took
+    release_arena( cfg );
+    for( UINTN i = 0; i < BOOTSPEC_COUNT; i++ )
+        cfg[ i ].value.number.u = 0;
+    return EFI_VOLUME_CORRUPTED;
+}
+
+// Lazy first pass for ranking candidates: only the keys in cfg_summary
+// are decoded, nothing is allocated and the rest of the text is just
+// skipped over. Same rules as parse_arena (last value wins etc).
+// size + 1 bytes of data must be writable: the loader value is NUL
+// terminated in place, so sum->loader is only good as long as data is.
+EFI_STATUS summarise_config (CHAR8 *data, UINTN size, cfg_summary *sum)
+{
+    CHAR8 *end = data + size;
+    CHAR8 *c = data;
     UINTN found = 0;
 
-    for( CHAR8 *c = data; c < data + size; c++ )
-        if( *c == '\n')
-            *c = (CHAR8) 0;
+    ZeroMem( sum, sizeof(*sum) );
 
-    for( CHAR8 *c = data; c < data + size; c++ )
-        if( (c == data) || (*(c - 1) == (CHAR8)0) )
-            found += set_config_from_line( cfg, c );
+    while( c < end )
+    {
+        CHAR8 *val = NULL;
+        UINTN vsize = 0;
+        INTN i = next_entry( &c, end, &val, &vsize );
+
+        if( i < 0 )
+            continue;
+
+        found++;
+
+        switch( (bootspec_key) i )
+        {
+          case bootspec_boot_requested_at:
+            sum->requested_at = conf_uint( val, vsize );
+            break;
+          case bootspec_update_window_start:
+            sum->window_start = conf_uint( val, vsize );
+            break;
+          case bootspec_update_window_end:
+            sum->window_end = conf_uint( val, vsize );
+            break;
+          case bootspec_boot_other:
+            sum->boot_other = conf_uint( val, vsize ) ? 1 : 0;
+            break;
+          case bootspec_image_invalid:
+            sum->image_invalid = conf_uint( val, vsize ) ? 1 : 0;
+            break;
+          case bootspec_update:
+            sum->update = conf_uint( val, vsize ) ? 1 : 0;
+            break;
+          case bootspec_loader:
+            val[ vsize ] = (CHAR8) 0;
+            sum->loader = val;
+            break;
+          case bootspec_cmdline:
+            sum->has_cmdline = vsize ? 1 : 0;
+            break;
+          case bootspec_initrd:
+            sum->has_initrd = vsize ? 1 : 0;
+            break;
+          default:
+            break;
+        }
+    }
 
     return found ? EFI_SUCCESS : EFI_END_OF_FILE;
 }
 
-#ifndef NO_EFI_TYPES
+// the same summary from a fully parsed config:
+VOID config_summary (const cfg_entry *cfg, cfg_summary *sum)
+{
+    CHAR8 *cmdline = cfg_cmdline( cfg );
+    CHAR8 *initrd  = cfg_initrd( cfg );
+
+    sum->requested_at  = cfg_boot_requested_at( cfg );
+    sum->window_start  = cfg_update_window_start( cfg );
+    sum->window_end    = cfg_update_window_end( cfg );
+    sum->boot_other    = cfg_boot_other( cfg )    ? 1 : 0;
+    sum->image_invalid = cfg_image_invalid( cfg ) ? 1 : 0;
+    sum->update        = cfg_update( cfg )        ? 1 : 0;
+    sum->loader        = cfg_loader( cfg );
+    sum->has_cmdline   = ( cmdline && *cmdline ) ? 1 : 0;
+    sum->has_initrd    = ( initrd  && *initrd  ) ? 1 : 0;
+}
+
 static CONST CHAR16 *_cts (cfg_entry_type t)
 {
     switch (t)
@@ -191,25 +521,75 @@ VOID dump_config (cfg_entry *config)
 #endif
 
 #ifndef NO_EFI_TYPES
+// the sidecar, if there is a usable one for the text file cffile:
+static EFI_STATUS parse_bootbin (EFI_FILE_PROTOCOL *root_dir,
+                                 EFI_FILE_PROTOCOL *cffile,
+                                 cfg_entry *config)
+{
+    EFI_STATUS res;
+    EFI_FILE_PROTOCOL *binfile = NULL;
+    EFI_FILE_INFO *info = NULL;
+    UINTN isize = 0;
+    CHAR8 *bindata = NULL;
+    UINTN binsize;
+    UINTN binalloc;
+    UINT64 mtime;
+    UINT64 tsize;
+
+    res = efi_file_open( root_dir, &binfile, BOOTBIN_PATH, 0, 0 );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    res = efi_file_stat( cffile, &info, &isize );
+    ERROR_JUMP( res, cleanup, L"parse_bootconfig: stat " BOOTCONFPATH );
+
+    mtime = efi_time_to_datestamp( &info->ModificationTime );
+    tsize = info->FileSize;
+
+    res = efi_file_to_mem( binfile, &bindata, &binsize, &binalloc );
+    ERROR_JUMP( res, cleanup, L"parse_bootconfig: load " BOOTBIN_PATH );
+
+    // the config owns bindata from here on:
+    res = set_config_from_bootbin( config, bindata, binsize, mtime, tsize );
+    bindata = NULL;
+
+    if( verbose && res != EFI_SUCCESS )
+        Print( L"%s not used (%r)\n", BOOTBIN_PATH, res );
+
+cleanup:
+    efi_free( bindata );
+    efi_free( info );
+    efi_file_close( binfile );
+
+    return res;
+}
+
 EFI_STATUS parse_config (EFI_FILE_PROTOCOL *root_dir, cfg_entry **config)
 {
     EFI_STATUS res = EFI_SUCCESS;
     EFI_FILE_PROTOCOL *cffile = NULL;
-    CHAR8 *cfdata;
+    CHAR8 *cfdata = NULL;
     UINTN cfsize;
     UINTN cfalloc;
 
     *config = new_config();
-    if( !config )
+    if( !*config )
         goto allocfail;
 
     res = efi_file_open( root_dir, &cffile, BOOTCONFPATH, 0, 0 );
     ERROR_JUMP( res, cleanup, L"parse_bootconfig: " BOOTCONFPATH );
 
+    // a sidecar written for this version of the text saves parsing it:
+    res = parse_bootbin( root_dir, cffile, *config );
+    if( res == EFI_SUCCESS )
+        goto cleanup;
+
     res = efi_file_to_mem( cffile, &cfdata, &cfsize, &cfalloc );
     ERROR_JUMP( res, cleanup, L"parse_bootconfig: load to mem failed" );
 
-    res = set_config_from_data( *config, cfdata, cfsize );
+    // the config owns cfdata from here on:
+    res = set_config_from_buffer( *config, cfdata, cfsize );
+    cfdata = NULL;
 
 cleanup:
     efi_free( cfdata );
@@ -226,32 +606,20 @@ allocfail:
 
 const cfg_entry * get_conf_item (const cfg_entry *config, const CHAR8 *name)
 {
+    INTN i;
+
     if( !name )
         return NULL;
 
     if( !config )
         return NULL;
 
-    for( UINTN i = 0; config[i].type != cfg_end; i++ )
-        if( config[i].name && *(config[i].name))
-            if( strcmpa( (CHAR8 *)config[i].name, name ) == 0 )
-                return &config[i];
-
-    return NULL;
-}
-
-UINT64 get_conf_uint (const cfg_entry *config, char *name)
-{
-    const cfg_entry *c = get_conf_item( config, (CHAR8 *)name );
-
-    return c ? c->value.number.u : 0;
-}
-
-CHAR8 * get_conf_str (const cfg_entry *config, char *name)
-{
-    const cfg_entry *c = get_conf_item( config, (CHAR8 *)name );
+    i = bootspec_key_index( name );
+    if( i < 0 )
+        return NULL;
 
-    return c ? &c->value.string.bytes[0] : NULL;
+    // NULL for deleted items (see del_conf_item in bootconf):
+    return cfg_item( config, (bootspec_key) i );
 }
 
 cfg_entry *new_config (VOID)
@@ -275,14 +643,9 @@ VOID free_config (cfg_entry **config)
         return;
 
     for( UINTN i = 0; conf[i].type != cfg_end; i++ )
-    {
-        conf[i].value.string.size = 0;
-        conf[i].value.number.u = 0;
-        if( !conf[i].value.string.bytes )
-            continue;
-        efi_free( conf[i].value.string.bytes );
-        conf[i].value.string.bytes = NULL;
-    }
+        free_conf_value( conf, &conf[i] );
+
+    release_arena( conf );
 
     efi_free( conf );
     *config = NULL;
@@ -43,10 +43,74 @@ typedef struct
     } value;
 } cfg_entry;
 
+#include "bootspec.h"
+
+// Typed accessors, one per bootspec key: cfg_boot_other( cfg ) etc.
+// Configs always hold every key at its bootspec index, so these are
+// a direct index rather than a lookup. get_conf_item & co. are only
+// for callers that have a key name from outside (steamos-bootconf's
+// command line). Deleted items (no name) read as 0 / NULL:
+static inline const cfg_entry *cfg_item (const cfg_entry *config,
+                                         bootspec_key key)
+{
+    return ( config && config[ key ].name ) ? &config[ key ] : NULL;
+}
+
+static inline UINT64 cfg_item_uint (const cfg_entry *config, bootspec_key key)
+{
+    const cfg_entry *c = cfg_item( config, key );
+
+    return c ? c->value.number.u : 0;
+}
+
+static inline CHAR8 *cfg_item_str (const cfg_entry *config, bootspec_key key)
+{
+    const cfg_entry *c = cfg_item( config, key );
+
+    return c ? c->value.string.bytes : NULL;
+}
+
+#define CFG_NUMBER_GETTER(id) \
+    static inline UINT64 cfg_##id (const cfg_entry *config) \
+    { return cfg_item_uint( config, bootspec_##id ); }
+
+#define CFG_STRING_GETTER(id) \
+    static inline CHAR8 *cfg_##id (const cfg_entry *config) \
+    { return cfg_item_str( config, bootspec_##id ); }
+
+#define CFG_GETTER_cfg_uint(id)   CFG_NUMBER_GETTER(id)
+#define CFG_GETTER_cfg_bool(id)   CFG_NUMBER_GETTER(id)
+#define CFG_GETTER_cfg_stamp(id)  CFG_NUMBER_GETTER(id)
+#define CFG_GETTER_cfg_string(id) CFG_STRING_GETTER(id)
+#define CFG_GETTER_cfg_path(id)   CFG_STRING_GETTER(id)
+
+#define CFG_GETTER(t, id, n) CFG_GETTER_##t(id)
+
+BOOTSPEC_KEYS(CFG_GETTER)
+
 
 #ifndef NO_EFI_TYPES
+// what choose_steamos_loader needs to rank a candidate and find its
+// loader, without keeping (or even fully parsing) its config:
+typedef struct
+{
+    UINT64 requested_at;
+    UINT64 window_start;
+    UINT64 window_end;
+    CHAR8 *loader; // points into the bootconf text or config it came from
+    UINT8 boot_other;
+    UINT8 image_invalid;
+    UINT8 update;
+    UINT8 has_cmdline;
+    UINT8 has_initrd;
+} cfg_summary;
+
 EFI_STATUS parse_config (EFI_FILE_PROTOCOL *root_dir, cfg_entry **config);
 
+EFI_STATUS summarise_config (CHAR8 *data, UINTN size, cfg_summary *sum);
+
+VOID config_summary (const cfg_entry *cfg, cfg_summary *sum);
+
 VOID dump_config (cfg_entry *config);
 #else
 const char *_cts (cfg_entry_type t);
@@ -54,13 +118,13 @@ const char *_cts (cfg_entry_type t);
 
 const cfg_entry *get_conf_item (const cfg_entry *config, const CHAR8 *name);
 
-UINT64 get_conf_uint (const cfg_entry *config, char *name);
-
-CHAR8 *get_conf_str (const cfg_entry *config, char *name);
-
 cfg_entry *new_config (VOID);
 
 VOID free_config (cfg_entry **config);
 
 EFI_STATUS set_config_from_data (cfg_entry *cfg, CHAR8 *data, UINTN size);
 
+EFI_STATUS set_config_from_buffer (cfg_entry *cfg, CHAR8 *data, UINTN size);
+
+UINTN conf_value_in_arena (const cfg_entry *config, const CHAR8 *value);
+
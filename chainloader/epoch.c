@@ -0,0 +1,208 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef NO_EFI_TYPES
+#include "bootconf/efi.h"
+#else
+#include <efi.h>
+#include <efilib.h>
+#include "timing.h"
+#endif
+
+#include "err.h"
+#include "util.h"
+#include "epoch.h"
+
+// floor division, as C's / truncates towards zero:
+static INT64 fdiv (INT64 a, INT64 b)
+{
+    return ( a >= 0 ? a : a - ( b - 1 ) ) / b;
+}
+
+// Howard Hinnant's days_from_civil: the year is shifted to start on
+// March 1st so the leap day is the last day of the (shifted) year, and
+// each 400 year era has exactly 146097 days:
+INT64 days_from_civil (INT64 year, UINTN month, UINTN day)
+{
+    INT64 era;
+    UINT64 yoe, doy, doe;
+
+    year -= ( month <= 2 ) ? 1 : 0;
+    era   = fdiv( year, 400 );
+    yoe   = (UINT64) ( year - era * 400 );
+    doy   = ( 153 * ( month > 2 ? month - 3 : month + 9 ) + 2 ) / 5 + day - 1;
+    doe   = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + (INT64) doe - 719468;
+}
+
+// ... and its inverse:
+VOID civil_from_days (INT64 days, INT64 *year, UINTN *month, UINTN *day)
+{
+    INT64 z = days + 719468;
+    INT64 era = fdiv( z, 146097 );
+    UINT64 doe = (UINT64) ( z - era * 146097 );
+    UINT64 yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365;
+    UINT64 doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 );
+    UINT64 mp  = ( 5 * doy + 2 ) / 153;
+
+    *day   = doy - ( 153 * mp + 2 ) / 5 + 1;
+    *month = ( mp < 10 ) ? mp + 3 : mp - 9;
+    *year  = (INT64) yoe + era * 400 + ( *month <= 2 ? 1 : 0 );
+}
+
+// number of form: YYYY mm DD HH MM SS
+INT64 datestamp_to_epoch (UINT64 stamp)
+{
+    UINTN sec   = stamp % 100; stamp /= 100;
+    UINTN min   = stamp % 100; stamp /= 100;
+    UINTN hour  = stamp % 100; stamp /= 100;
+    UINTN day   = stamp % 100; stamp /= 100;
+    UINTN month = stamp % 100; stamp /= 100;
+
+    return ( days_from_civil( (INT64) stamp, month, day ) * SECS_PER_DAY +
+             hour * 3600 + min * 60 + sec );
+}
+
+UINT64 epoch_to_datestamp (INT64 epoch)
+{
+    INT64 days = fdiv( epoch, SECS_PER_DAY );
+    UINT64 secs = (UINT64) ( epoch - days * SECS_PER_DAY );
+    INT64 year;
+    UINTN month;
+    UINTN day;
+
+    civil_from_days( days, &year, &month, &day );
+
+    if( year < 0 )
+        return 0;
+
+    return ( ( secs % 60 )               +
+             ( secs / 60 % 60 ) * 100    +
+             ( secs / 3600 )    * 10000  +
+             day                * 1000000     +
+             month              * 100000000   +
+             (UINT64) year      * 10000000000 );
+}
+
+#ifndef NO_EFI_TYPES
+// EFI sadly has no UTC support: an EFI_TIME is local time and
+// UTC = local + TimeZone (in minutes), if the zone is known at all:
+INT64 efi_time_to_epoch (CONST EFI_TIME *time)
+{
+    INT64 epoch = ( days_from_civil( time->Year, time->Month, time->Day ) *
+                    SECS_PER_DAY                                          +
+                    time->Hour   * 3600                                   +
+                    time->Minute * 60                                     +
+                    time->Second                                          );
+
+    if( time->TimeZone != EFI_UNSPECIFIED_TIMEZONE )
+        epoch += (INT64) time->TimeZone * 60;
+
+    return epoch;
+}
+
+// number of form: YYYY mm DD HH MM SS (in the EFI_TIME's own zone)
+UINT64 efi_time_to_datestamp (CONST EFI_TIME *time)
+{
+    return ( time->Second                 +
+             (time->Minute * 100)         +
+             (time->Hour   * 10000)       +
+             (time->Day    * 1000000)     +
+             (time->Month  * 100000000)   +
+             (time->Year   * 10000000000) );
+}
+
+// GetTime is slow on some firmware, and the answer can't usefully change
+// while we're deciding what to boot: read the RTC once, and work out
+// "now" from the TSC after that:
+static struct
+{
+    EFI_TIME time;  // local, as read
+    INT64 epoch;    // UTC
+    UINT64 tsc;
+    EFI_STATUS status;
+    UINTN taken;
+} rtc;
+
+static EFI_STATUS rtc_snapshot (VOID)
+{
+    if( rtc.taken )
+        return rtc.status;
+
+    rtc.taken  = 1;
+    rtc.tsc    = read_tsc();
+    rtc.status = uefi_call_wrapper( RT->GetTime, 2, &rtc.time, NULL );
+    WARN_STATUS( rtc.status, L"RTC not readable" );
+
+    if( rtc.status == EFI_SUCCESS )
+        rtc.epoch = efi_time_to_epoch( &rtc.time );
+
+    return rtc.status;
+}
+
+static INT64 rtc_elapsed (VOID)
+{
+    return (INT64) ( tsc_to_usec( read_tsc() - rtc.tsc ) / 1000000 );
+}
+
+// 0 if there's no usable RTC
+INT64 epoch_now (VOID)
+{
+    if( rtc_snapshot() != EFI_SUCCESS )
+        return 0;
+
+    return rtc.epoch + rtc_elapsed();
+}
+
+UINT64 local_datestamp (VOID)
+{
+    INT64 local;
+
+    if( rtc_snapshot() != EFI_SUCCESS )
+        return 0;
+
+    local = rtc.epoch + rtc_elapsed();
+
+    if( rtc.time.TimeZone != EFI_UNSPECIFIED_TIMEZONE )
+        local -= (INT64) rtc.time.TimeZone * 60;
+
+    return epoch_to_datestamp( local );
+}
+
+UINT64 utc_datestamp (VOID)
+{
+    if( rtc_snapshot() != EFI_SUCCESS )
+        return 0;
+
+    return epoch_to_datestamp( epoch_now() );
+}
+
+// number of form: HH MM SS
+UINT64 local_timestamp (VOID)
+{
+    return local_datestamp() % 1000000;
+}
+
+UINT64 utc_timestamp (VOID)
+{
+    return utc_datestamp() % 1000000;
+}
+#endif
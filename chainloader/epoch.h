@@ -0,0 +1,47 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+// Calendar arithmetic shared by the chainloader and steamos-bootconf:
+// conversions between seconds since 1970-01-01T00:00:00Z ("epoch"),
+// proleptic Gregorian dates and the YYYYmmddHHMMSS datestamps bootconf
+// uses, all in constant time (no clock stepping). Datestamps are UTC.
+
+#define SECS_PER_DAY 86400
+
+INT64  days_from_civil (INT64 year, UINTN month, UINTN day);
+VOID   civil_from_days (INT64 days, INT64 *year, UINTN *month, UINTN *day);
+
+INT64  datestamp_to_epoch (UINT64 stamp);
+UINT64 epoch_to_datestamp (INT64 epoch);
+
+#ifndef NO_EFI_TYPES
+INT64  efi_time_to_epoch (CONST EFI_TIME *time);
+UINT64 efi_time_to_datestamp (CONST EFI_TIME *time);
+
+// "now" comes from one RTC read per boot (see rtc_snapshot), advanced
+// by the TSC since:
+INT64  epoch_now (VOID);
+UINT64 local_datestamp (VOID);
+UINT64 utc_datestamp (VOID);
+UINT64 local_timestamp (VOID);
+UINT64 utc_timestamp (VOID);
+#endif
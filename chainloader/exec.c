@@ -24,19 +24,26 @@
 #include "util.h"
 #include "exec.h"
 #include "err.h"
+#include "fwtrace.h"
 
-EFI_STATUS load_image (EFI_DEVICE_PATH *path, EFI_HANDLE *image)
+// if source is NULL the firmware reads the image from path itself,
+// otherwise path is only used to fill in the loaded image's FilePath:
+EFI_STATUS load_image (EFI_DEVICE_PATH *path,
+                       VOID *source,
+                       UINTN size,
+                       EFI_HANDLE *image)
 {
     EFI_HANDLE current = get_self_handle();
 
-    return
-      uefi_call_wrapper( BS->LoadImage, 6, FALSE, current, path,
-                         NULL, 0, image );
+    return FW_TRACE( L"LoadImage", size,
+                     uefi_call_wrapper( BS->LoadImage, 6, FALSE, current, path,
+                                        source, size, image ) );
 }
 
 EFI_STATUS exec_image (EFI_HANDLE image, UINTN *code, CHAR16 **data)
 {
-    return uefi_call_wrapper( BS->StartImage, 3, image, code, data );
+    return FW_TRACE( L"StartImage", 0,
+                     uefi_call_wrapper( BS->StartImage, 3, image, code, data ) );
 }
 
 EFI_STATUS set_image_cmdline (EFI_HANDLE *image, CONST CHAR16 *cmdline,
@@ -48,10 +55,11 @@ EFI_STATUS set_image_cmdline (EFI_HANDLE *image, CONST CHAR16 *cmdline,
     res = get_handle_protocol( image, &load_guid, (VOID **) child );
     ERROR_RETURN( res, res, L"" );
 
-    if( cmdline )
+    // the options must outlive anything we allocated (see arena_shutdown),
+    // so the child gets its own pool copy:
+    if( cmdline && ( (*child)->LoadOptions = StrDuplicate( cmdline ) ) )
     {
-        (*child)->LoadOptions = (CHAR16 *)cmdline;
-        (*child)->LoadOptionsSize = StrLen( cmdline );
+        (*child)->LoadOptionsSize = StrSize( cmdline );
     }
     else
     {
@@ -20,7 +20,10 @@
 
 #pragma once
 
-EFI_STATUS load_image (EFI_DEVICE_PATH *path, EFI_HANDLE *image);
+EFI_STATUS load_image (EFI_DEVICE_PATH *path,
+                       VOID *source,
+                       UINTN size,
+                       EFI_HANDLE *image);
 
 EFI_STATUS exec_image (EFI_HANDLE image, UINTN *code, CHAR16 **data);
 
@@ -24,6 +24,10 @@
 
 #include "err.h"
 #include "util.h"
+#include "fileio.h"
+#include "timing.h"
+#include "fwtrace.h"
+#include "mp.h"
 
 EFI_STATUS efi_file_open (EFI_FILE_PROTOCOL *dir,
                           OUT EFI_FILE_PROTOCOL **opened,
@@ -34,12 +38,15 @@ EFI_STATUS efi_file_open (EFI_FILE_PROTOCOL *dir,
     if (!mode)
         mode = EFI_FILE_MODE_READ;
 
-    return uefi_call_wrapper( dir->Open, 5, dir, opened, path, mode, attr );
+    return FW_TRACE( L"Open", 0,
+                     uefi_call_wrapper( dir->Open, 5,
+                                        dir, opened, path, mode, attr ) );
 }
 
 EFI_STATUS efi_file_close (IN EFI_FILE_PROTOCOL *file)
 {
-    return uefi_call_wrapper( file->Close, 1, file );
+    return FW_TRACE( L"Close", 0,
+                     uefi_call_wrapper( file->Close, 1, file ) );
 }
 
 EFI_STATUS efi_file_exists (EFI_FILE_PROTOCOL *dir, CONST CHAR16 *path)
@@ -81,7 +88,9 @@ EFI_STATUS efi_readdir (EFI_FILE_PROTOCOL *dir,
 
     allocated = *dirent_size;
 
-    res = uefi_call_wrapper( dir->Read, 3, dir, dirent_size, *dirent );
+    res = FW_TRACE( L"Read(dir)", *dirent_size,
+                    uefi_call_wrapper( dir->Read, 3,
+                                       dir, dirent_size, *dirent ) );
 
     // we return what was actually allocated so the user can loop
     // without copying the allocated value back into *dirent_size:
@@ -98,14 +107,16 @@ EFI_STATUS efi_file_read (EFI_FILE_PROTOCOL *fh,
                           IN OUT CHAR8 *buf,
                           IN OUT UINTN *bytes)
 {
-    return uefi_call_wrapper( fh->Read, 3, fh, bytes, buf );
+    return FW_TRACE( L"Read", *bytes,
+                     uefi_call_wrapper( fh->Read, 3, fh, bytes, buf ) );
 }
 
 EFI_STATUS efi_mount (EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *part,
                       OUT EFI_FILE_PROTOCOL **root)
 {
     *root = NULL;
-    return uefi_call_wrapper( part->OpenVolume, 2, part, root );
+    return FW_TRACE( L"OpenVolume", 0,
+                     uefi_call_wrapper( part->OpenVolume, 2, part, root ) );
 }
 
 EFI_STATUS efi_unmount (IN OUT EFI_FILE_PROTOCOL **root)
@@ -197,7 +208,9 @@ EFI_STATUS efi_file_stat (EFI_FILE_PROTOCOL *fh,
     if( *info == NULL )
         *info = ALLOC_OR_GOTO( *bufsize, allocfail );
 
-    res = uefi_call_wrapper( fh->GetInfo, 4, fh, &info_guid, bufsize, *info );
+    res = FW_TRACE( L"GetInfo", *bufsize,
+                    uefi_call_wrapper( fh->GetInfo, 4,
+                                       fh, &info_guid, bufsize, *info ) );
     *bufsize = allocated;
 
     return res;
@@ -233,3 +246,462 @@ out:
     efi_free( info );
     return res;
 }
+
+typedef struct
+{
+    efi_chunk_fn fn;
+    VOID *ctx;
+    CONST CHAR8 *data;
+    volatile UINTN ready; // bytes read so far
+    volatile UINTN last;  // no more will be
+} image_job;
+
+// runs on an AP for the whole read, following the reader: one job per
+// image rather than per chunk, as each job start and finish is a round
+// trip through the MP services:
+static VOID run_image_job (VOID *arg)
+{
+    image_job *ij = arg;
+    UINTN done = 0;
+
+    for( ;; )
+    {
+        UINTN last = ij->last;
+        UINTN ready;
+
+        __sync_synchronize();
+        ready = ij->ready;
+
+        if( ready > done )
+        {
+            ij->fn( ij->ctx, ij->data + done, ready - done );
+            done = ready;
+        }
+        else if( last )
+        {
+            break;
+        }
+    }
+}
+
+// read a whole file into freshly allocated pages. Unlike efi_alloc the
+// pages are not zeroed first, since we're about to overwrite all of them.
+// chunk_fn (if set) sees the data in order as soon as it has been read:
+// it runs on an AP if there is one (so it must not call the firmware),
+// keeping up with the read, and otherwise inline after each chunk.
+// Release with efi_free_pages( buf, pages ):
+EFI_STATUS efi_file_to_pages (EFI_FILE_PROTOCOL *dir,
+                              CONST CHAR16 *path,
+                              OUT CHAR8 **buf,
+                              OUT UINTN *bytes,
+                              OUT UINTN *pages,
+                              efi_chunk_fn chunk_fn,
+                              VOID *chunk_ctx)
+{
+    EFI_STATUS res = EFI_SUCCESS;
+    EFI_FILE_PROTOCOL *fh = NULL;
+    EFI_FILE_INFO *info = NULL;
+    UINTN ialloc = 0;
+    UINTN size = 0;
+    UINTN done = 0;
+    image_job ij = { chunk_fn, chunk_ctx, NULL, 0, 0 };
+    job pending = { NULL };
+
+    *buf   = NULL;
+    *bytes = 0;
+    *pages = 0;
+
+    res = efi_file_open( dir, &fh, path, 0, 0 );
+    ERROR_RETURN( res, res, L"file_to_pages: open %s", path );
+
+    res = efi_file_stat( fh, &info, &ialloc );
+    ERROR_JUMP( res, out, L"file_to_pages: stat %s", path );
+
+    size = info->FileSize;
+    if( size == 0 )
+        res = EFI_END_OF_FILE;
+    ERROR_JUMP( res, out, L"file_to_pages: %s is empty", path );
+
+    res = efi_alloc_pages( size, buf, pages );
+    ERROR_JUMP( res, out, L"file_to_pages: %lu bytes", (UINT64) size );
+
+    if( chunk_fn )
+    {
+        ij.data = *buf;
+        job_start( &pending, run_image_job, &ij );
+    }
+
+    while( done < size )
+    {
+        UINTN chunk = size - done;
+
+        if( chunk > IMAGE_READ_CHUNK )
+            chunk = IMAGE_READ_CHUNK;
+
+        res = efi_file_read( fh, *buf + done, &chunk );
+        ERROR_JUMP( res, out, L"file_to_pages: read %s @ %lu",
+                    path, (UINT64) done );
+
+        // file shrank under us?
+        if( chunk == 0 )
+            res = EFI_END_OF_FILE;
+        ERROR_JUMP( res, out, L"file_to_pages: %s truncated", path );
+
+        if( chunk_fn && !pending.on_ap )
+            chunk_fn( chunk_ctx, *buf + done, chunk );
+
+        done += chunk;
+
+        __sync_synchronize();
+        ij.ready = done;
+    }
+
+    *bytes = done;
+
+out:
+    // let the AP catch up (or give up, on error) before the pages go:
+    ij.last = 1;
+    job_wait( &pending );
+
+    if( res != EFI_SUCCESS )
+        efi_free_pages( buf, *pages );
+
+    efi_free( info );
+    efi_file_close( fh );
+
+    return res;
+}
+
+// page allocations are not zeroed:
+EFI_STATUS efi_alloc_pages (UINTN bytes, OUT CHAR8 **buf, OUT UINTN *pages)
+{
+    EFI_PHYSICAL_ADDRESS addr = 0;
+    EFI_STATUS res;
+
+    *buf   = NULL;
+    *pages = 0;
+
+    res = FW_TRACE( L"AllocatePages", 0,
+                    uefi_call_wrapper( BS->AllocatePages, 4, AllocateAnyPages,
+                                       EfiLoaderData,
+                                       EFI_SIZE_TO_PAGES( bytes ), &addr ) );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    *buf   = (CHAR8 *) (UINTN) addr;
+    *pages = EFI_SIZE_TO_PAGES( bytes );
+
+    return EFI_SUCCESS;
+}
+
+VOID efi_free_pages (IN OUT CHAR8 **buf, UINTN pages)
+{
+    if( !buf || !*buf )
+        return;
+
+    FW_TRACE( L"FreePages", 0,
+              uefi_call_wrapper( BS->FreePages, 2,
+                                 (EFI_PHYSICAL_ADDRESS) (UINTN) *buf, pages ) );
+    *buf = NULL;
+}
+
+// ============================================================================
+// batched reads: where the firmware supports revision 2 file handles we
+// queue OpenEx/ReadEx requests on all the volumes at once and service
+// them as they complete, otherwise each request is done synchronously.
+
+VOID efi_read_req_init (OUT efi_read_req *req,
+                        EFI_FILE_PROTOCOL *dir,
+                        CONST CHAR16 *path,
+                        UINTN want)
+{
+    ZeroMem( req, sizeof(*req) );
+    req->dir    = dir;
+    req->path   = path;
+    req->want   = want;
+    req->status = EFI_NOT_STARTED;
+    req->stage  = READ_REQ_OPEN;
+}
+
+static UINTN async_capable (EFI_FILE_PROTOCOL *fh)
+{
+    return ( fh->Revision >= FILE_PROTOCOL_REVISION2 &&
+             fh->OpenEx && fh->ReadEx ) ? 1 : 0;
+}
+
+static VOID read_req_done (efi_read_req *req, EFI_STATUS status)
+{
+    req->status    = status;
+    req->stage     = READ_REQ_DONE;
+    req->completed = read_tsc();
+
+    if( req->io )
+    {
+        if( req->io->fh )
+            efi_file_close( req->io->fh );
+
+        if( req->io->token.Event )
+            FW_TRACE( L"CloseEvent", 0,
+                      uefi_call_wrapper( BS->CloseEvent, 1,
+                                         req->io->token.Event ) );
+
+        FreePool( req->io );
+        req->io = NULL;
+    }
+
+    if( status == EFI_SUCCESS )
+        return;
+
+    efi_free( req->buf );
+    req->buf   = NULL;
+    req->bytes = 0;
+}
+
+static VOID read_req_open (efi_read_req *req)
+{
+    EFI_STATUS res;
+    efi_read_io *io;
+
+    // not from the arena: an abandoned request's io block must outlive it
+    req->io = io = AllocateZeroPool( sizeof(*io) );
+    if( !io )
+    {
+        read_req_done( req, EFI_OUT_OF_RESOURCES );
+        return;
+    }
+
+    if( async_capable( req->dir ) )
+    {
+        res = FW_TRACE( L"CreateEvent", 0,
+                        uefi_call_wrapper( BS->CreateEvent, 5, 0, 0, NULL, NULL,
+                                           &io->token.Event ) );
+
+        if( res == EFI_SUCCESS )
+        {
+            io->token.Status = EFI_SUCCESS;
+            res = FW_TRACE( L"OpenEx", 0,
+                            uefi_call_wrapper( req->dir->OpenEx, 6,
+                                               req->dir, &io->fh,
+                                               (CHAR16 *) req->path,
+                                               EFI_FILE_MODE_READ,
+                                               0, &io->token ) );
+
+            if( res == EFI_SUCCESS )
+            {
+                req->stage = READ_REQ_OPENING;
+                return;
+            }
+
+            // async not actually available: carry on synchronously
+            FW_TRACE( L"CloseEvent", 0,
+                      uefi_call_wrapper( BS->CloseEvent, 1, io->token.Event ) );
+            io->token.Event = NULL;
+            io->fh = NULL;
+
+            if( res != EFI_UNSUPPORTED )
+            {
+                read_req_done( req, res );
+                return;
+            }
+        }
+    }
+
+    res = efi_file_open( req->dir, &io->fh, req->path, 0, 0 );
+
+    if( res == EFI_SUCCESS )
+        req->stage = READ_REQ_READ;
+    else
+        read_req_done( req, res );
+}
+
+static VOID read_req_read (efi_read_req *req)
+{
+    EFI_STATUS res = EFI_SUCCESS;
+    efi_read_io *io = req->io;
+    UINTN async;
+
+    if( req->want == 0 )
+    {
+        EFI_FILE_INFO *info = NULL;
+        UINTN isize = 0;
+
+        res = efi_file_stat( io->fh, &info, &isize );
+        if( res == EFI_SUCCESS )
+            req->want = info->FileSize;
+        efi_free( info );
+
+        if( res != EFI_SUCCESS )
+        {
+            read_req_done( req, res );
+            return;
+        }
+    }
+
+    async = ( io->token.Event && async_capable( io->fh ) );
+
+    // always NUL terminated on completion, no need to zero it. A ReadEx
+    // buffer comes from the pool, not the arena: if the read is abandoned
+    // the firmware may still write to it after arena_shutdown has handed
+    // the arena back (efi_free takes either):
+    req->buf = async ? AllocatePool( req->want + 1 )
+                     : efi_alloc_raw( req->want + 1 );
+    if( !req->buf )
+    {
+        read_req_done( req, EFI_OUT_OF_RESOURCES );
+        return;
+    }
+
+    req->bytes = req->want;
+
+    if( async )
+    {
+        io->token.Status     = EFI_SUCCESS;
+        io->token.BufferSize = req->want;
+        io->token.Buffer     = req->buf;
+
+        // completes later: what was asked for, not what arrived
+        res = FW_TRACE( L"ReadEx", req->want,
+                        uefi_call_wrapper( io->fh->ReadEx, 2,
+                                           io->fh, &io->token ) );
+
+        if( res == EFI_SUCCESS )
+        {
+            req->stage = READ_REQ_READING;
+            return;
+        }
+
+        if( res != EFI_UNSUPPORTED )
+        {
+            read_req_done( req, res );
+            return;
+        }
+    }
+
+    res = efi_file_read( io->fh, req->buf, &req->bytes );
+    if( res == EFI_SUCCESS )
+        req->buf[ req->bytes ] = (CHAR8) 0;
+    read_req_done( req, res );
+}
+
+// an OpenEx or ReadEx token was signalled:
+static VOID read_req_complete (efi_read_req *req)
+{
+    if( req->io->token.Status != EFI_SUCCESS )
+    {
+        read_req_done( req, req->io->token.Status );
+        return;
+    }
+
+    switch( req->stage )
+    {
+      case READ_REQ_OPENING:
+        req->stage = READ_REQ_READ;
+        break;
+
+      case READ_REQ_READING:
+        req->bytes = req->io->token.BufferSize;
+        req->buf[ req->bytes ] = (CHAR8) 0;
+        read_req_done( req, EFI_SUCCESS );
+        break;
+
+      default:
+        break;
+    }
+}
+
+// limit (if not NULL) is a deadline after which any outstanding requests
+// are abandoned with EFI_TIMEOUT. Synchronous io can't be interrupted,
+// so in that case it's checked between requests:
+EFI_STATUS efi_file_read_many (IN OUT efi_read_req *reqs,
+                               UINTN n,
+                               deadline *limit)
+{
+    EFI_EVENT waiting[ MAX_ASYNC_READS + 1 ];
+    UINTN which[ MAX_ASYNC_READS ];
+    EFI_STATUS res = EFI_SUCCESS;
+
+    if( n > MAX_ASYNC_READS )
+        return EFI_INVALID_PARAMETER;
+
+    for( ;; )
+    {
+        UINTN pending = 0;
+        UINTN idx = 0;
+
+        if( deadline_passed( limit ) )
+        {
+            res = EFI_TIMEOUT;
+            break;
+        }
+
+        // start whatever can be started, note what we're waiting for:
+        for( UINTN i = 0; i < n && !deadline_passed( limit ); i++ )
+        {
+            efi_read_req *req = &reqs[ i ];
+
+            if( req->stage == READ_REQ_OPEN )
+                read_req_open( req );
+
+            if( req->stage == READ_REQ_READ )
+                read_req_read( req );
+
+            if( req->stage == READ_REQ_OPENING ||
+                req->stage == READ_REQ_READING )
+            {
+                waiting[ pending ] = req->io->token.Event;
+                which[ pending++ ] = i;
+            }
+        }
+
+        if( !pending )
+        {
+            // sync requests ran us past the deadline in the last pass:
+            if( deadline_passed( limit ) )
+                continue;
+            break;
+        }
+
+        if( limit && limit->timer )
+            waiting[ pending ] = limit->timer;
+
+        res = FW_TRACE( L"WaitForEvent", 0,
+                        uefi_call_wrapper( BS->WaitForEvent, 3,
+                                           pending + ( ( limit && limit->timer )
+                                                       ? 1 : 0 ),
+                                           waiting, &idx ) );
+        if( res != EFI_SUCCESS )
+            break;
+
+        if( idx == pending )
+        {
+            deadline_fired( limit );
+            continue;
+        }
+
+        read_req_complete( &reqs[ which[ idx ] ] );
+    }
+
+    // only reachable with requests in flight if WaitForEvent failed or the
+    // deadline passed: we can't cancel file io tokens, so the io block
+    // (token, file handle) and any read buffer are left to the firmware,
+    // none of them in memory we'll reuse, and the request itself is
+    // detached from them:
+    for( UINTN i = 0; i < n; i++ )
+    {
+        efi_read_req *req = &reqs[ i ];
+
+        if( req->stage == READ_REQ_DONE )
+            continue;
+
+        if( req->stage == READ_REQ_OPENING || req->stage == READ_REQ_READING )
+        {
+            req->buf = NULL;
+            req->io  = NULL;
+            req->abandoned = 1;
+        }
+
+        read_req_done( req, ( res == EFI_SUCCESS ) ? EFI_ABORTED : res );
+    }
+
+    return res;
+}
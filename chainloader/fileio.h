@@ -22,6 +22,54 @@
 
 #include <efi.h>
 
+#include "timing.h"
+
+// not every gnu-efi knows about revision 2 (OpenEx/ReadEx) file handles:
+#define FILE_PROTOCOL_REVISION2 0x00020000
+
+#define MAX_ASYNC_READS 16
+
+// whole-image reads are done in chunks of this size: it's a multiple of
+// any plausible (power of two) block size, so every read but the last
+// is block aligned in the file and starts on a page boundary in memory:
+#define IMAGE_READ_CHUNK ( 1024 * 1024 )
+
+typedef enum
+{
+    READ_REQ_OPEN,
+    READ_REQ_OPENING,
+    READ_REQ_READ,
+    READ_REQ_READING,
+    READ_REQ_DONE,
+} read_req_stage;
+
+// what the firmware holds pointers to while OpenEx/ReadEx are in flight:
+// allocated from the pool per request, and never freed (or reused) if
+// the request is abandoned, since file io tokens can't be cancelled:
+typedef struct
+{
+    EFI_FILE_PROTOCOL *fh;
+    EFI_FILE_IO_TOKEN token;
+} efi_read_io;
+
+// a whole-file (want == 0) or leading-bytes read of dir/path.
+// On completion buf (if not NULL) is a NUL terminated buffer of bytes
+// bytes which the caller must efi_free (it may be pool, not arena, memory):
+typedef struct
+{
+    EFI_FILE_PROTOCOL *dir;
+    CONST CHAR16 *path;
+    UINTN want;
+    CHAR8 *buf;
+    UINTN bytes;
+    EFI_STATUS status;
+    UINT64 completed; // TSC when the request finished
+    UINTN abandoned;  // timed out with io still in flight
+    // private:
+    read_req_stage stage;
+    efi_read_io *io;
+} efi_read_req;
+
 EFI_STATUS efi_file_exists (EFI_FILE_PROTOCOL *dir, CONST CHAR16 *path);
 
 EFI_STATUS efi_file_open (EFI_FILE_PROTOCOL *dir,
@@ -58,3 +106,25 @@ EFI_STATUS efi_file_to_mem (EFI_FILE_PROTOCOL *fh,
                             OUT CHAR8 **buf,
                             OUT UINTN *bytes,
                             OUT UINTN *alloc);
+
+// called on each chunk of a file as efi_file_to_pages reads it:
+typedef VOID (*efi_chunk_fn) (VOID *ctx, CONST CHAR8 *data, UINTN bytes);
+
+EFI_STATUS efi_file_to_pages (EFI_FILE_PROTOCOL *dir,
+                              CONST CHAR16 *path,
+                              OUT CHAR8 **buf,
+                              OUT UINTN *bytes,
+                              OUT UINTN *pages,
+                              efi_chunk_fn chunk_fn,
+                              VOID *chunk_ctx);
+EFI_STATUS efi_alloc_pages (UINTN bytes, OUT CHAR8 **buf, OUT UINTN *pages);
+VOID efi_free_pages (IN OUT CHAR8 **buf, UINTN pages);
+
+VOID efi_read_req_init (OUT efi_read_req *req,
+                        EFI_FILE_PROTOCOL *dir,
+                        CONST CHAR16 *path,
+                        UINTN want);
+
+EFI_STATUS efi_file_read_many (IN OUT efi_read_req *reqs,
+                               UINTN n,
+                               deadline *limit);
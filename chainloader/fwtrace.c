@@ -0,0 +1,113 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "err.h"
+#include "util.h"
+#include "fwtrace.h"
+
+#if FWTRACE
+
+// room for the published table (in CHAR16s): keep it well under what
+// firmware is likely to accept for a single variable:
+#define FWTRACE_TEXT_MAX 2048
+
+static fw_site *sites;
+static fw_site **last_site = &sites;
+
+VOID fwtrace_record (fw_site *site, UINT64 ticks, UINT64 bytes)
+{
+    // sites are listed in the order they were first called:
+    if( !site->listed )
+    {
+        site->listed = 1;
+        *last_site = site;
+        last_site = &site->next;
+    }
+
+    site->count++;
+    site->ticks += ticks;
+    site->bytes += bytes;
+
+    if( ticks > site->max_ticks )
+        site->max_ticks = ticks;
+}
+
+// __FILE__ has whatever path the build used:
+static CONST CHAR8 *site_file (CONST fw_site *site)
+{
+    CONST CHAR8 *base = site->file;
+
+    for( CONST CHAR8 *c = site->file; *c; c++ )
+        if( *c == '/' )
+            base = c + 1;
+
+    return base;
+}
+
+VOID fwtrace_dump (VOID)
+{
+    CHAR16 where[ 32 ];
+
+    Print( L"Firmware calls (TSC cycles):\n" );
+    Print( L"  %-16s %-14s %6s %12s %10s %10s\n",
+           L"service", L"site", L"count", L"total", L"max", L"bytes" );
+
+    for( fw_site *s = sites; s; s = s->next )
+    {
+        SPrint( where, sizeof(where), L"%a:%d", site_file( s ), s->line );
+        Print( L"  %-16s %-14s %6lu %12lu %10lu %10lu\n",
+               s->service, where, s->count, s->ticks, s->max_ticks, s->bytes );
+    }
+}
+
+// one "SERVICE FILE:LINE COUNT TOTAL MAX BYTES" line per call site:
+EFI_STATUS fwtrace_publish (VOID)
+{
+    static EFI_GUID steamos_guid = STEAMOS_VENDOR_GUID;
+    static CHAR16 table[ FWTRACE_TEXT_MAX ];
+    CHAR16 line[ 128 ];
+    UINTN used = 0;
+
+    table[ 0 ] = L'\0';
+
+    for( fw_site *s = sites; s; s = s->next )
+    {
+        UINTN len = SPrint( line, sizeof(line), L"%s %a:%d %lu %lu %lu %lu\n",
+                            s->service, site_file( s ), s->line, s->count,
+                            s->ticks, s->max_ticks, s->bytes );
+
+        if( used + len >= FWTRACE_TEXT_MAX )
+            break;
+
+        StrCpy( table + used, line );
+        used += len;
+    }
+
+    // volatile, like the timing variables:
+    return set_efi_variable( L"ChainloaderFirmwareCalls", &steamos_guid,
+                             EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                             EFI_VARIABLE_RUNTIME_ACCESS,
+                             ( used + 1 ) * sizeof(CHAR16), table );
+}
+
+#endif
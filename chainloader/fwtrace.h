@@ -0,0 +1,76 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <efi.h>
+
+// 1: time every firmware call made from fileio.c, util.c and exec.c and
+//    keep per call site counts, cycles and bytes (see fwtrace_dump)
+// 0: FW_TRACE is just the call
+// Set at build time with eg -DFWTRACE=1 (steamcl-bench.efi has it on)
+#ifndef FWTRACE
+#define FWTRACE 0
+#endif
+
+#if FWTRACE
+
+#include "timing.h"
+
+typedef struct fw_site
+{
+    CONST CHAR16 *service;
+    CONST CHAR8 *file;
+    UINTN line;
+    UINT64 count;
+    UINT64 ticks;
+    UINT64 max_ticks;
+    UINT64 bytes;
+    struct fw_site *next;
+    UINTN listed;
+} fw_site;
+
+VOID fwtrace_record (fw_site *site, UINT64 ticks, UINT64 bytes);
+
+// call is a whole uefi_call_wrapper (or firmware library) expression
+// returning an EFI_STATUS: bytes is only evaluated after it succeeds,
+// so it can refer to sizes the firmware passes back:
+#define FW_TRACE(name, bytes, call)                                     \
+    ({ static fw_site _site = { .service = name,                        \
+                                .file    = (CONST CHAR8 *) __FILE__,    \
+                                .line    = __LINE__ };                  \
+       UINT64 _start = read_tsc();                                      \
+       EFI_STATUS _res = call;                                          \
+       UINT64 _ticks = read_tsc() - _start;                             \
+       fwtrace_record( &_site, _ticks,                                  \
+                       _res == EFI_SUCCESS ? (UINT64) (bytes) : 0 );    \
+       _res; })
+
+VOID fwtrace_dump (VOID);
+EFI_STATUS fwtrace_publish (VOID);
+
+#else
+
+#define FW_TRACE(name, bytes, call) (call)
+
+static inline VOID fwtrace_dump (VOID) { }
+static inline EFI_STATUS fwtrace_publish (VOID) { return EFI_UNSUPPORTED; }
+
+#endif
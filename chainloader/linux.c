@@ -0,0 +1,171 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "err.h"
+#include "util.h"
+#include "linux.h"
+
+typedef struct _load_file2 load_file2;
+
+struct _load_file2
+{
+    EFI_STATUS (EFI_CALLBACK *load_file) (load_file2 *this,
+                                          EFI_DEVICE_PATH *path,
+                                          BOOLEAN boot_policy,
+                                          IN OUT UINTN *size,
+                                          OUT VOID *buf);
+};
+
+typedef struct
+{
+    VENDOR_DEVICE_PATH vendor;
+    EFI_DEVICE_PATH end;
+} __attribute__ ((packed)) initrd_device_path;
+
+static struct
+{
+    EFI_HANDLE handle;
+    CONST CHAR8 *data;
+    UINTN size;
+} initrd;
+
+// Is this an EFI-stub kernel (bzImage setup header magic at 0x202)
+// or a UKI (a PE image with a .linux section)? Assumes the image has
+// already passed valid_efi_header:
+UINTN is_linux_image (CONST CHAR8 *image, UINTN size)
+{
+    UINT32 pe;
+    UINT16 sections;
+    UINT16 opt_size;
+    UINTN table;
+
+    if( size >= 0x206 &&
+        image[ 0x202 ] == 'H' && image[ 0x203 ] == 'd' &&
+        image[ 0x204 ] == 'r' && image[ 0x205 ] == 'S' )
+        return 1;
+
+    pe = * (UINT32 *) &image[ 0x3c ];
+
+    if( size < (UINTN) pe + 24 )
+        return 0;
+
+    sections = * (UINT16 *) &image[ pe + 6  ];
+    opt_size = * (UINT16 *) &image[ pe + 20 ];
+    table    = pe + 24 + opt_size;
+
+    // section headers are 40 bytes, starting with an 8 byte name:
+    for( UINTN i = 0; i < sections && table + (i + 1) * 40 <= size; i++ )
+        if( CompareMem( &image[ table + i * 40 ], ".linux\0\0", 8 ) == 0 )
+            return 1;
+
+    return 0;
+}
+
+static EFI_STATUS EFI_CALLBACK initrd_load_file (load_file2 *this,
+                                                 EFI_DEVICE_PATH *path
+                                                 __attribute__ ((unused)),
+                                                 BOOLEAN boot_policy,
+                                                 IN OUT UINTN *size,
+                                                 OUT VOID *buf)
+{
+    if( !this || !size )
+        return EFI_INVALID_PARAMETER;
+
+    // LoadFile2 never deals with boot policy requests:
+    if( boot_policy )
+        return EFI_UNSUPPORTED;
+
+    if( !initrd.data )
+        return EFI_NOT_FOUND;
+
+    if( !buf || *size < initrd.size )
+    {
+        *size = initrd.size;
+        return EFI_BUFFER_TOO_SMALL;
+    }
+
+    CopyMem( buf, (VOID *) initrd.data, initrd.size );
+    *size = initrd.size;
+
+    return EFI_SUCCESS;
+}
+
+static load_file2 initrd_lf2 = { .load_file = initrd_load_file };
+
+static initrd_device_path initrd_dp =
+  { .vendor = { .Header = { .Type    = MEDIA_DEVICE_PATH,
+                            .SubType = MEDIA_VENDOR_DP,
+                            .Length  = { sizeof(VENDOR_DEVICE_PATH), 0 } },
+                .Guid   = LINUX_EFI_INITRD_MEDIA_GUID },
+    .end    = { .Type    = END_DEVICE_PATH_TYPE,
+                .SubType = END_ENTIRE_DEVICE_PATH_SUBTYPE,
+                .Length  = { sizeof(EFI_DEVICE_PATH), 0 } } };
+
+// serve data (which must stay valid until uninstall_initrd) as the initrd
+// for an EFI-stub kernel. The kernel copies it, so we don't need to worry
+// about its lifetime past StartImage:
+EFI_STATUS install_initrd (CONST CHAR8 *data, UINTN size)
+{
+    static EFI_GUID dp_guid  = DEVICE_PATH_PROTOCOL;
+    static EFI_GUID lf2_guid = LOAD_FILE2_GUID;
+    EFI_STATUS res;
+
+    if( initrd.handle )
+        return EFI_ALREADY_STARTED;
+
+    initrd.data = data;
+    initrd.size = size;
+
+    res = uefi_call_wrapper( BS->InstallProtocolInterface, 4, &initrd.handle,
+                             &dp_guid, EFI_NATIVE_INTERFACE, &initrd_dp );
+    ERROR_JUMP( res, fail, L"initrd: install device path" );
+
+    res = uefi_call_wrapper( BS->InstallProtocolInterface, 4, &initrd.handle,
+                             &lf2_guid, EFI_NATIVE_INTERFACE, &initrd_lf2 );
+    ERROR_JUMP( res, fail, L"initrd: install LoadFile2" );
+
+    return EFI_SUCCESS;
+
+fail:
+    uninstall_initrd();
+    return res;
+}
+
+VOID uninstall_initrd (VOID)
+{
+    static EFI_GUID dp_guid  = DEVICE_PATH_PROTOCOL;
+    static EFI_GUID lf2_guid = LOAD_FILE2_GUID;
+
+    // removing the last interface from a handle also frees the handle:
+    if( initrd.handle )
+    {
+        uefi_call_wrapper( BS->UninstallProtocolInterface, 3, initrd.handle,
+                           &lf2_guid, &initrd_lf2 );
+        uefi_call_wrapper( BS->UninstallProtocolInterface, 3, initrd.handle,
+                           &dp_guid, &initrd_dp );
+    }
+
+    initrd.handle = NULL;
+    initrd.data   = NULL;
+    initrd.size   = 0;
+}
@@ -0,0 +1,41 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <efi.h>
+
+// direct boot of an EFI-stub kernel or a unified kernel image (UKI),
+// without going through grub:
+#define UKILDR EFIDIR L"\\Linux\\steamos.efi"
+
+// the linux efi stub looks for a LoadFile2 protocol on a handle with
+// this vendor media device path and asks it for the initrd:
+#define LINUX_EFI_INITRD_MEDIA_GUID \
+    { 0x5568e427, 0x68fc, 0x4f3d, {0xac, 0x74, 0xca, 0x55, 0x52, 0x31, 0xcc, 0x68} }
+
+// not every gnu-efi defines LoadFile2:
+#define LOAD_FILE2_GUID \
+    { 0x4006c0c1, 0xfcb3, 0x403e, {0x99, 0x6d, 0x4a, 0x6c, 0x87, 0x24, 0xe0, 0x6d} }
+
+UINTN is_linux_image (CONST CHAR8 *image, UINTN size);
+
+EFI_STATUS install_initrd (CONST CHAR8 *data, UINTN size);
+VOID uninstall_initrd (VOID);
@@ -0,0 +1,271 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <efi.h>
+
+#include "lz4.h"
+
+#define FLG_VERSION_MASK  0xc0
+#define FLG_VERSION       0x40
+#define FLG_BLOCK_CSUM    0x10
+#define FLG_CONTENT_SIZE  0x08
+#define FLG_CONTENT_CSUM  0x04
+#define FLG_DICT_ID       0x01
+
+#define BLOCK_UNCOMPRESSED 0x80000000
+#define MIN_MATCH 4
+
+typedef struct
+{
+    UINT8 flags;
+    UINTN block_max;
+    UINT64 content_size;
+    UINTN header_size;
+} lz4_frame;
+
+static UINT32 le32 (CONST UINT8 *p)
+{
+    return (UINT32) p[0]         | ((UINT32) p[1] << 8) |
+           ((UINT32) p[2] << 16) | ((UINT32) p[3] << 24);
+}
+
+UINTN lz4_frame_magic (CONST UINT8 *src, UINTN size)
+{
+    return ( size >= 4 && le32( src ) == LZ4_FRAME_MAGIC ) ? 1 : 0;
+}
+
+static EFI_STATUS parse_frame_header (CONST UINT8 *src,
+                                      UINTN size,
+                                      OUT lz4_frame *frame)
+{
+    UINTN h = 4;
+
+    if( !lz4_frame_magic( src, size ) || size < 7 )
+        return EFI_LOAD_ERROR;
+
+    frame->flags = src[ h++ ];
+
+    if( ( frame->flags & FLG_VERSION_MASK ) != FLG_VERSION )
+        return EFI_UNSUPPORTED;
+
+    if( frame->flags & FLG_DICT_ID )
+        return EFI_UNSUPPORTED;
+
+    // 4 → 64KiB, 5 → 256KiB, 6 → 1MiB, 7 → 4MiB:
+    switch( ( src[ h++ ] >> 4 ) & 0x7 )
+    {
+      case 4: frame->block_max = 64   * 1024; break;
+      case 5: frame->block_max = 256  * 1024; break;
+      case 6: frame->block_max = 1024 * 1024; break;
+      case 7: frame->block_max = 4096 * 1024; break;
+      default:
+        return EFI_UNSUPPORTED;
+    }
+
+    frame->content_size = 0;
+
+    if( frame->flags & FLG_CONTENT_SIZE )
+    {
+        if( size < h + 8 + 1 )
+            return EFI_LOAD_ERROR;
+
+        frame->content_size = (UINT64) le32( src + h ) |
+                              ((UINT64) le32( src + h + 4 ) << 32);
+        h += 8;
+    }
+
+    // header checksum byte:
+    frame->header_size = h + 1;
+
+    return EFI_SUCCESS;
+}
+
+// walk the block headers to find out how big the output can get,
+// unless the frame tells us outright:
+EFI_STATUS lz4_frame_bound (CONST UINT8 *src, UINTN size, OUT UINTN *bound)
+{
+    lz4_frame frame;
+    EFI_STATUS res;
+    UINTN pos;
+
+    *bound = 0;
+
+    res = parse_frame_header( src, size, &frame );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    if( frame.content_size )
+    {
+        *bound = (UINTN) frame.content_size;
+        return EFI_SUCCESS;
+    }
+
+    for( pos = frame.header_size; pos + 4 <= size; )
+    {
+        UINT32 block = le32( src + pos );
+        UINTN bytes = block & ~BLOCK_UNCOMPRESSED;
+
+        if( block == 0 )
+            return EFI_SUCCESS;
+
+        *bound += ( block & BLOCK_UNCOMPRESSED ) ? bytes : frame.block_max;
+        pos    += 4 + bytes + ( ( frame.flags & FLG_BLOCK_CSUM ) ? 4 : 0 );
+    }
+
+    return EFI_LOAD_ERROR;
+}
+
+// LZ4 sequence lengths: 15 in the token means "add bytes until one < 255"
+static UINTN sequence_length (UINTN len,
+                              CONST UINT8 **ip,
+                              CONST UINT8 *end,
+                              OUT UINTN *ok)
+{
+    UINT8 b;
+
+    *ok = 1;
+
+    if( len != 15 )
+        return len;
+
+    do
+    {
+        if( *ip >= end )
+        {
+            *ok = 0;
+            return 0;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while( b == 255 );
+
+    return len;
+}
+
+// decode one compressed block to op: matches may reach back into earlier
+// blocks (linked block mode), so the whole output so far is the window.
+static EFI_STATUS decode_block (CONST UINT8 *ip,
+                                CONST UINT8 *iend,
+                                UINT8 *base,
+                                IN OUT UINT8 **opp,
+                                UINT8 *oend)
+{
+    UINT8 *op = *opp;
+    UINTN ok;
+
+    while( ip < iend )
+    {
+        UINT8 token = *ip++;
+        UINTN len = sequence_length( token >> 4, &ip, iend, &ok );
+        UINTN offset;
+        CONST UINT8 *match;
+
+        if( !ok || len > (UINTN) ( iend - ip ) || len > (UINTN) ( oend - op ) )
+            return EFI_LOAD_ERROR;
+
+        for( UINTN i = 0; i < len; i++ )
+            *op++ = *ip++;
+
+        // the last sequence in a block is literals only:
+        if( ip == iend )
+            break;
+
+        if( iend - ip < 2 )
+            return EFI_LOAD_ERROR;
+
+        offset = (UINTN) ip[0] | ((UINTN) ip[1] << 8);
+        ip += 2;
+
+        if( offset == 0 || offset > (UINTN) ( op - base ) )
+            return EFI_LOAD_ERROR;
+
+        len = sequence_length( token & 0xf, &ip, iend, &ok ) + MIN_MATCH;
+        if( !ok || len > (UINTN) ( oend - op ) )
+            return EFI_LOAD_ERROR;
+
+        // byte by byte: the match may overlap the bytes it's producing
+        match = op - offset;
+        for( UINTN i = 0; i < len; i++ )
+            *op++ = *match++;
+    }
+
+    *opp = op;
+
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS lz4_frame_decode (CONST UINT8 *src,
+                             UINTN size,
+                             OUT UINT8 *dst,
+                             UINTN capacity,
+                             OUT UINTN *used)
+{
+    lz4_frame frame;
+    EFI_STATUS res;
+    UINT8 *op = dst;
+    UINT8 *oend = dst + capacity;
+    UINTN pos;
+
+    *used = 0;
+
+    res = parse_frame_header( src, size, &frame );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    for( pos = frame.header_size; pos + 4 <= size; )
+    {
+        UINT32 block = le32( src + pos );
+        UINTN bytes = block & ~BLOCK_UNCOMPRESSED;
+        CONST UINT8 *ip = src + pos + 4;
+
+        if( block == 0 )
+        {
+            *used = op - dst;
+
+            if( frame.content_size && frame.content_size != *used )
+                return EFI_LOAD_ERROR;
+
+            return EFI_SUCCESS;
+        }
+
+        if( bytes > size - pos - 4 || bytes > frame.block_max )
+            return EFI_LOAD_ERROR;
+
+        if( block & BLOCK_UNCOMPRESSED )
+        {
+            if( bytes > (UINTN) ( oend - op ) )
+                return EFI_BUFFER_TOO_SMALL;
+
+            for( UINTN i = 0; i < bytes; i++ )
+                *op++ = ip[ i ];
+        }
+        else
+        {
+            res = decode_block( ip, ip + bytes, dst, &op, oend );
+            if( res != EFI_SUCCESS )
+                return res;
+        }
+
+        pos += 4 + bytes + ( ( frame.flags & FLG_BLOCK_CSUM ) ? 4 : 0 );
+    }
+
+    // no end mark:
+    return EFI_LOAD_ERROR;
+}
@@ -0,0 +1,39 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <efi.h>
+
+// A minimal LZ4 frame decoder: no dictionaries, and the xxhash block and
+// content checksums are skipped rather than verified (the decompressed
+// image is validated as a PE binary afterwards anyway).
+// Freestanding: no libc and no firmware calls, just memory to memory.
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+#define LZ4_SUFFIX L".lz4"
+
+UINTN lz4_frame_magic (CONST UINT8 *src, UINTN size);
+EFI_STATUS lz4_frame_bound (CONST UINT8 *src, UINTN size, OUT UINTN *bound);
+EFI_STATUS lz4_frame_decode (CONST UINT8 *src,
+                             UINTN size,
+                             OUT UINT8 *dst,
+                             UINTN capacity,
+                             OUT UINTN *used);
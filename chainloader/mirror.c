@@ -0,0 +1,74 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "err.h"
+#include "util.h"
+#include "config.h"
+#include "mirror.h"
+
+static EFI_GUID steamos_guid = STEAMOS_VENDOR_GUID;
+
+// SteamOSBootconf-<partition guid>, guid in lower case as Linux shows it
+#define MIRROR_NAME_LEN ( sizeof(MIRROR_VAR_PREFIX) + 36 )
+
+EFI_STATUS read_bootconf_mirror (CONST EFI_GUID *partition,
+                                 OUT cfg_summary *sum,
+                                 OUT UINT64 *generation)
+{
+    CHAR16 name[ MIRROR_NAME_LEN ];
+    CHAR8 data[ MIRROR_SIZE ];
+    UINTN size = sizeof(data);
+    UINT32 attr = 0;
+    UINT32 flags;
+    EFI_STATUS res;
+
+    SPrint( name, sizeof(name),
+            L"%a%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+            MIRROR_VAR_PREFIX,
+            partition->Data1, partition->Data2, partition->Data3,
+            partition->Data4[0], partition->Data4[1], partition->Data4[2],
+            partition->Data4[3], partition->Data4[4], partition->Data4[5],
+            partition->Data4[6], partition->Data4[7] );
+
+    res = get_efi_variable( name, &steamos_guid, &attr, &size, data );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    if( size != MIRROR_SIZE ||
+        bootbin_get( data + MIRROR_OFF_VERSION, 4 ) != MIRROR_VERSION )
+        return EFI_INCOMPATIBLE_VERSION;
+
+    flags = (UINT32) bootbin_get( data + MIRROR_OFF_FLAGS, 4 );
+
+    ZeroMem( sum, sizeof(*sum) );
+    sum->requested_at  = bootbin_get( data + MIRROR_OFF_REQUESTED_AT, 8 );
+    sum->window_start  = bootbin_get( data + MIRROR_OFF_WINDOW_START, 8 );
+    sum->window_end    = bootbin_get( data + MIRROR_OFF_WINDOW_END  , 8 );
+    sum->boot_other    = ( flags & MIRROR_BOOT_OTHER    ) ? 1 : 0;
+    sum->image_invalid = ( flags & MIRROR_IMAGE_INVALID ) ? 1 : 0;
+    sum->update        = ( flags & MIRROR_UPDATE        ) ? 1 : 0;
+
+    *generation = bootbin_get( data + MIRROR_OFF_GENERATION, 8 );
+
+    return EFI_SUCCESS;
+}
@@ -0,0 +1,68 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include "bootbin.h"
+
+// steamos-bootconf --efivar-mirror copies the fields candidates are
+// ranked by into a non-volatile variable per image, so the chainloader
+// can pick one without mounting every ESP. The variable is named after
+// the GPT unique guid of the partition holding the bootconf:
+//   SteamOSBootconf-xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+// in the STEAMOS_VENDOR_GUID namespace. The value (little endian):
+//
+//   0  version      u32 MIRROR_VERSION
+//   4  reserved     u32
+//   8  generation   u64 the bootconf's mirror-generation when written
+//  16  requested_at u64 boot-requested-at
+//  24  window_start u64 update-window-start
+//  32  window_end   u64 update-window-end
+//  40  flags        u32 MIRROR_* bits
+//  44  reserved     u32
+//
+// steamos-bootconf bumps mirror-generation in the file every time it
+// rewrites it: if the generations disagree the file has been changed
+// behind the mirror's back and the chainloader doesn't trust it.
+
+#define MIRROR_VAR_PREFIX "SteamOSBootconf-"
+// STEAMOS_VENDOR_GUID (util.h) as efivarfs spells it:
+#define STEAMOS_VENDOR_GUID_STR "b08b02b9-bde7-47a8-b5ae-90f5341c0ce3"
+#define MIRROR_VERSION 1
+#define MIRROR_SIZE    48
+// non-volatile, boot services and runtime access:
+#define MIRROR_VAR_ATTRS 0x07
+
+#define MIRROR_OFF_VERSION      0
+#define MIRROR_OFF_GENERATION   8
+#define MIRROR_OFF_REQUESTED_AT 16
+#define MIRROR_OFF_WINDOW_START 24
+#define MIRROR_OFF_WINDOW_END   32
+#define MIRROR_OFF_FLAGS        40
+
+#define MIRROR_BOOT_OTHER    0x01
+#define MIRROR_IMAGE_INVALID 0x02
+#define MIRROR_UPDATE        0x04
+
+#ifndef NO_EFI_TYPES
+EFI_STATUS read_bootconf_mirror (CONST EFI_GUID *partition,
+                                 OUT cfg_summary *sum,
+                                 OUT UINT64 *generation);
+#endif
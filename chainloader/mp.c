@@ -0,0 +1,198 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "err.h"
+#include "util.h"
+#include "mp.h"
+
+typedef struct _mp_services mp_services;
+
+typedef VOID (EFI_CALLBACK *ap_procedure) (VOID *arg);
+
+// not in every gnu-efi, hence the local definition. Only StartupThisAP,
+// WhoAmI and GetNumberOfProcessors are called, but the layout has to
+// match the whole protocol:
+struct _mp_services
+{
+    EFI_STATUS (EFIAPI *get_number_of_processors) (mp_services *this,
+                                                   OUT UINTN *total,
+                                                   OUT UINTN *enabled);
+    VOID *get_processor_info;
+    VOID *startup_all_aps;
+    EFI_STATUS (EFIAPI *startup_this_ap) (mp_services *this,
+                                          ap_procedure procedure,
+                                          UINTN cpu,
+                                          EFI_EVENT wait_event,
+                                          UINTN timeout_usec,
+                                          VOID *arg,
+                                          OUT BOOLEAN *finished);
+    VOID *switch_bsp;
+    VOID *enable_disable_ap;
+    EFI_STATUS (EFIAPI *who_am_i) (mp_services *this, OUT UINTN *cpu);
+};
+
+static struct
+{
+    UINTN probed;
+    mp_services *mp;
+    UINTN cpus;
+    UINTN bsp;
+    UINTN busy[ MAX_AP_JOBS + 1 ];
+    EFI_EVENT retired[ MAX_AP_JOBS + 1 ];
+} mp_state;
+
+// the APs can't call firmware services, which is fine because jobs are
+// pure computation. The AP procedure must use the firmware ABI though:
+static VOID EFI_CALLBACK job_trampoline (VOID *arg)
+{
+    job *j = arg;
+
+    j->fn( j->arg );
+
+    __sync_synchronize();
+    j->finished = 1;
+}
+
+// DxeMpLib only notices that a non-blocking AP job has returned (and
+// signals its event) from a timer that can run ~100ms later, so job_wait
+// watches j->finished instead. The AP stays busy as far as the firmware
+// is concerned until the event fires, so it isn't reused before then:
+static UINTN ap_idle (UINTN cpu)
+{
+    EFI_EVENT ev = mp_state.retired[ cpu ];
+
+    if( !mp_state.busy[ cpu ] )
+        return 1;
+
+    if( !ev || uefi_call_wrapper( BS->CheckEvent, 1, ev ) != EFI_SUCCESS )
+        return 0;
+
+    uefi_call_wrapper( BS->CloseEvent, 1, ev );
+    mp_state.retired[ cpu ] = NULL;
+    mp_state.busy[ cpu ] = 0;
+
+    return 1;
+}
+
+static VOID mp_probe (VOID)
+{
+    static EFI_GUID mp_guid = MP_SERVICES_GUID;
+    EFI_STATUS res;
+    UINTN total = 0;
+    UINTN enabled = 0;
+
+    mp_state.probed = 1;
+
+    res = uefi_call_wrapper( BS->LocateProtocol, 3, &mp_guid, NULL,
+                             (VOID **) &mp_state.mp );
+    if( res != EFI_SUCCESS )
+    {
+        mp_state.mp = NULL;
+        return;
+    }
+
+    res = uefi_call_wrapper( mp_state.mp->get_number_of_processors, 3,
+                             mp_state.mp, &total, &enabled );
+    if( res == EFI_SUCCESS )
+        res = uefi_call_wrapper( mp_state.mp->who_am_i, 2,
+                                 mp_state.mp, &mp_state.bsp );
+
+    if( res != EFI_SUCCESS || enabled < 2 )
+    {
+        mp_state.mp = NULL;
+        return;
+    }
+
+    mp_state.cpus = total;
+    if( mp_state.cpus > MAX_AP_JOBS + 1 )
+        mp_state.cpus = MAX_AP_JOBS + 1;
+
+    if( verbose )
+        Print( L"MP services: %u of %u processors enabled\n", enabled, total );
+}
+
+UINTN mp_processors (VOID)
+{
+    if( !mp_state.probed )
+        mp_probe();
+
+    return mp_state.mp ? mp_state.cpus : 1;
+}
+
+// start fn( arg ) on an idle AP and return true, or return false without
+// running it if there isn't one. Every started job must be job_waited for:
+UINTN job_start (OUT job *j, job_fn fn, VOID *arg)
+{
+    EFI_STATUS res;
+
+    j->fn       = fn;
+    j->arg      = arg;
+    j->done     = NULL;
+    j->on_ap    = 0;
+    j->finished = 0;
+
+    if( mp_processors() > 1 &&
+        uefi_call_wrapper( BS->CreateEvent, 5, 0, 0, NULL, NULL,
+                           &j->done ) == EFI_SUCCESS )
+    {
+        for( UINTN cpu = 0; cpu < mp_state.cpus; cpu++ )
+        {
+            if( cpu == mp_state.bsp || !ap_idle( cpu ) )
+                continue;
+
+            // disabled or otherwise unavailable APs just fail here:
+            res = uefi_call_wrapper( mp_state.mp->startup_this_ap, 7,
+                                     mp_state.mp, job_trampoline, cpu,
+                                     j->done, 0, j, NULL );
+            if( res != EFI_SUCCESS )
+                continue;
+
+            mp_state.busy[ cpu ] = 1;
+            j->cpu   = cpu;
+            j->on_ap = 1;
+
+            return 1;
+        }
+
+        uefi_call_wrapper( BS->CloseEvent, 1, j->done );
+        j->done = NULL;
+    }
+
+    return 0;
+}
+
+VOID job_wait (IN OUT job *j)
+{
+    if( !j->on_ap )
+        return;
+
+    while( !j->finished )
+        uefi_call_wrapper( BS->Stall, 1, 1 );
+
+    // the event is closed by ap_idle once the firmware has signalled it:
+    mp_state.retired[ j->cpu ] = j->done;
+    ap_idle( j->cpu );
+
+    j->done  = NULL;
+    j->on_ap = 0;
+}
@@ -0,0 +1,45 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <efi.h>
+
+// PI spec MP services (the protocol is defined in mp.c):
+#define MP_SERVICES_GUID \
+    { 0x3fdda605, 0xa76e, 0x4f46, {0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08} }
+
+#define MAX_AP_JOBS 8
+
+typedef VOID (*job_fn) (VOID *arg);
+
+typedef struct
+{
+    job_fn fn;
+    VOID *arg;
+    EFI_EVENT done;
+    UINTN cpu;
+    UINTN on_ap;
+    volatile UINTN finished;
+} job;
+
+UINTN mp_processors (VOID);
+UINTN job_start (OUT job *j, job_fn fn, VOID *arg);
+VOID job_wait (IN OUT job *j);
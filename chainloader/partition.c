@@ -0,0 +1,281 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <efi.h>
+#include <efilib.h>
+#include <efiprot.h>
+
+#include "err.h"
+#include "util.h"
+#include "partition.h"
+
+EFI_STATUS get_partition_info (EFI_HANDLE handle, OUT partition_info **info)
+{
+    static EFI_GUID pi_guid = PARTITION_INFO_GUID;
+
+    return get_handle_protocol( &handle, &pi_guid, (VOID **) info );
+}
+
+static EFI_DEVICE_PATH * handle_device_path (EFI_HANDLE handle)
+{
+    static EFI_GUID dp_guid = DEVICE_PATH_PROTOCOL;
+    EFI_DEVICE_PATH *dp = NULL;
+
+    if( get_handle_protocol( &handle, &dp_guid, (VOID **) &dp ) != EFI_SUCCESS )
+        return NULL;
+
+    return dp;
+}
+
+// size of the part of a device path that describes the disk
+// (everything before the partition node), 0 if there's no partition node:
+static UINTN disk_path_size (EFI_DEVICE_PATH *dp)
+{
+    HARDDRIVE_DEVICE_PATH *hd = get_partition_node( dp );
+
+    return hd ? (UINTN)((UINT8 *) hd - (UINT8 *) dp) : 0;
+}
+
+static UINTN on_usb_bus (EFI_DEVICE_PATH *dp)
+{
+    for( ; dp && !IsDevicePathEnd( dp ); dp = NextDevicePathNode( dp ) )
+        if( DevicePathType( dp ) == MESSAGING_DEVICE_PATH &&
+            ( DevicePathSubType( dp ) == MSG_USB_DP       ||
+              DevicePathSubType( dp ) == MSG_USB_CLASS_DP ) )
+            return 1;
+
+    return 0;
+}
+
+static UINTN is_removable (EFI_HANDLE handle, EFI_DEVICE_PATH *dp)
+{
+    static EFI_GUID bio_guid = BLOCK_IO_PROTOCOL;
+    EFI_BLOCK_IO *bio = NULL;
+
+    if( on_usb_bus( dp ) )
+        return 1;
+
+    if( get_handle_protocol( &handle, &bio_guid, (VOID **) &bio ) != EFI_SUCCESS )
+        return 0;
+
+    return ( bio->Media && bio->Media->RemovableMedia ) ? 1 : 0;
+}
+
+static UINTN gpt_flags (EFI_HANDLE handle)
+{
+    static EFI_GUID esp_type  = ESP_TYPE_GUID;
+    static EFI_GUID data_type = BASIC_DATA_TYPE_GUID;
+    partition_info *pi = NULL;
+    UINTN flags = 0;
+
+    if( get_partition_info( handle, &pi ) != EFI_SUCCESS )
+        return 0;
+
+    if( pi->type != PARTITION_TYPE_GPT )
+        return 0;
+
+    if( !CompareMem( &pi->info.gpt.type, &esp_type, sizeof(EFI_GUID) ) )
+        flags |= PART_ESP_TYPE;
+    else if( !CompareMem( &pi->info.gpt.type, &data_type, sizeof(EFI_GUID) ) )
+        flags |= PART_DATA_TYPE;
+
+    // SteamOS labels its image ESPs efi-A, efi-B and so forth:
+    if( ( pi->info.gpt.name[0] | 0x20 ) == L'e' &&
+        ( pi->info.gpt.name[1] | 0x20 ) == L'f' &&
+        ( pi->info.gpt.name[2] | 0x20 ) == L'i' &&
+        ( pi->info.gpt.name[3] == L'-' ) )
+        flags |= PART_EFI_LABEL;
+
+    return flags;
+}
+
+// the device path of the disk the chainloader was loaded from:
+static EFI_DEVICE_PATH * self_disk_path (OUT UINTN *size)
+{
+    static EFI_GUID lip_guid = LOADED_IMAGE_PROTOCOL;
+    EFI_HANDLE self = get_self_handle();
+    EFI_LOADED_IMAGE *li = NULL;
+    EFI_DEVICE_PATH *self_dp = NULL;
+
+    if( get_handle_protocol( &self, &lip_guid, (VOID **) &li ) == EFI_SUCCESS )
+        self_dp = handle_device_path( li->DeviceHandle );
+
+    *size = disk_path_size( self_dp );
+
+    return self_dp;
+}
+
+static UINTN on_disk (EFI_DEVICE_PATH *dp,
+                      EFI_DEVICE_PATH *disk_dp,
+                      UINTN disk_dsize)
+{
+    return ( disk_dsize &&
+             disk_path_size( dp ) == disk_dsize &&
+             !CompareMem( dp, disk_dp, disk_dsize ) ) ? 1 : 0;
+}
+
+static UINTN score_target (UINTN flags)
+{
+    return ( ( flags & PART_SAME_DISK ) ? 8 : 0 ) +
+           ( ( flags & PART_EFI_LABEL ) ? 4 : 0 ) +
+           ( ( flags & PART_ESP_TYPE  ) ? 2 : 0 ) +
+           ( ( flags & PART_DATA_TYPE ) ? 1 : 0 ) ;
+}
+
+// Work out which of the file system handles are worth mounting, and in
+// what order, using only the device path and GPT metadata.
+// The chainloader's own disk goes first; removable and non-GPT media are
+// dropped (unless on our own disk or the policy says otherwise) as are
+// duplicate views of the same partition.
+UINTN order_probe_targets (EFI_HANDLE *handles,
+                           CONST UINTN n_handles,
+                           UINTN policy,
+                           OUT probe_target *targets)
+{
+    UINTN self_dsize = 0;
+    EFI_DEVICE_PATH *self_dp = self_disk_path( &self_dsize );
+    UINTN n = 0;
+
+    for( UINTN i = 0; i < n_handles && n < MAX_PROBE_TARGETS; i++ )
+    {
+        EFI_DEVICE_PATH *dp = handle_device_path( handles[ i ] );
+        probe_target *t = &targets[ n ];
+        UINTN dup = 0;
+
+        ZeroMem( t, sizeof(*t) );
+        t->handle = handles[ i ];
+        t->index  = i;
+
+        if( get_partition_guid( handles[ i ], &t->guid ) == EFI_SUCCESS )
+            t->flags |= PART_GPT | gpt_flags( handles[ i ] );
+
+        if( on_disk( dp, self_dp, self_dsize ) )
+            t->flags |= PART_SAME_DISK;
+
+        if( is_removable( handles[ i ], dp ) )
+            t->flags |= PART_REMOVABLE;
+
+        if( !( t->flags & PART_SAME_DISK ) )
+        {
+            if( ( t->flags & PART_REMOVABLE ) &&
+                !( policy & PROBE_ALLOW_REMOVABLE ) )
+                continue;
+
+            if( !( t->flags & PART_GPT ) &&
+                !( policy & PROBE_ALLOW_NON_GPT ) )
+                continue;
+        }
+
+        for( UINTN j = 0; !dup && ( t->flags & PART_GPT ) && j < n; j++ )
+            if( ( targets[ j ].flags & PART_GPT ) &&
+                !CompareMem( &targets[ j ].guid, &t->guid, sizeof(EFI_GUID) ) )
+                dup = 1;
+
+        if( dup )
+            continue;
+
+        t->score = score_target( t->flags );
+        n++;
+    }
+
+    // stable insertion sort, highest score first, otherwise firmware order:
+    for( UINTN i = 1; i < n; i++ )
+    {
+        probe_target t;
+        UINTN j = i;
+
+        CopyMem( &t, &targets[ i ], sizeof(t) );
+
+        for( ; j > 0 && targets[ j - 1 ].score < t.score; j-- )
+            CopyMem( &targets[ j ], &targets[ j - 1 ], sizeof(t) );
+
+        CopyMem( &targets[ j ], &t, sizeof(t) );
+    }
+
+    if( verbose )
+        for( UINTN i = 0; i < n; i++ )
+            Print( L"probe #%u: handle #%u flags 0x%x score %u\n",
+                   i, targets[ i ].index, targets[ i ].flags,
+                   targets[ i ].score );
+
+    return n;
+}
+
+// Firmware with "fast boot" enabled typically only connects the file
+// system driver to the boot partition, so the other SteamOS image is
+// invisible to a SIMPLE_FILE_SYSTEM handle search.
+// Connect (non-recursively) just the GPT partitions that look like
+// SteamOS ESPs (by type or label) and have no file system yet.
+// If the firmware can't tell us partition types we fall back to the
+// GPT partitions on our own disk.
+UINTN connect_steamos_partitions (VOID)
+{
+    static EFI_GUID bio_guid = BLOCK_IO_PROTOCOL;
+    static EFI_GUID fs_guid  = SIMPLE_FILE_SYSTEM_PROTOCOL;
+    EFI_HANDLE *handles = NULL;
+    UINTN count = 0;
+    UINTN connected = 0;
+    UINTN self_dsize = 0;
+    EFI_DEVICE_PATH *self_dp = self_disk_path( &self_dsize );
+    EFI_STATUS res;
+
+    res = get_protocol_handles( &bio_guid, &handles, &count );
+    ERROR_RETURN( res, 0, L"no block io handles" );
+
+    for( UINTN i = 0; i < count; i++ )
+    {
+        EFI_DEVICE_PATH *dp = handle_device_path( handles[ i ] );
+        HARDDRIVE_DEVICE_PATH *hd = get_partition_node( dp );
+        partition_info *pi = NULL;
+        VOID *fs = NULL;
+
+        if( !hd || hd->MBRType != MBR_TYPE_EFI_PARTITION_TABLE_HEADER )
+            continue;
+
+        if( get_handle_protocol( &handles[ i ], &fs_guid, &fs ) == EFI_SUCCESS )
+            continue;
+
+        if( get_partition_info( handles[ i ], &pi ) == EFI_SUCCESS )
+        {
+            if( !( gpt_flags( handles[ i ] ) & (PART_ESP_TYPE|PART_EFI_LABEL) ) )
+                continue;
+        }
+        else if( !on_disk( dp, self_dp, self_dsize ) )
+        {
+            continue;
+        }
+
+        res = uefi_call_wrapper( BS->ConnectController, 4,
+                                 handles[ i ], NULL, NULL, FALSE );
+        WARN_STATUS( res, L"connect partition handle #%u", i );
+
+        if( res == EFI_SUCCESS )
+            connected++;
+    }
+
+    efi_free( handles );
+
+    if( verbose )
+        Print( L"Connected %u partitions out of %u block devices\n",
+               connected, count );
+
+    return connected;
+}
@@ -0,0 +1,108 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <efi.h>
+
+#define MAX_PROBE_TARGETS 64
+
+// UEFI 2.7 partition info protocol: gives us the GPT entry (type guid,
+// label) of a partition handle without touching the volume itself.
+// Not all gnu-efi versions define it, hence the local definition:
+#define PARTITION_INFO_GUID \
+    { 0x8cf2f62c, 0xbc9b, 0x4821, {0x80, 0x8d, 0xec, 0x9e, 0xc4, 0x21, 0xa1, 0xa0} }
+
+#define PARTITION_TYPE_OTHER 0
+#define PARTITION_TYPE_MBR   1
+#define PARTITION_TYPE_GPT   2
+
+typedef struct
+{
+    EFI_GUID type;
+    EFI_GUID unique;
+    UINT64 start_lba;
+    UINT64 end_lba;
+    UINT64 attributes;
+    CHAR16 name[36];
+} __attribute__ ((packed)) gpt_entry;
+
+typedef struct
+{
+    UINT32 revision;
+    UINT32 type;
+    UINT8  system;
+    UINT8  reserved[7];
+    union
+    {
+        UINT8 mbr[16];
+        gpt_entry gpt;
+    } info;
+} __attribute__ ((packed)) partition_info;
+
+#define ESP_TYPE_GUID \
+    { 0xc12a7328, 0xf81f, 0x11d2, {0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b} }
+#define BASIC_DATA_TYPE_GUID \
+    { 0xebd0a0a2, 0xb9e5, 0x4433, {0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7} }
+
+// probe target flags:
+#define PART_GPT        0x01 // GPT partition (has a unique partition guid)
+#define PART_SAME_DISK  0x02 // on the disk the chainloader was loaded from
+#define PART_REMOVABLE  0x04 // removable media or on a USB bus
+#define PART_ESP_TYPE   0x08 // GPT type is EFI System Partition
+#define PART_DATA_TYPE  0x10 // GPT type is basic data (FAT is common here)
+#define PART_EFI_LABEL  0x20 // GPT label looks like a SteamOS efi-X partition
+
+// probe policy flags:
+#define PROBE_ALLOW_REMOVABLE 0x01
+#define PROBE_ALLOW_NON_GPT   0x02
+#define PROBE_ALLOW_ALL       (PROBE_ALLOW_REMOVABLE|PROBE_ALLOW_NON_GPT)
+
+// the default policy can be set at build time, eg -DPROBE_POLICY=0x01
+#ifndef PROBE_POLICY
+#define PROBE_POLICY 0
+#endif
+
+// connect SteamOS partitions the firmware left unconnected (fast boot):
+#ifndef CONNECT_PARTITIONS
+#define CONNECT_PARTITIONS 1
+#endif
+
+// stop probing once this many loaders have been found (an A/B pair):
+#define PROBE_STOP_AFTER 2
+
+typedef struct
+{
+    EFI_HANDLE handle;
+    EFI_GUID guid;
+    UINTN index; // position in the firmware handle list
+    UINTN flags;
+    UINTN score;
+} probe_target;
+
+EFI_STATUS get_partition_info (EFI_HANDLE handle, OUT partition_info **info);
+
+UINTN connect_steamos_partitions (VOID);
+
+UINTN order_probe_targets (EFI_HANDLE *handles,
+                           CONST UINTN n_handles,
+                           UINTN policy,
+                           OUT probe_target *targets);
@@ -0,0 +1,319 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <efi.h>
+
+#include "util.h"
+#include "sha256.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI 1
+#else
+#define HAVE_SHA_NI 0
+#endif
+
+typedef VOID (*sha256_blocks_fn) (UINT32 *state, CONST UINT8 *data, UINTN n);
+
+static CONST UINT32 K[ 64 ] =
+  { 0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+#define ROR(x,n) ( ( (x) >> (n) ) | ( (x) << ( 32 - (n) ) ) )
+
+static UINT32 be32 (CONST UINT8 *p)
+{
+    return ((UINT32) p[0] << 24) | ((UINT32) p[1] << 16) |
+           ((UINT32) p[2] <<  8) |  (UINT32) p[3];
+}
+
+static VOID sha256_blocks_portable (UINT32 *state, CONST UINT8 *data, UINTN n)
+{
+    UINT32 w[ 64 ];
+
+    for( ; n; n--, data += SHA256_BLOCK_SIZE )
+    {
+        UINT32 a = state[0], b = state[1], c = state[2], d = state[3];
+        UINT32 e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for( UINTN i = 0; i < 16; i++ )
+            w[ i ] = be32( data + i * 4 );
+
+        for( UINTN i = 16; i < 64; i++ )
+        {
+            UINT32 s0 = ROR( w[i-15],  7 ) ^ ROR( w[i-15], 18 ) ^ ( w[i-15] >>  3 );
+            UINT32 s1 = ROR( w[i- 2], 17 ) ^ ROR( w[i- 2], 19 ) ^ ( w[i- 2] >> 10 );
+            w[ i ] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        for( UINTN i = 0; i < 64; i++ )
+        {
+            UINT32 s1 = ROR( e, 6 ) ^ ROR( e, 11 ) ^ ROR( e, 25 );
+            UINT32 ch = ( e & f ) ^ ( ~e & g );
+            UINT32 t1 = h + s1 + ch + K[ i ] + w[ i ];
+            UINT32 s0 = ROR( a, 2 ) ^ ROR( a, 13 ) ^ ROR( a, 22 );
+            UINT32 mj = ( a & b ) ^ ( a & c ) ^ ( b & c );
+            UINT32 t2 = s0 + mj;
+
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if HAVE_SHA_NI
+// The build disables SSE globally (see configure.ac), so this function
+// opts back in explicitly, and is only used once we've checked both the
+// cpu and that the firmware has actually enabled SSE (CR4.OSFXSR).
+// Standard SHA-NI schedule: state is kept as ABEF/CDGH register pairs,
+// 4 rounds per sha256rnds2 pair, message schedule via sha256msg1/2:
+__attribute__ ((target("sha,sse4.1")))
+static VOID sha256_blocks_ni (UINT32 *state, CONST UINT8 *data, UINTN n)
+{
+    CONST __m128i bswap = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL,
+                                          0x0405060700010203ULL );
+    __m128i tmp, s0, s1, msg, m0, m1, m2, m3, abef_save, cdgh_save;
+
+    tmp = _mm_loadu_si128( (CONST __m128i *) &state[0] );
+    s1  = _mm_loadu_si128( (CONST __m128i *) &state[4] );
+
+    tmp = _mm_shuffle_epi32( tmp, 0xb1 );       // CDAB
+    s1  = _mm_shuffle_epi32( s1 , 0x1b );       // EFGH
+    s0  = _mm_alignr_epi8( tmp, s1, 8 );        // ABEF
+    s1  = _mm_blend_epi16( s1, tmp, 0xf0 );     // CDGH
+
+#define ROUNDS4(m, k)                                                   \
+    msg = _mm_add_epi32( m, _mm_loadu_si128( (CONST __m128i *) &K[k] ) ); \
+    s1  = _mm_sha256rnds2_epu32( s1, s0, msg );                         \
+    msg = _mm_shuffle_epi32( msg, 0x0e );                               \
+    s0  = _mm_sha256rnds2_epu32( s0, s1, msg )
+
+// next schedule word group: a = msg1(a, b) + alignr(d, c) then msg2 with d
+#define SCHEDULE(a, b, c, d)                                            \
+    a = _mm_sha256msg1_epu32( a, b );                                   \
+    a = _mm_add_epi32( a, _mm_alignr_epi8( d, c, 4 ) );                 \
+    a = _mm_sha256msg2_epu32( a, d )
+
+    for( ; n; n--, data += SHA256_BLOCK_SIZE )
+    {
+        abef_save = s0;
+        cdgh_save = s1;
+
+        m0 = _mm_shuffle_epi8( _mm_loadu_si128( (CONST __m128i *) ( data +  0 ) ), bswap );
+        m1 = _mm_shuffle_epi8( _mm_loadu_si128( (CONST __m128i *) ( data + 16 ) ), bswap );
+        m2 = _mm_shuffle_epi8( _mm_loadu_si128( (CONST __m128i *) ( data + 32 ) ), bswap );
+        m3 = _mm_shuffle_epi8( _mm_loadu_si128( (CONST __m128i *) ( data + 48 ) ), bswap );
+
+        ROUNDS4( m0,  0 );
+        ROUNDS4( m1,  4 );
+        ROUNDS4( m2,  8 );
+        ROUNDS4( m3, 12 );
+
+        for( UINTN k = 16; k < 64; k += 16 )
+        {
+            SCHEDULE( m0, m1, m2, m3 ); ROUNDS4( m0, k      );
+            SCHEDULE( m1, m2, m3, m0 ); ROUNDS4( m1, k +  4 );
+            SCHEDULE( m2, m3, m0, m1 ); ROUNDS4( m2, k +  8 );
+            SCHEDULE( m3, m0, m1, m2 ); ROUNDS4( m3, k + 12 );
+        }
+
+        s0 = _mm_add_epi32( s0, abef_save );
+        s1 = _mm_add_epi32( s1, cdgh_save );
+    }
+
+#undef ROUNDS4
+#undef SCHEDULE
+
+    tmp = _mm_shuffle_epi32( s0, 0x1b );        // FEBA
+    s1  = _mm_shuffle_epi32( s1, 0xb1 );        // DCHG
+    s0  = _mm_blend_epi16( tmp, s1, 0xf0 );     // DCBA
+    s1  = _mm_alignr_epi8( s1, tmp, 8 );        // HGFE
+
+    _mm_storeu_si128( (__m128i *) &state[0], s0 );
+    _mm_storeu_si128( (__m128i *) &state[4], s1 );
+}
+
+static UINTN sha_ni_usable (VOID)
+{
+    UINT32 a, b, c, d;
+    UINT64 cr4 = 0;
+
+    if( !__get_cpuid( 1, &a, &b, &c, &d ) || !( c & bit_SSE4_1 ) ||
+        !( c & bit_SSSE3 ) )
+        return 0;
+
+    if( !__get_cpuid_count( 7, 0, &a, &b, &c, &d ) || !( b & bit_SHA ) )
+        return 0;
+
+    // the cpu can do it, but has the firmware turned SSE on?
+    __asm__ __volatile__ ( "mov %%cr4, %0" : "=r" (cr4) );
+
+    return ( cr4 & ( 1 << 9 ) ) ? 1 : 0;
+}
+#endif
+
+static sha256_blocks_fn sha256_blocks;
+
+static sha256_blocks_fn sha256_dispatch (VOID)
+{
+    if( !sha256_blocks )
+    {
+        sha256_blocks = sha256_blocks_portable;
+#if HAVE_SHA_NI
+        if( sha_ni_usable() )
+            sha256_blocks = sha256_blocks_ni;
+#endif
+    }
+
+    return sha256_blocks;
+}
+
+CONST CHAR16 *sha256_engine (VOID)
+{
+#if HAVE_SHA_NI
+    if( sha256_dispatch() == sha256_blocks_ni )
+        return L"sha-ni";
+#endif
+    return L"portable";
+}
+
+VOID sha256_init (OUT sha256_ctx *ctx)
+{
+    static CONST UINT32 H0[ 8 ] =
+      { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    for( UINTN i = 0; i < 8; i++ )
+        ctx->state[ i ] = H0[ i ];
+
+    ctx->length = 0;
+    ctx->used   = 0;
+}
+
+VOID sha256_update (IN OUT sha256_ctx *ctx, CONST VOID *data, UINTN size)
+{
+    CONST UINT8 *p = data;
+    sha256_blocks_fn blocks = sha256_dispatch();
+
+    ctx->length += size;
+
+    if( ctx->used )
+    {
+        while( size && ctx->used < SHA256_BLOCK_SIZE )
+        {
+            ctx->block[ ctx->used++ ] = *p++;
+            size--;
+        }
+
+        if( ctx->used < SHA256_BLOCK_SIZE )
+            return;
+
+        blocks( ctx->state, ctx->block, 1 );
+        ctx->used = 0;
+    }
+
+    if( size >= SHA256_BLOCK_SIZE )
+    {
+        blocks( ctx->state, p, size / SHA256_BLOCK_SIZE );
+        p    += size - ( size % SHA256_BLOCK_SIZE );
+        size %= SHA256_BLOCK_SIZE;
+    }
+
+    while( size-- )
+        ctx->block[ ctx->used++ ] = *p++;
+}
+
+VOID sha256_final (IN OUT sha256_ctx *ctx, OUT UINT8 *digest)
+{
+    sha256_blocks_fn blocks = sha256_dispatch();
+    UINT64 bits = ctx->length * 8;
+
+    ctx->block[ ctx->used++ ] = 0x80;
+
+    if( ctx->used > SHA256_BLOCK_SIZE - 8 )
+    {
+        while( ctx->used < SHA256_BLOCK_SIZE )
+            ctx->block[ ctx->used++ ] = 0;
+        blocks( ctx->state, ctx->block, 1 );
+        ctx->used = 0;
+    }
+
+    while( ctx->used < SHA256_BLOCK_SIZE - 8 )
+        ctx->block[ ctx->used++ ] = 0;
+
+    for( UINTN i = 0; i < 8; i++ )
+        ctx->block[ SHA256_BLOCK_SIZE - 1 - i ] = (UINT8) ( bits >> ( i * 8 ) );
+
+    blocks( ctx->state, ctx->block, 1 );
+
+    for( UINTN i = 0; i < 8; i++ )
+    {
+        digest[ i * 4     ] = (UINT8) ( ctx->state[ i ] >> 24 );
+        digest[ i * 4 + 1 ] = (UINT8) ( ctx->state[ i ] >> 16 );
+        digest[ i * 4 + 2 ] = (UINT8) ( ctx->state[ i ] >>  8 );
+        digest[ i * 4 + 3 ] = (UINT8) ( ctx->state[ i ]       );
+    }
+}
+
+// the first 64 hex digits of hex (as in sha256sum output or the
+// steamcl.version manifest) → digest. Returns 1 on success:
+UINTN sha256_parse_hex (CONST CHAR8 *hex, UINTN size, OUT UINT8 *digest)
+{
+    if( size < SHA256_DIGEST_SIZE * 2 )
+        return 0;
+
+    for( UINTN i = 0; i < SHA256_DIGEST_SIZE * 2; i++ )
+    {
+        INTN v = hexval( hex[ i ] );
+
+        if( v < 0 )
+            return 0;
+
+        if( i & 1 )
+            digest[ i / 2 ] |= (UINT8) v;
+        else
+            digest[ i / 2 ] = (UINT8) ( v << 4 );
+    }
+
+    // a longer run of hex digits is not a sha256:
+    if( size > SHA256_DIGEST_SIZE * 2 &&
+        hexval( hex[ SHA256_DIGEST_SIZE * 2 ] ) >= 0 )
+        return 0;
+
+    return 1;
+}
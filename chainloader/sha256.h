@@ -0,0 +1,41 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <efi.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE  64
+
+typedef struct
+{
+    UINT32 state[ 8 ];
+    UINT64 length;
+    UINT8 block[ SHA256_BLOCK_SIZE ];
+    UINTN used;
+} sha256_ctx;
+
+VOID sha256_init (OUT sha256_ctx *ctx);
+VOID sha256_update (IN OUT sha256_ctx *ctx, CONST VOID *data, UINTN size);
+VOID sha256_final (IN OUT sha256_ctx *ctx, OUT UINT8 *digest);
+
+UINTN sha256_parse_hex (CONST CHAR8 *hex, UINTN size, OUT UINT8 *digest);
+CONST CHAR16 *sha256_engine (VOID);
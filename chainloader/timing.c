@@ -0,0 +1,219 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <efi.h>
+#include <efilib.h>
+
+#include "err.h"
+#include "util.h"
+#include "timing.h"
+
+typedef struct
+{
+    UINTN partition;
+    UINT64 ticks;
+} probe_time;
+
+static UINT64 ticks_per_ms;
+static UINT64 stamps[TS_MAX];
+static probe_time probes[MAX_PROBE_TIMES];
+static UINTN n_probes;
+
+// this is x86_64 specific, like the rest of the chainloader:
+UINT64 read_tsc (VOID)
+{
+#if defined(__x86_64__)
+    UINT32 lo, hi;
+
+    __asm__ __volatile__ ( "rdtsc" : "=a" (lo), "=d" (hi) );
+
+    return ((UINT64) hi << 32) | lo;
+#else
+    return 0;
+#endif
+}
+
+UINT64 tsc_to_usec (UINT64 ticks)
+{
+    if( !ticks_per_ms )
+        return 0;
+
+    return ( ticks * 1000 ) / ticks_per_ms;
+}
+
+// the TSC frequency is not something EFI will tell us, so we
+// measure it against a firmware Stall of 1ms (same as systemd-boot):
+VOID timing_init (VOID)
+{
+    UINT64 start = read_tsc();
+
+    uefi_call_wrapper( BS->Stall, 1, 1000 );
+
+    ticks_per_ms = read_tsc() - start;
+}
+
+VOID timing_mark (boot_phase phase)
+{
+    if( phase < TS_MAX )
+        stamps[ phase ] = read_tsc();
+}
+
+UINT64 timing_stamp (boot_phase phase)
+{
+    return ( phase < TS_MAX ) ? tsc_to_usec( stamps[ phase ] ) : 0;
+}
+
+// probes overlap when the firmware supports async file io, so the
+// caller measures each one and just hands us the result:
+VOID timing_probe_record (UINTN partition, UINT64 ticks)
+{
+    if( n_probes >= MAX_PROBE_TIMES )
+        return;
+
+    probes[ n_probes ].partition = partition;
+    probes[ n_probes ].ticks     = ticks;
+    n_probes++;
+}
+
+EFI_STATUS deadline_start (OUT deadline *d, UINT64 msec)
+{
+    EFI_STATUS res;
+
+    d->timer   = NULL;
+    d->expired = 0;
+
+    res = uefi_call_wrapper( BS->CreateEvent, 5, EVT_TIMER, 0, NULL, NULL,
+                             &d->timer );
+    ERROR_RETURN( res, res, L"deadline: create timer" );
+
+    // timer units are 100ns:
+    res = uefi_call_wrapper( BS->SetTimer, 3, d->timer, TimerRelative,
+                             msec * 10000 );
+    if( res != EFI_SUCCESS )
+        deadline_stop( d );
+    ERROR_RETURN( res, res, L"deadline: set timer" );
+
+    return EFI_SUCCESS;
+}
+
+// a deadline that could not be started never expires:
+UINTN deadline_passed (deadline *d)
+{
+    if( !d || !d->timer )
+        return 0;
+
+    if( !d->expired &&
+        uefi_call_wrapper( BS->CheckEvent, 1, d->timer ) == EFI_SUCCESS )
+        d->expired = 1;
+
+    return d->expired;
+}
+
+// for callers that saw the timer fire via WaitForEvent:
+VOID deadline_fired (deadline *d)
+{
+    if( d )
+        d->expired = 1;
+}
+
+VOID deadline_stop (deadline *d)
+{
+    if( !d || !d->timer )
+        return;
+
+    uefi_call_wrapper( BS->SetTimer, 3, d->timer, TimerCancel, 0 );
+    uefi_call_wrapper( BS->CloseEvent, 1, d->timer );
+    d->timer = NULL;
+}
+
+VOID timing_dump (VOID)
+{
+    Print( L"Chainloader timings (usec since TSC start):\n" );
+    Print( L"  init %lu enum %lu select %lu exec %lu\n",
+           timing_stamp( TS_ENTRY ),
+           timing_stamp( TS_ENUMERATED ),
+           timing_stamp( TS_SELECTED ),
+           timing_stamp( TS_EXEC ) );
+
+    for( UINTN i = 0; i < n_probes; i++ )
+        Print( L"  probe partition #%u: %lu usec\n",
+               probes[ i ].partition, tsc_to_usec( probes[ i ].ticks ) );
+}
+
+static EFI_STATUS publish_string (CHAR16 *name, EFI_GUID *guid, CHAR16 *value)
+{
+    // volatile: these are only meaningful for the current boot and
+    // should not be wearing out anyone's flash:
+    return set_efi_variable( name, guid,
+                             EFI_VARIABLE_BOOTSERVICE_ACCESS |
+                             EFI_VARIABLE_RUNTIME_ACCESS,
+                             StrSize( value ), value );
+}
+
+static EFI_STATUS publish_usec (CHAR16 *name, UINT64 usec)
+{
+    static EFI_GUID loader_guid = LOADER_VENDOR_GUID;
+    CHAR16 str[32];
+
+    if( !usec )
+        return EFI_NOT_READY;
+
+    SPrint( str, sizeof(str), L"%lu", usec );
+
+    return publish_string( name, &loader_guid, str );
+}
+
+EFI_STATUS timing_publish (VOID)
+{
+    static EFI_GUID steamos_guid = STEAMOS_VENDOR_GUID;
+    CHAR16 phases[ TS_MAX * 32 ] = { 0 };
+    CHAR16 breakdown[ MAX_PROBE_TIMES * 24 ] = { 0 };
+    UINTN used = 0;
+    EFI_STATUS res;
+
+    res = publish_usec( L"LoaderTimeInitUSec", timing_stamp( TS_ENTRY ) );
+    WARN_STATUS( res, L"LoaderTimeInitUSec not set" );
+
+    res = publish_usec( L"LoaderTimeExecUSec", timing_stamp( TS_EXEC ) );
+    WARN_STATUS( res, L"LoaderTimeExecUSec not set" );
+
+    SPrint( phases, sizeof(phases), L"init:%lu enum:%lu select:%lu exec:%lu",
+            timing_stamp( TS_ENTRY ),
+            timing_stamp( TS_ENUMERATED ),
+            timing_stamp( TS_SELECTED ),
+            timing_stamp( TS_EXEC ) );
+
+    res = publish_string( L"ChainloaderTimeUSec", &steamos_guid, phases );
+    WARN_STATUS( res, L"ChainloaderTimeUSec not set" );
+
+    // per-partition breakdown: "N:USEC N:USEC ..." in handle order
+    for( UINTN i = 0; i < n_probes; i++ )
+        used += SPrint( breakdown + used,
+                        sizeof(breakdown) - (used * sizeof(CHAR16)),
+                        L"%s%u:%lu", used ? L" " : L"",
+                        probes[ i ].partition,
+                        tsc_to_usec( probes[ i ].ticks ) );
+
+    res = publish_string( L"ChainloaderProbeUSec", &steamos_guid, breakdown );
+    WARN_STATUS( res, L"ChainloaderProbeUSec not set" );
+
+    return res;
+}
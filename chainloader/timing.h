@@ -0,0 +1,75 @@
+// steamos-efi  --  SteamOS EFI Chainloader
+
+// SPDX-License-Identifier: GPL-2.0+
+// Copyright © 2018,2019 Collabora Ltd
+// Copyright © 2018,2019 Valve Corporation
+// Copyright © 2018,2019 Vivek Das Mohapatra <vivek@etla.org>
+
+// steamos-efi is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 2.0 of the License, or
+// (at your option) any later version.
+
+// steamos-efi is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with steamos-efi.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#pragma once
+
+#include <efi.h>
+
+// systemd's loader interface vendor guid: we publish our timestamps
+// in the same format and namespace so systemd-analyze can pick them up:
+#define LOADER_VENDOR_GUID \
+    { 0x4a67b082, 0x0a4c, 0x41cf, {0xb6, 0xc7, 0x44, 0x0b, 0x29, 0xbb, 0x8c, 0x4f} }
+
+#define MAX_PROBE_TIMES 32
+
+// per-probe (batch) deadline and overall selection budget, in ms.
+// Override at build time with eg -DPROBE_TIMEOUT_MS=500
+#ifndef PROBE_TIMEOUT_MS
+#define PROBE_TIMEOUT_MS 3000
+#endif
+
+#ifndef SELECT_BUDGET_MS
+#define SELECT_BUDGET_MS 10000
+#endif
+
+// a one-shot firmware timer. WaitForEvent/CheckEvent reset the signal
+// state of an event, so whether it has ever fired is latched here:
+typedef struct
+{
+    EFI_EVENT timer;
+    UINTN expired;
+} deadline;
+
+typedef enum
+{
+    TS_ENTRY,      // efi_main entered
+    TS_ENUMERATED, // file system handles enumerated
+    TS_SELECTED,   // loader chosen
+    TS_EXEC,       // about to StartImage the loader
+    TS_MAX,
+} boot_phase;
+
+UINT64 read_tsc (VOID);
+UINT64 tsc_to_usec (UINT64 ticks);
+
+VOID timing_init (VOID);
+VOID timing_mark (boot_phase phase);
+UINT64 timing_stamp (boot_phase phase);
+
+VOID timing_probe_record (UINTN partition, UINT64 ticks);
+
+EFI_STATUS deadline_start (OUT deadline *d, UINT64 msec);
+UINTN deadline_passed (deadline *d);
+VOID deadline_fired (deadline *d);
+VOID deadline_stop (deadline *d);
+
+VOID timing_dump (VOID);
+EFI_STATUS timing_publish (VOID);
@@ -24,9 +24,14 @@
 
 #include "err.h"
 #include "util.h"
+#include "arena.h"
+#include "fwtrace.h"
 
-VOID * efi_alloc (UINTN s) { return AllocateZeroPool( s ); }
-VOID   efi_free  (VOID *p) { if( p ) FreePool( p); }
+#if !ALLOC_TRACE
+VOID * efi_alloc     (UINTN s) { return arena_alloc( s, 1 ); }
+VOID * efi_alloc_raw (UINTN s) { return arena_alloc( s, 0 ); }
+VOID   efi_free      (VOID *p) { if( p && !arena_free( p ) ) FreePool( p ); }
+#endif
 
 EFI_HANDLE self_image;
 
@@ -101,7 +106,7 @@ VOID sleep (UINTN seconds)
     if( seconds && (seconds < 60) )
     {
         UINTN musec = 1000000 * seconds;
-        uefi_call_wrapper( BS->Stall, 1, musec );
+        FW_TRACE( L"Stall", 0, uefi_call_wrapper( BS->Stall, 1, musec ) );
     }
 }
 
@@ -109,14 +114,17 @@ EFI_STATUS get_handle_protocol (EFI_HANDLE *handle,
                                 EFI_GUID *id,
                                 OUT VOID **protocol)
 {
-    return uefi_call_wrapper( BS->HandleProtocol, 3, *handle, id, protocol );
+    return FW_TRACE( L"HandleProtocol", 0,
+                     uefi_call_wrapper( BS->HandleProtocol, 3,
+                                        *handle, id, protocol ) );
 }
 
 EFI_STATUS get_protocol_handles (EFI_GUID *guid,
                                  OUT EFI_HANDLE **handles,
                                  OUT UINTN *count)
 {
-    return LibLocateHandle(ByProtocol, guid, NULL, count, handles);
+    return FW_TRACE( L"LocateHandle", *count * sizeof(EFI_HANDLE),
+                     LibLocateHandle(ByProtocol, guid, NULL, count, handles) );
 }
 
 EFI_STATUS get_protocol_instance_handle (EFI_GUID *id,
@@ -148,6 +156,61 @@ EFI_STATUS get_protocol_instance_handle (EFI_GUID *id,
     return EFI_SUCCESS;
 }
 
+EFI_STATUS set_efi_variable (CHAR16 *name,
+                             EFI_GUID *vendor,
+                             UINT32 attr,
+                             UINTN size,
+                             VOID *data)
+{
+    return FW_TRACE( L"SetVariable", size,
+                     uefi_call_wrapper( RT->SetVariable, 5,
+                                        name, vendor, attr, size, data ) );
+}
+
+EFI_STATUS get_efi_variable (CHAR16 *name,
+                             EFI_GUID *vendor,
+                             OUT UINT32 *attr,
+                             IN OUT UINTN *size,
+                             OUT VOID *data)
+{
+    return FW_TRACE( L"GetVariable", *size,
+                     uefi_call_wrapper( RT->GetVariable, 5,
+                                        name, vendor, attr, size, data ) );
+}
+
+// the first hard drive (ie partition) node in a device path, if any:
+HARDDRIVE_DEVICE_PATH * get_partition_node (EFI_DEVICE_PATH *dp)
+{
+    for( ; dp && !IsDevicePathEnd( dp ); dp = NextDevicePathNode( dp ) )
+        if( DevicePathType( dp )    == MEDIA_DEVICE_PATH &&
+            DevicePathSubType( dp ) == MEDIA_HARDDRIVE_DP )
+            return (HARDDRIVE_DEVICE_PATH *) dp;
+
+    return NULL;
+}
+
+// the GPT unique partition guid of a handle - no media access required:
+EFI_STATUS get_partition_guid (EFI_HANDLE handle, OUT EFI_GUID *guid)
+{
+    EFI_GUID dp_guid = DEVICE_PATH_PROTOCOL;
+    EFI_DEVICE_PATH *dp = NULL;
+    HARDDRIVE_DEVICE_PATH *hd = NULL;
+    EFI_STATUS res;
+
+    res = get_handle_protocol( &handle, &dp_guid, (VOID **) &dp );
+    if( res != EFI_SUCCESS )
+        return res;
+
+    hd = get_partition_node( dp );
+
+    if( !hd || hd->SignatureType != SIGNATURE_TYPE_GUID )
+        return EFI_NOT_FOUND;
+
+    CopyMem( guid, &hd->Signature[0], sizeof(EFI_GUID) );
+
+    return EFI_SUCCESS;
+}
+
 EFI_HANDLE get_self_handle (VOID)
 {
     return self_image;
@@ -172,14 +235,14 @@ strwiden (CHAR8 *narrow)
         return NULL;
 
     UINTN l = strlena( narrow ) + 1;
-    CHAR16 *wide = ALLOC_OR_GOTO( l * sizeof(CHAR16), allocfail );
+    CHAR16 *wide = efi_alloc_raw( l * sizeof(CHAR16) );
+
+    if( !wide )
+        return NULL;
 
     for( UINTN i = 0; i < l; i++ )
         wide[ i ] = (CHAR16) narrow[ i ];
     return wide;
-
-allocfail:
-    return NULL;
 }
 
 CHAR8 *
@@ -280,215 +343,54 @@ allocfail:
     efi_free( wide );
     return NULL;
 }
-// ============================================================================
-// EFI sadly has no UTC support so we need to roll our own:
-
-static UINT8 max_month_day (EFI_TIME *time)
-{
-    UINT16 y;
-
-    switch( time->Month )
-    {
-      case 1:  /* Jan */
-      case 3:  /* Mar */
-      case 5:  /* May */
-      case 7:  /* Jul */
-      case 8:  /* Aug */
-      case 10: /* Oct */
-      case 12: /* Dec */
-        return 31;
-
-      case 4:  /* Apr */
-      case 6:  /* Jun */
-      case 9:  /* Sep */
-      case 11: /* Nov */
-        return 30;
-
-      case 2:  /* Feb */
-        y = time->Year;
-        // leap years divisible by 4 BUT centuries must also be div by 400:
-        //       not-div-100  not-div-4             not-div-400
-        return ( (y % 100) ? ((y % 4) ? 28 : 29) : ((y % 400) ? 28 : 29) );
-
-      default:
-        return 0;
-    }
-}
-
-static inline void incr_month (EFI_TIME *time)
-{
-    if( time->Month == 12 )
-    {
-        time->Month = 1;
-        time->Year++;
-        return;
-    }
-
-    time->Month++;
-}
 
-static inline void incr_day (EFI_TIME *time)
+// the value of hex digit c, or -1 if it isn't one:
+INTN hexval (CHAR8 c)
 {
-    if( time->Day == max_month_day( time ) )
-    {
-        time->Day = 1;
-        incr_month( time );
-        return;
-    }
-
-    time->Day++;
+    if( c >= '0' && c <= '9' )
+        return c - '0';
+    if( c >= 'a' && c <= 'f' )
+        return c - 'a' + 10;
+    if( c >= 'A' && c <= 'F' )
+        return c - 'A' + 10;
+    return -1;
 }
 
-static inline void incr_hour (EFI_TIME *time)
+// parse an xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx guid (as printed by blkid
+// et al) into the mixed-endian EFI_GUID layout: returns the number of
+// characters consumed, or 0 if str does not start with a valid guid:
+UINTN parse_guid (CONST CHAR8 *str, OUT EFI_GUID *guid)
 {
-    if( time->Hour == 23 )
+    // hex digits per group: the first three groups are little endian
+    // numbers in the EFI_GUID, the last two are stored byte by byte
+    static CONST UINTN group[] = { 8, 4, 4, 4, 12 };
+    UINT8 bytes[16];
+    UINTN b = 0;
+    UINTN c = 0;
+
+    for( UINTN g = 0; g < sizeof(group) / sizeof(group[0]); g++ )
     {
-        time->Hour = 0;
-        incr_day( time );
-        return;
-    }
-
-    time->Hour++;
-}
-
-static inline void incr_minute (EFI_TIME *time)
-{
-    if( time->Minute == 59 )
-    {
-        time->Minute = 0;
-        incr_hour( time );
-        return;
-    }
+        if( g > 0 && str[ c++ ] != '-' )
+            return 0;
 
-    time->Minute++;
-}
-
-static inline void decr_month (EFI_TIME *time)
-{
-    if( time->Month == 1 )
-    {
-        time->Month = 12;
-        time->Year--;
-        return;
-    }
-
-    time->Month--;
-}
-
-static inline void decr_day (EFI_TIME *time)
-{
-    if( time->Day == 1 )
-    {
-        decr_month( time );
-        time->Day = max_month_day( time );
-        return;
-    }
-
-    time->Day--;
-}
-
-static inline void decr_hour (EFI_TIME *time)
-{
-    if( time->Hour == 0 )
-    {
-        time->Hour = 23;
-        decr_day( time );
-        return;
-    }
+        for( UINTN i = 0; i < group[ g ]; i += 2 )
+        {
+            INTN hi = hexval( str[ c ] );
+            INTN lo = ( hi < 0 ) ? -1 : hexval( str[ c + 1 ] );
 
-    time->Hour--;
-}
+            if( lo < 0 )
+                return 0;
 
-static inline void decr_minute (EFI_TIME *time)
-{
-    if( time->Minute == 0 )
-    {
-        time->Minute = 59;
-        decr_hour( time );
-        return;
+            bytes[ b++ ] = (UINT8)( ( hi << 4 ) | lo );
+            c += 2;
+        }
     }
 
-    time->Minute--;
-}
-
-// UTC = now + now.zone
-// now.zoneis ± 24 hours (1440 minutes)
-static VOID efi_time_to_utc (EFI_TIME *time)
-{
-
-    if( time->TimeZone == EFI_UNSPECIFIED_TIMEZONE )
-        return;
-
-    if( time->TimeZone > 0 )
-        for (; time->TimeZone; time->TimeZone--)
-            incr_minute( time );
-    else if( time->TimeZone < 0 )
-        for (; time->TimeZone; time->TimeZone++)
-            decr_minute( time );
-}
-
-UINT64 local_datestamp (VOID)
-{
-    EFI_TIME now = { 0 };
-    EFI_STATUS res = uefi_call_wrapper( RT->GetTime, 2, &now, NULL );
-
-    if( res != EFI_SUCCESS )
-        return 0;
-
-    // number of form: YYYY mm DD HH MM SS
-    return ( now.Second                 +
-             (now.Minute * 100)         +
-             (now.Hour   * 10000)       +
-             (now.Day    * 1000000)     +
-             (now.Month  * 100000000)   +
-             (now.Year   * 10000000000) );
-}
-
-UINT64 utc_datestamp (VOID)
-{
-    EFI_TIME now = { 0 };
-    EFI_STATUS res = uefi_call_wrapper( RT->GetTime, 2, &now, NULL );
-
-    if( res != EFI_SUCCESS )
-        return 0;
-
-    efi_time_to_utc( &now );
-
-    // number of form: YYYY mm DD HH MM SS
-    return ( now.Second                 +
-             (now.Minute * 100)         +
-             (now.Hour   * 10000)       +
-             (now.Day    * 1000000)     +
-             (now.Month  * 100000000)   +
-             (now.Year   * 10000000000) );
-}
-
-UINT64 local_timestamp (VOID)
-{
-    EFI_TIME now = { 0 };
-    EFI_STATUS res = uefi_call_wrapper( RT->GetTime, 2, &now, NULL );
-
-    if( res != EFI_SUCCESS )
-        return 0;
-
-    // number of form: YYYY mm DD HH MM SS
-    return ( now.Second           +
-             (now.Minute * 100)   +
-             (now.Hour   * 10000) );
-}
-
-UINT64 utc_timestamp (VOID)
-{
-    EFI_TIME now = { 0 };
-    EFI_STATUS res = uefi_call_wrapper( RT->GetTime, 2, &now, NULL );
-
-    if( res != EFI_SUCCESS )
-        return 0;
-
-    efi_time_to_utc( &now );
+    guid->Data1 = ( (UINT32) bytes[0] << 24 ) | ( (UINT32) bytes[1] << 16 ) |
+                  ( (UINT32) bytes[2] <<  8 ) |   (UINT32) bytes[3];
+    guid->Data2 = (UINT16)( ( bytes[4] << 8 ) | bytes[5] );
+    guid->Data3 = (UINT16)( ( bytes[6] << 8 ) | bytes[7] );
+    CopyMem( &guid->Data4[0], &bytes[8], 8 );
 
-    // number of form: YYYY mm DD HH MM SS
-    return ( now.Second           +
-             (now.Minute * 100)   +
-             (now.Hour   * 10000) );
+    return c;
 }
@@ -22,6 +22,7 @@
 
 #ifndef NO_EFI_TYPES
 #include <efi.h>
+#include "alloctrace.h"
 #else
 #include "bootconf/efi.h"
 #endif
@@ -41,9 +42,32 @@
 #define STEAMOSLDR  GRUBLDR
 #define CHAINLDR    EFIDIR L"\\Shell\\steamcl.efi"
 
+// vendor guid for the EFI variables the chainloader publishes/consumes:
+#define STEAMOS_VENDOR_GUID \
+    { 0xb08b02b9, 0xbde7, 0x47a8, {0xb5, 0xae, 0x90, 0xf5, 0x34, 0x1c, 0x0c, 0xe3} }
+
 #ifndef NO_EFI_TYPES
-VOID * efi_alloc (IN UINTN s);
-VOID   efi_free  (IN VOID *p);
+// functions the firmware calls directly (protocol members, AP procedures)
+// must use the firmware calling convention, but gnu-efi's EFIAPI is only
+// ms_abi when built with GNU_EFI_USE_MS_ABI:
+#if defined(__x86_64__) && !defined(GNU_EFI_USE_MS_ABI)
+#define EFI_CALLBACK __attribute__((ms_abi))
+#else
+#define EFI_CALLBACK EFIAPI
+#endif
+
+// efi_alloc'd memory is zeroed, efi_alloc_raw'd memory is not:
+#if ALLOC_TRACE
+#define efi_alloc(s) \
+    alloc_trace_alloc( s, 1, (CONST CHAR8 *) __FILE__, __LINE__ )
+#define efi_alloc_raw(s) \
+    alloc_trace_alloc( s, 0, (CONST CHAR8 *) __FILE__, __LINE__ )
+#define efi_free(p)      alloc_trace_free( p )
+#else
+VOID * efi_alloc     (IN UINTN s);
+VOID * efi_alloc_raw (IN UINTN s);
+VOID   efi_free      (IN VOID *p);
+#endif
 
 CONST CHAR16 * efi_statstr (EFI_STATUS s);
 CONST CHAR16 * efi_memtypestr (EFI_MEMORY_TYPE m);
@@ -60,6 +84,21 @@ EFI_STATUS get_protocol_instance_handle (EFI_GUID *id,
                                          VOID *protocol,
                                          OUT EFI_HANDLE *handle);
 
+EFI_STATUS set_efi_variable (CHAR16 *name,
+                             EFI_GUID *vendor,
+                             UINT32 attr,
+                             UINTN size,
+                             VOID *data);
+
+EFI_STATUS get_efi_variable (CHAR16 *name,
+                             EFI_GUID *vendor,
+                             OUT UINT32 *attr,
+                             IN OUT UINTN *size,
+                             OUT VOID *data);
+
+HARDDRIVE_DEVICE_PATH * get_partition_node (EFI_DEVICE_PATH *dp);
+EFI_STATUS get_partition_guid (EFI_HANDLE handle, OUT EFI_GUID *guid);
+
 EFI_DEVICE_PATH * make_absolute_device_path (EFI_HANDLE device, CHAR16 *path);
 EFI_HANDLE get_self_handle (VOID);
 VOID initialise (EFI_HANDLE image, UINTN verbose);
@@ -70,9 +109,11 @@ CHAR8  *strnarrow (CHAR16 *wide);
 
 CHAR16 *resolve_path (CONST VOID *path, CONST CHAR16* relative_to, UINTN widen);
 
+INTN hexval (CHAR8 c);
+
+#ifndef NO_EFI_TYPES
+UINTN parse_guid (CONST CHAR8 *str, OUT EFI_GUID *guid);
+#endif
+
 VOID sleep (UINTN seconds);
 
-UINT64 local_datestamp (VOID);
-UINT64 utc_datestamp (VOID);
-UINT64 local_timestamp (VOID);
-UINT64 utc_timestamp (VOID);